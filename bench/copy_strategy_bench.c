@@ -0,0 +1,393 @@
+/*
+ * Offline benchmark of copy read strategies.
+ * Runs copy procedure on simulated devices with synthetic defect layouts,
+ * in modeled time, and reports how fast and how gently each strategy recovers data.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "libdevcheck.h"
+#include "procedure.h"
+#include "sim_device.h"
+
+typedef struct range {
+    uint64_t begin_lba;
+    uint64_t end_lba;
+} Range;
+
+typedef struct layout {
+    const char *name;
+    uint64_t capacity;  // In sectors
+    Range *bad;  // Sorted, non-overlapping
+    int nb_bad;
+    char *extra_spec;  // Spec lines besides capacity and bad ranges
+    const char *spec_path;  // Spec given by user, used as is
+} Layout;
+
+typedef struct rng {
+    uint64_t state;
+} Rng;
+
+static uint64_t rng_next(Rng *rng) {
+    // xorshift64*
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 2685821657736338717ULL;
+}
+
+static uint64_t rng_range(Rng *rng, uint64_t begin, uint64_t end) {
+    return begin + rng_next(rng) % (end - begin);
+}
+
+static void add_bad(Layout *layout, uint64_t lba, uint64_t sectors) {
+    if (lba >= layout->capacity)
+        return;
+    if (lba + sectors > layout->capacity)
+        sectors = layout->capacity - lba;
+    layout->bad = realloc(layout->bad, (layout->nb_bad + 1) * sizeof(Range));
+    assert(layout->bad);
+    layout->bad[layout->nb_bad++] = (Range){ .begin_lba = lba, .end_lba = lba + sectors };
+}
+
+static void add_extra_spec(Layout *layout, const char *fmt, uint64_t a, uint64_t b, unsigned c) {
+    char line[100];
+    snprintf(line, sizeof(line), fmt, a, b, c);
+    size_t len = layout->extra_spec ? strlen(layout->extra_spec) : 0;
+    layout->extra_spec = realloc(layout->extra_spec, len + strlen(line) + 1);
+    assert(layout->extra_spec);
+    strcpy(layout->extra_spec + len, line);
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    const Range *ra = a;
+    const Range *rb = b;
+    return (ra->begin_lba > rb->begin_lba) - (ra->begin_lba < rb->begin_lba);
+}
+
+static void normalize_bad(Layout *layout) {
+    int nb_merged = 0;
+    qsort(layout->bad, layout->nb_bad, sizeof(Range), compare_ranges);
+    for (int i = 0; i < layout->nb_bad; i++) {
+        if (nb_merged && layout->bad[i].begin_lba <= layout->bad[nb_merged - 1].end_lba) {
+            if (layout->bad[i].end_lba > layout->bad[nb_merged - 1].end_lba)
+                layout->bad[nb_merged - 1].end_lba = layout->bad[i].end_lba;
+        } else {
+            layout->bad[nb_merged++] = layout->bad[i];
+        }
+    }
+    layout->nb_bad = nb_merged;
+}
+
+static void gen_clean(Layout *layout, Rng *rng) {
+    (void)layout;
+    (void)rng;
+}
+
+// Isolated bad sectors all over the surface
+static void gen_scattered(Layout *layout, Rng *rng) {
+    for (int i = 0; i < 200; i++)
+        add_bad(layout, rng_range(rng, 0, layout->capacity), 1);
+}
+
+// Clusters of bad sectors along a scratch in one area
+static void gen_scratch(Layout *layout, Rng *rng) {
+    uint64_t begin = layout->capacity / 10 * 4;
+    uint64_t end = begin + layout->capacity / 200;
+    for (int i = 0; i < 300; i++)
+        add_bad(layout, rng_range(rng, begin, end), rng_range(rng, 1, 65));
+}
+
+// Area which reads slowly and has many bad sectors
+static void gen_degraded(Layout *layout, Rng *rng) {
+    uint64_t begin = layout->capacity / 10 * 7;
+    uint64_t length = layout->capacity / 50;
+    add_extra_spec(layout, "slow %"PRIu64" %"PRIu64" %u\n", begin, length, 20);
+    for (int i = 0; i < 1000; i++)
+        add_bad(layout, rng_range(rng, begin, begin + length), rng_range(rng, 1, 9));
+}
+
+// Weak head: a band of each cylinder group is unreadable, over whole disk
+static void gen_head(Layout *layout, Rng *rng) {
+    uint64_t period = layout->capacity / 2000;
+    if (period < 4096)
+        period = 4096;
+    for (uint64_t lba = rng_range(rng, 0, period); lba < layout->capacity; lba += period)
+        add_bad(layout, lba, period / 16);
+}
+
+static const struct {
+    const char *name;
+    void (*generate)(Layout *layout, Rng *rng);
+} generators[] = {
+    { "clean", gen_clean },
+    { "scattered", gen_scattered },
+    { "scratch", gen_scratch },
+    { "degraded", gen_degraded },
+    { "head", gen_head },
+};
+#define NB_GENERATORS (int)(sizeof(generators) / sizeof(generators[0]))
+
+// Only bad ranges are read from user spec, for statistics; device itself is simulated by libdevcheck
+static int layout_load(Layout *layout, const char *path) {
+    char line[200];
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 1;
+    memset(layout, 0, sizeof(*layout));
+    layout->name = path;
+    layout->spec_path = path;
+    while (fgets(line, sizeof(line), f)) {
+        uint64_t a, b;
+        if (sscanf(line, " capacity %"SCNu64, &a) == 1)
+            layout->capacity = a;
+        else if (sscanf(line, " bad %"SCNu64" %"SCNu64, &a, &b) == 2)
+            add_bad(layout, a, b);
+    }
+    fclose(f);
+    normalize_bad(layout);
+    return 0;
+}
+
+// Returns path of temporary file, to be unlinked
+static char *layout_write_spec(Layout *layout) {
+    char *path = strdup("/tmp/whdd-bench-XXXXXX");
+    assert(path);
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        free(path);
+        return NULL;
+    }
+    FILE *f = fdopen(fd, "w");
+    assert(f);
+    fprintf(f, SIM_DEVICE_MAGIC "\n");
+    fprintf(f, "capacity %"PRIu64"\n", layout->capacity);
+    fprintf(f, "data no\n");
+    for (int i = 0; i < layout->nb_bad; i++)
+        fprintf(f, "bad %"PRIu64" %"PRIu64"\n", layout->bad[i].begin_lba, layout->bad[i].end_lba - layout->bad[i].begin_lba);
+    if (layout->extra_spec)
+        fputs(layout->extra_spec, f);
+    fclose(f);
+    return path;
+}
+
+static const double milestones[] = { 0.5, 0.9, 0.99, 0.999 };
+#define NB_MILESTONES (int)(sizeof(milestones) / sizeof(milestones[0]))
+
+typedef struct run_stats {
+    Layout *layout;
+    uint64_t margin;  // Reads closer than this to bad range count as near defects
+    uint64_t readable;  // Sectors not in bad ranges
+    uint64_t time;  // Modeled, mcs
+    uint64_t head_lba;
+    uint64_t seek_distance;  // In sectors
+    uint64_t nb_seeks;
+    uint64_t nb_reads;
+    uint64_t nb_near_defects;
+    uint64_t nb_errors;
+    uint64_t recovered;  // In sectors
+    uint64_t milestone_time[NB_MILESTONES];
+    int nb_milestones_reached;
+} RunStats;
+
+static int is_near_defect(RunStats *stats, uint64_t lba, uint64_t sectors) {
+    Layout *layout = stats->layout;
+    int lo = 0;
+    int hi = layout->nb_bad;
+    // First bad range ending after beginning of read, with margin
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (layout->bad[mid].end_lba + stats->margin <= lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < layout->nb_bad && layout->bad[lo].begin_lba < lba + sectors + stats->margin;
+}
+
+static void account_report(RunStats *stats, DC_BlockReport *report) {
+    if (!report->sectors_processed)
+        return;
+    stats->time += report->blk_access_time;
+    if (report->lba != stats->head_lba) {
+        stats->nb_seeks++;
+        stats->seek_distance += report->lba > stats->head_lba ? report->lba - stats->head_lba : stats->head_lba - report->lba;
+    }
+    stats->head_lba = report->lba + report->sectors_processed;
+    stats->nb_reads++;
+    if (is_near_defect(stats, report->lba, report->sectors_processed))
+        stats->nb_near_defects++;
+    if (report->blk_status) {
+        stats->nb_errors++;
+    } else {
+        stats->recovered += report->sectors_processed;
+        while (stats->nb_milestones_reached < NB_MILESTONES
+                && stats->recovered >= milestones[stats->nb_milestones_reached] * stats->readable)
+            stats->milestone_time[stats->nb_milestones_reached++] = stats->time;
+    }
+}
+
+static int report_cb(DC_ProcedureCtx *ctx, void *callback_priv) {
+    for (int i = 0; i < ctx->nb_reports; i++)
+        account_report(callback_priv, &ctx->reports[i]);
+    return 0;
+}
+
+static int run(Layout *layout, const char *spec_path, const char *strategy, int64_t skip_blocks, uint64_t margin) {
+    DC_DevList *list = calloc(1, sizeof(*list));
+    assert(list);
+    DC_Dev *dev = dc_dev_list_add_image(list, spec_path);
+    if (!dev) {
+        dc_dev_list_free(list);
+        return 1;
+    }
+    char skip_blocks_str[32];
+    snprintf(skip_blocks_str, sizeof(skip_blocks_str), "%"PRId64, skip_blocks);
+    DC_OptionSetting options[] = {
+        { "api", (char*)"posix" },
+        { "read_strategy", (char*)strategy },
+        { "dst_file", (char*)"/dev/null" },
+        { "use_journal", (char*)"no" },
+        { "skip_blocks", skip_blocks_str },
+        { NULL }
+    };
+    DC_ProcedureCtx *ctx;
+    int r = dc_procedure_open(dc_find_procedure("copy"), dev, &ctx, options);
+    if (r) {
+        fprintf(stderr, "Failed to start copy with strategy %s\n", strategy);
+        dc_dev_list_free(list);
+        return 1;
+    }
+
+    RunStats stats = { .layout = layout, .margin = margin, .readable = layout->capacity };
+    for (int i = 0; i < layout->nb_bad; i++)
+        stats.readable -= layout->bad[i].end_lba - layout->bad[i].begin_lba;
+    // Strategies stop with error when they give up on remaining space, that's not our failure
+    dc_procedure_perform_loop(ctx, report_cb, &stats);
+    dc_procedure_close(ctx);
+    int sector_size = dev->logical_sector_size;
+    dc_dev_list_free(list);
+
+    printf("%-10.10s %-18s %6s %10.1f %9.1f %7"PRIu64" %8"PRIu64" %8"PRIu64" %7"PRIu64" %8.3f%%",
+            layout->name, strategy, strstr(strategy, "skipfail") ? skip_blocks_str : "-",
+            stats.time / 1e6, stats.seek_distance * sector_size / 1e9, stats.nb_seeks, stats.nb_reads,
+            stats.nb_near_defects, stats.nb_errors, stats.readable ? 100.0 * stats.recovered / stats.readable : 100.0);
+    for (int i = 0; i < NB_MILESTONES; i++) {
+        if (i < stats.nb_milestones_reached)
+            printf(" %9.1f", stats.milestone_time[i] / 1e6);
+        else
+            printf(" %9s", "-");
+    }
+    printf("\n");
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [options] [simulated device spec]...\n"
+            "Runs copy read strategies on simulated devices and reports modeled efficiency.\n"
+            "  -c GIB        capacity of generated devices, GiB (default 64)\n"
+            "  -l LIST       comma-separated generated layouts: clean,scattered,scratch,degraded,head (default all;\n"
+            "                none if spec files are given)\n"
+            "  -s LIST       comma-separated strategies (default all)\n"
+            "  -k LIST       comma-separated skip_blocks values for skipfail* strategies (default 5000)\n"
+            "  -m SECTORS    distance to bad range for read to count as near defect (default 2048)\n"
+            "  -r SEED       random seed for layouts (default 1)\n"
+            "  -v            show libdevcheck log\n"
+            "Columns: modeled time and seek distance; numbers of seeks, reads, reads near defects, failed reads;\n"
+            "share of readable sectors recovered; modeled seconds until 50%%, 90%%, 99%%, 99.9%% were recovered.\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    uint64_t capacity_gib = 64;
+    char *layouts_str = NULL;
+    char *strategies_str = strdup("plain,smart,smart_noreverse,skipfail,skipfail_noreverse");
+    char *skip_blocks_str = strdup("5000");
+    uint64_t margin = 2048;
+    uint64_t seed = 1;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:l:s:k:m:r:vh")) != -1) {
+        switch (opt) {
+            case 'c': capacity_gib = strtoull(optarg, NULL, 0); break;
+            case 'l': layouts_str = strdup(optarg); break;
+            case 's': free(strategies_str); strategies_str = strdup(optarg); break;
+            case 'k': free(skip_blocks_str); skip_blocks_str = strdup(optarg); break;
+            case 'm': margin = strtoull(optarg, NULL, 0); break;
+            case 'r': seed = strtoull(optarg, NULL, 0); break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!capacity_gib) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!layouts_str && optind == argc)
+        layouts_str = strdup("clean,scattered,scratch,degraded,head");
+
+    int r = dc_init();
+    assert(!r);
+    dc_log_set_level(verbose ? DC_LOG_DEBUG : DC_LOG_QUIET);
+
+    int nb_layouts = 0;
+    Layout layouts[NB_GENERATORS + argc];
+    char *saveptr;
+    for (char *name = layouts_str ? strtok_r(layouts_str, ",", &saveptr) : NULL; name; name = strtok_r(NULL, ",", &saveptr)) {
+        int i;
+        for (i = 0; i < NB_GENERATORS && strcmp(name, generators[i].name); i++)
+            ;
+        if (i == NB_GENERATORS) {
+            fprintf(stderr, "Unknown layout %s\n", name);
+            return 1;
+        }
+        Layout *layout = &layouts[nb_layouts++];
+        Rng rng = { .state = seed * 0x9E3779B97F4A7C15ULL + i + 1 };
+        memset(layout, 0, sizeof(*layout));
+        layout->name = generators[i].name;
+        layout->capacity = capacity_gib * 1024 * 1024 * 2;
+        generators[i].generate(layout, &rng);
+        normalize_bad(layout);
+    }
+    for (int i = optind; i < argc; i++) {
+        if (layout_load(&layouts[nb_layouts], argv[i])) {
+            fprintf(stderr, "Cannot read %s\n", argv[i]);
+            return 1;
+        }
+        nb_layouts++;
+    }
+
+    printf("%-10s %-18s %6s %10s %9s %7s %8s %8s %7s %9s %9s %9s %9s %9s\n",
+            "layout", "strategy", "skip", "time,s", "seek,GB", "seeks", "reads", "near_def", "errors",
+            "recovered", "t50%,s", "t90%,s", "t99%,s", "t99.9%,s");
+    for (int l = 0; l < nb_layouts; l++) {
+        Layout *layout = &layouts[l];
+        char *spec_path = layout->spec_path ? NULL : layout_write_spec(layout);
+        if (!layout->spec_path && !spec_path) {
+            fprintf(stderr, "Cannot write temporary spec file\n");
+            return 1;
+        }
+        char *strategies = strdup(strategies_str);
+        for (char *strategy = strtok_r(strategies, ",", &saveptr); strategy; strategy = strtok_r(NULL, ",", &saveptr)) {
+            char *skip_list = strdup(skip_blocks_str);
+            char *skip_saveptr;
+            for (char *skip = strtok_r(skip_list, ",", &skip_saveptr); skip; skip = strtok_r(NULL, ",", &skip_saveptr)) {
+                run(layout, layout->spec_path ? layout->spec_path : spec_path, strategy, strtoll(skip, NULL, 0), margin);
+                if (!strstr(strategy, "skipfail"))
+                    break;  // Other strategies don't use skip_blocks
+            }
+            free(skip_list);
+        }
+        free(strategies);
+        if (spec_path) {
+            unlink(spec_path);
+            free(spec_path);
+        }
+    }
+    dc_finish();
+    return 0;
+}
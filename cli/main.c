@@ -4,15 +4,20 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <unistd.h>
+#include <poll.h>
 #include "libdevcheck.h"
 #include "device.h"
 #include "procedure.h"
 #include "utils.h"
+#include "hotplug.h"
+#include "smart_sampler.h"
+#include "watchdog.h"
 #include "ui_mutual.h"
 
 static int proc_render_cb(DC_ProcedureCtx *ctx, void *callback_priv);
 DC_Procedure *request_and_get_cli_action();
-DC_Dev *request_and_get_device();
+DC_Dev *request_and_get_device(DC_DevList *devlist, DC_Hotplug *hotplug);
 
 static int ask_option_value(DC_OptionSetting *setting, DC_ProcedureOption *option) {
     char *suggested_value = setting->value;
@@ -41,7 +46,7 @@ static int ask_option_value(DC_OptionSetting *setting, DC_ProcedureOption *optio
     return 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
     printf(WHDD_ABOUT);
     printf("\nATTENTION! whdd-cli utility is purposed for development debugging, and as a fallback if whdd utility somehow fails to work. In other cases, consider using whdd utility, which should provide better usage experience.\n");
     int r;
@@ -52,18 +57,28 @@ int main() {
     // get list of devices
     DC_DevList *devlist = dc_dev_list();
     assert(devlist);
+    dc_dev_list_update(devlist, UI_DEV_LIST_FIRST_WAIT_MS);
+    DC_Hotplug *hotplug = dc_hotplug_open();
+    // Image files given in command line are shown as devices
+    for (int i = 1; i < argc; i++)
+        if (!dc_dev_list_add_image(devlist, argv[i]))
+            return 1;
     // show list of devices
-    if (dc_dev_list_size(devlist) == 0) {
+    if (dc_dev_list_size(devlist) == 0 && !hotplug) {
         printf("No devices found, go buy some :)\n");
         return 0;
     }
 
     while (1) {
-        DC_Dev *chosen_dev = request_and_get_device();
+        DC_Dev *chosen_dev = request_and_get_device(devlist, hotplug);
         if (!chosen_dev) {
             printf("Invalid choice\n");
             break;
         }
+        if (dc_dev_wait_probed(chosen_dev, DC_DEV_PROBE_TIMEOUT_MS)) {
+            printf("Device %s doesn't respond\n", chosen_dev->dev_path);
+            continue;
+        }
         DC_Procedure *act = request_and_get_cli_action();
         if (!act)
             break;
@@ -117,15 +132,30 @@ int main() {
 
 static int proc_render_cb(DC_ProcedureCtx *ctx, void *callback_priv) {
     (void)callback_priv;
-    if (ctx->progress.num == 1) {  // TODO eliminate such hacks
+    if (ctx->progress.num == (uint64_t)ctx->nb_reports) {  // TODO eliminate such hacks
         printf("on device '%s' with block size of %"PRIu64" bytes\n",
                 ctx->dev->dev_fs_name, ctx->blk_size);
     }
-    printf("LBA #%"PRIu64" %s in %"PRIu64" mcs. Progress %"PRIu64"/%"PRIu64"\n",
-            ctx->report.lba,
-            ctx->report.blk_status == 0 ? "OK" : "FAILED",
-            ctx->report.blk_access_time,
-            ctx->progress.num, ctx->progress.den);
+    for (int i = 0; i < ctx->nb_reports; i++)
+        printf("LBA #%"PRIu64" %s in %"PRIu64" mcs. Progress %"PRIu64"/%"PRIu64"\n",
+                ctx->reports[i].lba,
+                ctx->reports[i].blk_status == 0 ? "OK" : "FAILED",
+                ctx->reports[i].blk_access_time,
+                ctx->progress.num - ctx->nb_reports + i + 1, ctx->progress.den);
+    for (int i = 0; i < ctx->nb_smart_events; i++)
+        printf("SMART %s changed by %+"PRId64" to %"PRIu64" near LBA #%"PRIu64"\n",
+                dc_smart_attr_name(ctx->smart_events[i].id), ctx->smart_events[i].delta,
+                ctx->smart_events[i].raw, ctx->smart_events[i].lba);
+    for (int i = 0; i < ctx->nb_watchdog_events; i++) {
+        DC_WatchdogEvent *event = &ctx->watchdog_events[i];
+        if (event->action == DC_WatchdogAction_eReopen)
+            printf("Watchdog: %s %s, resuming at LBA #%"PRIu64"\n", dc_watchdog_action_name(event->action),
+                    event->failed ? "FAILED" : "done", event->lba);
+        else
+            printf("Watchdog: %s %s, command at LBA #%"PRIu64" stuck for %"PRIu64" ms\n",
+                    dc_watchdog_action_name(event->action), event->failed ? "FAILED" : "done",
+                    event->lba, event->stuck_ms);
+    }
     fflush(stdout);
     return 0;
 }
@@ -154,17 +184,46 @@ DC_Procedure *request_and_get_cli_action() {
     return dc_get_procedure_by_index(chosen_action_ind);
 }
 
-DC_Dev *request_and_get_device() {
-    int i;
-    DC_DevList *devlist = dc_dev_list();
-    int devs_num = dc_dev_list_size(devlist);
-    printf("\nChoose device by #:\n");
-    for (i = 0; i < devs_num; i++) {
-        DC_Dev *dev = dc_dev_list_get_entry(devlist, i);
-        char descr_buf[80];
-        ui_dev_descr_format(descr_buf, sizeof(descr_buf), dev);
-        printf("#%d: %s %s\n", i, dev->dev_fs_name, descr_buf);
+// Returns 1 if device list has changed before user started typing, 0 if input is ready
+static int wait_for_dev_list_change(DC_DevList *devlist, DC_Hotplug *hotplug) {
+    // With piped input, stdio may hold buffered lines which poll() doesn't see
+    if (!isatty(STDIN_FILENO))
+        return 0;
+    int nb_pending = dc_dev_list_update(devlist, 0);
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = hotplug ? hotplug->fd : -1, .events = POLLIN },
+    };
+    while (1) {
+        // Probe results are not signalled, so they are checked periodically
+        int r = poll(fds, 2, nb_pending ? 100 : -1);
+        if (r == -1 && errno != EINTR)
+            return 0;
+        if (fds[0].revents)
+            return 0;
+        if (fds[1].revents && dc_hotplug_handle_events(hotplug, devlist))
+            return 1;
+        if (nb_pending && dc_dev_list_update(devlist, 0) < nb_pending)
+            return 1;
     }
+}
+
+DC_Dev *request_and_get_device(DC_DevList *devlist, DC_Hotplug *hotplug) {
+    int i;
+    int devs_num;
+    do {
+        // Show details which have arrived since last time
+        dc_dev_list_update(devlist, 0);
+        devs_num = dc_dev_list_size(devlist);
+        printf("\nChoose device by #:\n");
+        for (i = 0; i < devs_num; i++) {
+            DC_Dev *dev = dc_dev_list_get_entry(devlist, i);
+            char descr_buf[80];
+            ui_dev_descr_format(descr_buf, sizeof(descr_buf), dev);
+            printf("#%d: %s %s\n", i, dev->dev_fs_name, descr_buf);
+        }
+        fflush(stdout);
+    } while (wait_for_dev_list_change(devlist, hotplug));
     char input[10];
     int chosen_dev_ind;
     char *char_ret = fgets(input, sizeof(input), stdin);
@@ -0,0 +1 @@
+#define HAVE_CLOCK_MONOTONIC_RAW
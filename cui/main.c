@@ -19,10 +19,14 @@
 #include "ncurses_convenience.h"
 #include "render.h"
 #include "ui_mutual.h"
+#include "hotplug.h"
+
+// Device menu returns this often while nobody touches it, to be redrawn with attached devices and probe results
+#define DEVICE_MENU_REFRESH_SECS 1
 
 static int global_init(void);
 static void global_fini(void);
-static DC_Dev *menu_choose_device(DC_DevList *devlist);
+static DC_Dev *menu_choose_device(DC_DevList *devlist, DC_Hotplug *hotplug);
 static DC_Procedure *menu_choose_procedure(DC_Dev *dev);
 void log_cb(void *priv, enum DC_LogLevel level, const char* fmt, va_list vl);
 
@@ -95,7 +99,7 @@ static int ask_option_value(DC_Procedure *act, DC_OptionSetting *setting, DC_Pro
     return 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
     int r;
     r = global_init();
     if (r) {
@@ -105,13 +109,30 @@ int main() {
     // get list of devices
     DC_DevList *devlist = dc_dev_list();
     assert(devlist);
+    dc_dev_list_update(devlist, UI_DEV_LIST_FIRST_WAIT_MS);
+    DC_Hotplug *hotplug = dc_hotplug_open();
+    // Image files given in command line are shown as devices
+    for (int i = 1; i < argc; i++) {
+        if (!dc_dev_list_add_image(devlist, argv[i])) {
+            global_fini();
+            fprintf(stderr, "Cannot use %s as image file\n", argv[i]);
+            return 1;
+        }
+    }
 
     while (1) {
         // draw menu of device choice
-        DC_Dev *chosen_dev = menu_choose_device(devlist);
+        DC_Dev *chosen_dev = menu_choose_device(devlist, hotplug);
         if (!chosen_dev) {
             break;
         }
+        if (chosen_dev->probe_state != DC_DevProbeState_eDone) {
+            dialog_msgbox("Info", "Waiting for device to answer", 0, 0, 0 /* non-pausing */);
+            if (dc_dev_wait_probed(chosen_dev, DC_DEV_PROBE_TIMEOUT_MS)) {
+                dialog_msgbox("Error", "Device doesn't respond", 0, 0, 1);
+                continue;
+            }
+        }
         // draw procedures menu
         DC_Procedure *act = menu_choose_procedure(chosen_dev);
         if (!act)
@@ -216,30 +237,71 @@ static void global_fini(void) {
     endwin();
 }
 
-static DC_Dev *menu_choose_device(DC_DevList *devlist) {
-    int devs_num = dc_dev_list_size(devlist);
-    if (devs_num == 0) {
-        dialog_msgbox("Info", "No devices found", 0, 0, 1);
-        return NULL;
-    }
-    char *items[2 * devs_num];
+static DC_Dev *menu_choose_device(DC_DevList *devlist, DC_Hotplug *hotplug) {
+    char *selected_name = NULL;
+    int devs_num;
+    int ret;
     int i;
-    for (i = 0; i < devs_num; i++) {
-        DC_Dev *dev = dc_dev_list_get_entry(devlist, i);
-        char dev_descr_buf[80];
-        ui_dev_descr_format(dev_descr_buf, sizeof(dev_descr_buf), dev);
-        items[2*i] = dev->dev_fs_name;
-        items[2*i+1] = strdup(dev_descr_buf);
-    }
+    while (1) {
+        // Attached and detached devices, and details of devices which were slow to answer, are shown on refresh
+        if (hotplug)
+            dc_hotplug_handle_events(hotplug, devlist);
+        int nb_pending = dc_dev_list_update(devlist, 0);
+        devs_num = dc_dev_list_size(devlist);
+        if (devs_num == 0) {
+            if (!hotplug) {
+                dialog_msgbox("Info", "No devices found", 0, 0, 1);
+                return NULL;
+            }
+            dialog_vars.default_button = 0;  // Focus on "Yes"
+            if (dialog_yesno("Info", "No devices found. Check again?", 0, 0))
+                return NULL;
+            continue;
+        }
+        char *items[2 * devs_num];
+        for (i = 0; i < devs_num; i++) {
+            DC_Dev *dev = dc_dev_list_get_entry(devlist, i);
+            char dev_descr_buf[80];
+            ui_dev_descr_format(dev_descr_buf, sizeof(dev_descr_buf), dev);
+            items[2*i] = dev->dev_fs_name;
+            items[2*i+1] = strdup(dev_descr_buf);
+        }
 
-    clear_body();
-    dialog_vars.no_items = 0;
-    dialog_vars.item_help = 0;
-    dialog_vars.input_result = NULL;
-    dialog_vars.default_button = 0;  // Focus on "OK"
-    int ret = dialog_menu("Choose device", "", 0, 0, 0, devs_num, items);
-    for (i = 0; i < devs_num; i++)
-        free(items[2*i+1]);
+        clear_body();
+        dialog_vars.no_items = 0;
+        dialog_vars.item_help = 0;
+        dialog_vars.input_result = NULL;
+        dialog_vars.default_button = 0;  // Focus on "OK"
+        dialog_vars.default_item = selected_name;
+        dialog_vars.extra_button = (nb_pending > 0 || hotplug);
+        dialog_vars.extra_label = "Refresh";
+#ifdef DLG_EXIT_TIMEOUT
+        // dialog_menu() blocks, so it's left on timeout to take events and finished probes
+        if (nb_pending > 0 || hotplug)
+            dialog_vars.timeout_secs = DEVICE_MENU_REFRESH_SECS;
+#endif
+        ret = dialog_menu("Choose device", nb_pending ? "Some devices are still being probed" : "",
+                0, 0, 0, devs_num, items);
+#ifdef DLG_EXIT_TIMEOUT
+        dialog_vars.timeout_secs = 0;
+#endif
+        dialog_vars.extra_button = 0;
+        dialog_vars.default_item = NULL;
+        for (i = 0; i < devs_num; i++)
+            free(items[2*i+1]);
+#ifdef DLG_EXIT_TIMEOUT
+        // Cursor position isn't returned on timeout, it goes back to last refreshed device
+        if (ret == DLG_EXIT_TIMEOUT)
+            continue;
+#endif
+        free(selected_name);
+        selected_name = NULL;
+        if (ret != DLG_EXIT_EXTRA)
+            break;
+        // Keep cursor on same device
+        if (dialog_vars.input_result)
+            selected_name = strdup(dialog_vars.input_result);
+    }
 
     if (ret != 0)
         return NULL;
@@ -9,11 +9,7 @@
 #include "ncurses_convenience.h"
 #include "procedure.h"
 #include "vis.h"
-
-typedef struct blk_report {
-    uint64_t seqno;
-    DC_BlockReport report;
-} blk_report_t;
+#include "report_queue.h"
 
 typedef struct {
     WINDOW *legend; // not for updating, just to free afterwards
@@ -26,6 +22,7 @@ typedef struct {
     WINDOW *summary;
     WINDOW *w_end_lba;
     WINDOW *w_cur_lba;
+    WINDOW *w_smart;
 
     struct timespec start_time;
     uint64_t access_time_stats_accum[7];
@@ -34,61 +31,31 @@ typedef struct {
     uint64_t avg_processing_speed;
     uint64_t eta_time; // estimated time
     uint64_t cur_lba;
+    uint64_t reports_handled;
+    uint64_t blk_size;
+
+    vis_smart_deltas_t smart_deltas;
+    int nb_resets;
 
     pthread_t render_thread;
     int order_hangup; // if interrupted or completed, render remainings and end render thread
 
-    // lockless ringbuffer
-    blk_report_t reports[100*1000];
-    uint64_t next_report_seqno_write;
-    uint64_t next_report_seqno_read;
+    DC_ReportQueue *queue;
 } SlidingWindow;
 
 
 
 static void *render_thread_proc(void *arg);
-static void blk_rep_write_finalize(SlidingWindow *priv, blk_report_t *rep);
-static blk_report_t *blk_rep_get_next_for_write(SlidingWindow *priv);
-static void render_update_vis(SlidingWindow *priv, blk_report_t *rep);
+static void render_update_vis(SlidingWindow *priv, const DC_BlockReport *report);
 static void render_update_stats(SlidingWindow *priv);
 
-static blk_report_t *blk_rep_get_next_for_write(SlidingWindow *priv) {
-    blk_report_t *rep = &priv->reports[
-        (priv->next_report_seqno_write) % (sizeof(priv->reports) / sizeof(priv->reports[0]))
-        ];
-    //fprintf(stderr, "giving %p for write\n", rep);
-    return rep;
-}
-
-static void blk_rep_write_finalize(SlidingWindow *priv, blk_report_t *rep) {
-    rep->seqno = priv->next_report_seqno_write;
-    priv->next_report_seqno_write++;
-    //fprintf(stderr, "mark %p with seqno %"PRIu64", go to next\n", rep, rep->seqno);
-}
-
-static blk_report_t *blk_rep_get_unread(SlidingWindow *priv) {
-    blk_report_t *rep = &priv->reports[
-        priv->next_report_seqno_read % (sizeof(priv->reports) / sizeof(priv->reports[0]))
-        ];
-    return rep;
-}
-
-static blk_report_t *blk_rep_read(SlidingWindow *priv) {
-    blk_report_t *rep = blk_rep_get_unread(priv);
-    priv->next_report_seqno_read++;
-    return rep;
-}
-
-static int get_queue_length(SlidingWindow *priv) {
-    return priv->next_report_seqno_write - priv->next_report_seqno_read;
-}
-
 static void render_queued(SlidingWindow *priv) {
-    int queue_length = get_queue_length(priv);
-    while (queue_length) {
-        blk_report_t *cur_rep = blk_rep_read(priv);
-        render_update_vis(priv, cur_rep);
-        queue_length--;
+    const DC_BlockReport *reports;
+    size_t nb_reports;
+    while ((nb_reports = dc_report_queue_peek(priv->queue, &reports))) {
+        for (size_t i = 0; i < nb_reports; i++)
+            render_update_vis(priv, &reports[i]);
+        dc_report_queue_release(priv->queue, nb_reports);
     }
     render_update_stats(priv);
     wnoutrefresh(priv->vis);
@@ -106,18 +73,20 @@ static void *render_thread_proc(void *arg) {
     return NULL;
 }
 
-static void render_update_vis(SlidingWindow *priv, blk_report_t *rep) {
-    if (rep->report.blk_status)
+static void render_update_vis(SlidingWindow *priv, const DC_BlockReport *report) {
+    if (report->blk_status)
     {
-        print_vis(priv->vis, error_vis[rep->report.blk_status]);
-        priv->error_stats_accum[rep->report.blk_status]++;
+        print_vis(priv->vis, error_vis[report->blk_status]);
+        priv->error_stats_accum[report->blk_status]++;
     }
     else
     {
-        print_vis(priv->vis, choose_vis(rep->report.blk_access_time));
+        // Colors are calibrated for blocks of VIS_BLK_SIZE
+        uint64_t access_time = report->blk_access_time * VIS_BLK_SIZE / priv->blk_size;
+        print_vis(priv->vis, choose_vis(access_time));
         unsigned int i;
         for (i = 0; i < 5; i++)
-            if (rep->report.blk_access_time < bs_vis[i].access_time) {
+            if (access_time < bs_vis[i].access_time) {
                 priv->access_time_stats_accum[i]++;
                 break;
             }
@@ -156,6 +125,10 @@ static void render_update_stats(SlidingWindow *priv) {
     comma_lba_p = commaprint(priv->cur_lba, comma_lba_buf, sizeof(comma_lba_buf));
     wprintw(priv->w_cur_lba, "LBA: %14s", comma_lba_p);
     wnoutrefresh(priv->w_cur_lba);
+
+    print_smart_deltas(priv->w_smart, &priv->smart_deltas);
+    print_watchdog_resets(priv->w_smart, &priv->nb_resets);
+    wnoutrefresh(priv->w_smart);
 }
 
 /*
@@ -211,6 +184,10 @@ static int Open(DC_RendererCtx *ctx) {
     assert(priv->w_end_lba);
     wbkgd(priv->w_end_lba, COLOR_PAIR(MY_COLOR_GRAY));
 
+    // SMART counters changes are shown left of LBA
+    priv->w_smart = derwin(stdscr, 1, COLS - LEGEND_WIDTH - 1 - (LBA_WIDTH * 2), 0 /* at the top */, 0);
+    assert(priv->w_smart);
+
     priv->eta = derwin(stdscr, 1, LEGEND_WIDTH, 0 /* at the top */, COLS-LEGEND_WIDTH);
     assert(priv->eta);
     wbkgd(priv->eta, COLOR_PAIR(MY_COLOR_GRAY));
@@ -239,10 +216,12 @@ static int Open(DC_RendererCtx *ctx) {
     scrollok(priv->vis, TRUE);
     wrefresh(priv->vis);
 
-    priv->reports[0].seqno = 1; // anything but zero
+    priv->blk_size = actctx->blk_size;
+    priv->queue = dc_report_queue_open(DC_REPORT_QUEUE_DEFAULT_CAPACITY);
+    assert(priv->queue);
 
     char comma_lba_buf[30], *comma_lba_p;
-    comma_lba_p = commaprint(actctx->dev->capacity / 512, comma_lba_buf, sizeof(comma_lba_buf));
+    comma_lba_p = commaprint(actctx->dev->capacity / actctx->dev->logical_sector_size, comma_lba_buf, sizeof(comma_lba_buf));
     wprintw(priv->w_end_lba, "/ %s", comma_lba_p);
     wnoutrefresh(priv->w_end_lba);
     wprintw(priv->summary,
@@ -262,14 +241,23 @@ static int HandleReport(DC_RendererCtx *ctx) {
     SlidingWindow *priv = ctx->priv;
     DC_ProcedureCtx *actctx = ctx->procedure_ctx;
 
-    priv->bytes_processed += actctx->report.sectors_processed * 512;
-    priv->cur_lba = actctx->report.lba + actctx->report.sectors_processed;
-
-    if (actctx->progress.num == 1) {  // TODO fix priv hack
+    smart_deltas_add(&priv->smart_deltas, actctx->smart_events, actctx->nb_smart_events);
+    watchdog_resets_add(&priv->nb_resets, actctx->watchdog_events, actctx->nb_watchdog_events);
+    if (!actctx->nb_reports)
+        return 0;
+    for (int i = 0; i < actctx->nb_reports; i++)
+        priv->bytes_processed += actctx->reports[i].sectors_processed * actctx->dev->logical_sector_size;
+    DC_BlockReport *last_report = &actctx->reports[actctx->nb_reports - 1];
+    priv->cur_lba = last_report->lba + last_report->sectors_processed;
+
+    uint64_t prev_reports_handled = priv->reports_handled;
+    priv->reports_handled += actctx->nb_reports;
+    if (prev_reports_handled == 0) {  // TODO fix priv hack
         r = clock_gettime(DC_BEST_CLOCK, &priv->start_time);
         assert(!r);
     } else {
-        if ((actctx->progress.num % 10) == 0) {
+        // Every 10 blocks
+        if (prev_reports_handled / 10 != priv->reports_handled / 10) {
             struct timespec now;
             r = clock_gettime(DC_BEST_CLOCK, &now);
             assert(!r);
@@ -287,12 +275,8 @@ static int HandleReport(DC_RendererCtx *ctx) {
         }
     }
 
-    // enqueue block report
-    blk_report_t *rep = blk_rep_get_next_for_write(priv);
-    assert(rep);
-    rep->report = actctx->report;
-    blk_rep_write_finalize(priv, rep);
-    //fprintf(stderr, "finalized %"PRIu64"\n", priv->next_report_seqno_write-1);
+    // Waits if render thread lags, so that no report is lost
+    dc_report_queue_push_wait(priv->queue, actctx->reports, actctx->nb_reports);
     return 0;
 }
 
@@ -306,6 +290,8 @@ static void Close(DC_RendererCtx *ctx) {
         wprintw(priv->summary, "Aborted.\n");
     else
         wprintw(priv->summary, "Completed.\n");
+    if (dc_report_queue_overflows(priv->queue))
+        wprintw(priv->summary, "Display lagged %"PRIu64" times\n", dc_report_queue_overflows(priv->queue));
     wprintw(priv->summary, "Press 'm' for menu");
     wrefresh(priv->summary);
     beep();
@@ -319,7 +305,9 @@ static void Close(DC_RendererCtx *ctx) {
     delwin(priv->summary);
     delwin(priv->w_end_lba);
     delwin(priv->w_cur_lba);
+    delwin(priv->w_smart);
     clear_body();
+    dc_report_queue_close(priv->queue);
 }
 
 DC_Renderer sliding_window = {
@@ -84,3 +84,67 @@ void show_legend(WINDOW *win) {
     wrefresh(win);
 }
 
+
+void smart_deltas_add(vis_smart_deltas_t *deltas, const DC_SmartEvent *events, int nb_events) {
+    // Only this thread writes, so nb is read plainly; it is published after id of new counter
+    for (int i = 0; i < nb_events; i++) {
+        int j;
+        for (j = 0; j < deltas->nb; j++)
+            if (deltas->ids[j] == events[i].id)
+                break;
+        if (j == deltas->nb) {
+            if (deltas->nb == VIS_SMART_COUNTERS)
+                continue;
+            deltas->ids[j] = events[i].id;
+            __atomic_store_n(&deltas->nb, j + 1, __ATOMIC_RELEASE);
+        }
+        __atomic_add_fetch(&deltas->deltas[j], events[i].delta, __ATOMIC_RELAXED);
+    }
+}
+
+static const char *smart_counter_label(uint8_t id) {
+    switch (id) {
+        case 5: return "Realloc";
+        case 187: return "Unc";
+        case 188: return "Tmout";
+        case 196: return "RelocEv";
+        case 197: return "Pend";
+        case 198: return "Offl";
+        case 199: return "CRC";
+        default: return NULL;
+    }
+}
+
+void print_smart_deltas(WINDOW *win, const vis_smart_deltas_t *deltas) {
+    werase(win);
+    int nb = __atomic_load_n(&deltas->nb, __ATOMIC_ACQUIRE);
+    if (!nb)
+        return;
+    wattron(win, A_BOLD);
+    wattron(win, COLOR_PAIR(MY_COLOR_RED));
+    for (int i = 0; i < nb; i++) {
+        int64_t delta = __atomic_load_n(&deltas->deltas[i], __ATOMIC_RELAXED);
+        const char *label = smart_counter_label(deltas->ids[i]);
+        if (label)
+            wprintw(win, "%s%+"PRId64" ", label, delta);
+        else
+            wprintw(win, "#%d%+"PRId64" ", deltas->ids[i], delta);
+    }
+    wattrset(win, A_NORMAL);
+}
+
+void watchdog_resets_add(int *nb_resets, const DC_WatchdogEvent *events, int nb_events) {
+    for (int i = 0; i < nb_events; i++)
+        if (events[i].action != DC_WatchdogAction_eReopen && !events[i].failed)
+            __atomic_add_fetch(nb_resets, 1, __ATOMIC_RELAXED);
+}
+
+void print_watchdog_resets(WINDOW *win, const int *nb_resets_ptr) {
+    int nb_resets = __atomic_load_n(nb_resets_ptr, __ATOMIC_RELAXED);
+    if (!nb_resets)
+        return;
+    wattron(win, A_BOLD);
+    wattron(win, COLOR_PAIR(MY_COLOR_ORANGE));
+    wprintw(win, "Resets:%d ", nb_resets);
+    wattrset(win, A_NORMAL);
+}
@@ -5,6 +5,9 @@
 #include <wchar.h>
 #include <curses.h>
 
+#include "smart_sampler.h"
+#include "watchdog.h"
+
 // start numbers from 40 because libdialog uses up to 40 items starting from 1
 #define MY_COLOR_GRAY 41
 #define MY_COLOR_GREEN 42
@@ -21,13 +24,32 @@ typedef struct vis_t {
     int color_pair;
 } vis_t;
 
+// Access times in bs_vis are for blocks of this size
+#define VIS_BLK_SIZE (256 * 512)
+
 extern vis_t bs_vis[];
 extern vis_t exceed_vis;
 extern vis_t error_vis[]; // 0th is unused, rest go as in enum
 
+// Sums of SMART error counter changes since procedure start.
+// Added to by procedure thread, printed by render thread
+#define VIS_SMART_COUNTERS 9
+typedef struct vis_smart_deltas_t {
+    int nb;
+    uint8_t ids[VIS_SMART_COUNTERS];
+    int64_t deltas[VIS_SMART_COUNTERS];
+} vis_smart_deltas_t;
+
 void init_my_colors(void);
 vis_t choose_vis(uint64_t access_time);
 void print_vis(WINDOW *win, vis_t vis);
 void show_legend(WINDOW *win);
+void smart_deltas_add(vis_smart_deltas_t *deltas, const DC_SmartEvent *events, int nb_events);
+// One line like "Realloc+2 Pend+1"; nothing until some counter changes
+void print_smart_deltas(WINDOW *win, const vis_smart_deltas_t *deltas);
+// Counts device and bus resets done by watchdog; called by procedure thread
+void watchdog_resets_add(int *nb_resets, const DC_WatchdogEvent *events, int nb_events);
+// Appended to line of print_smart_deltas(), like "Resets:2"; nothing if there were none
+void print_watchdog_resets(WINDOW *win, const int *nb_resets);
 
 #endif // VIS_H
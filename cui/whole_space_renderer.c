@@ -9,15 +9,11 @@
 #include "ncurses_convenience.h"
 #include "procedure.h"
 #include "vis.h"
+#include "report_queue.h"
 #include "copy.h"
 
 #define LEGEND_WIDTH 20
 
-typedef struct blk_report {
-    uint64_t seqno;
-    DC_BlockReport report;
-} blk_report_t;
-
 typedef struct {
     WINDOW *legend; // not for updating, just to free afterwards
     WINDOW *w_stats;
@@ -31,6 +27,7 @@ typedef struct {
     WINDOW *summary;
     WINDOW *w_end_lba;
     WINDOW *w_cur_lba;
+    WINDOW *w_smart;
 
     struct timespec start_time;
     uint64_t access_time_stats_accum[6];
@@ -44,92 +41,99 @@ typedef struct {
     uint64_t unread_count;
     uint64_t read_ok_count;
 
+    vis_smart_deltas_t smart_deltas;
+    int nb_resets;
+
     pthread_t render_thread;
     int order_hangup; // if interrupted or completed, render remainings and end render thread
 
-    // lockless ringbuffer
-    blk_report_t reports[100*1000];
-    uint64_t next_report_seqno_write;
-    uint64_t next_report_seqno_read;
+    DC_ReportQueue *queue;
 
     int64_t nb_blocks;
     int64_t blocks_per_vis;
     int sectors_per_block;
+    uint64_t blk_size;
     uint8_t *blocks_map;
+
+    // Aggregates per vis cell, so that only changed cells are redrawn
+    int nb_cells;
+    uint32_t *cell_processed;  // Blocks which are not unread
+    uint32_t *cell_failed;  // Blocks processed with failure
+    uint8_t *cell_dirty;
+    int *dirty_cells;
+    int nb_dirty_cells;
 } WholeSpace;
 
 
 
 static void *render_thread_proc(void *arg);
-static void blk_rep_write_finalize(WholeSpace *priv, blk_report_t *rep);
-static blk_report_t *blk_rep_get_next_for_write(WholeSpace *priv);
-static void update_blocks_info(WholeSpace *priv, blk_report_t *rep);
+static void update_blocks_info(WholeSpace *priv, const DC_BlockReport *report);
 static void render_update_stats(WholeSpace *priv);
 
-static blk_report_t *blk_rep_get_next_for_write(WholeSpace *priv) {
-    blk_report_t *rep = &priv->reports[
-        (priv->next_report_seqno_write) % (sizeof(priv->reports) / sizeof(priv->reports[0]))
-        ];
-    //fprintf(stderr, "giving %p for write\n", rep);
-    return rep;
-}
-
-static void blk_rep_write_finalize(WholeSpace *priv, blk_report_t *rep) {
-    rep->seqno = priv->next_report_seqno_write;
-    priv->next_report_seqno_write++;
-    //fprintf(stderr, "mark %p with seqno %"PRIu64", go to next\n", rep, rep->seqno);
+static void mark_cell_dirty(WholeSpace *priv, int cell) {
+    if (priv->cell_dirty[cell])
+        return;
+    priv->cell_dirty[cell] = 1;
+    priv->dirty_cells[priv->nb_dirty_cells++] = cell;
 }
 
-static blk_report_t *blk_rep_get_unread(WholeSpace *priv) {
-    blk_report_t *rep = &priv->reports[
-        priv->next_report_seqno_read % (sizeof(priv->reports) / sizeof(priv->reports[0]))
-        ];
-    return rep;
+static void set_block_state(WholeSpace *priv, int64_t blk_index, uint8_t state) {
+    uint8_t old_state = priv->blocks_map[blk_index];
+    if (old_state == state)
+        return;
+    int cell = blk_index / priv->blocks_per_vis;
+    priv->cell_processed[cell] += (state != 0) - (old_state != 0);
+    priv->cell_failed[cell] += (state == 2) - (old_state == 2);
+    priv->blocks_map[blk_index] = state;
+    mark_cell_dirty(priv, cell);
 }
 
-static blk_report_t *blk_rep_read(WholeSpace *priv) {
-    blk_report_t *rep = blk_rep_get_unread(priv);
-    priv->next_report_seqno_read++;
-    return rep;
-}
-
-static int get_queue_length(WholeSpace *priv) {
-    return priv->next_report_seqno_write - priv->next_report_seqno_read;
+// Counts cells' blocks once, after blocks map was filled from journal
+static void init_cells(WholeSpace *priv) {
+    priv->nb_cells = (priv->nb_blocks + priv->blocks_per_vis - 1) / priv->blocks_per_vis;
+    priv->cell_processed = calloc(priv->nb_cells, sizeof(uint32_t));
+    assert(priv->cell_processed);
+    priv->cell_failed = calloc(priv->nb_cells, sizeof(uint32_t));
+    assert(priv->cell_failed);
+    priv->cell_dirty = calloc(priv->nb_cells, sizeof(uint8_t));
+    assert(priv->cell_dirty);
+    priv->dirty_cells = calloc(priv->nb_cells, sizeof(int));
+    assert(priv->dirty_cells);
+    for (int64_t i = 0; i < priv->nb_blocks; i++) {
+        int cell = i / priv->blocks_per_vis;
+        priv->cell_processed[cell] += priv->blocks_map[i] != 0;
+        priv->cell_failed[cell] += priv->blocks_map[i] == 2;
+    }
+    for (int i = 0; i < priv->nb_cells; i++)
+        mark_cell_dirty(priv, i);
 }
 
 static void render_map(WholeSpace *priv) {
-    int i;
-    // Clear vis window
-    werase(priv->vis);
-    for (i = 0; i < priv->nb_blocks; i += priv->blocks_per_vis) {
-        int64_t end_blk_index = (i + priv->blocks_per_vis < priv->nb_blocks) ? i + priv->blocks_per_vis : priv->nb_blocks;
-        int j;
-        int this_cell_fully_processed = 1;
-        int errors_in_this_cell = 0;
-        for (j = i; j < end_blk_index; j++) {
-            if (priv->blocks_map[j] == 2) {
-                errors_in_this_cell = 1;
-                break;
-            }
-            if (!priv->blocks_map[j])
-                this_cell_fully_processed = 0;
-        }
-        if (errors_in_this_cell)
+    for (int i = 0; i < priv->nb_dirty_cells; i++) {
+        int cell = priv->dirty_cells[i];
+        int64_t cell_blocks = priv->blocks_per_vis;
+        if ((int64_t)(cell + 1) * priv->blocks_per_vis > priv->nb_blocks)
+            cell_blocks = priv->nb_blocks - (int64_t)cell * priv->blocks_per_vis;
+        wmove(priv->vis, cell / priv->vis_width, cell % priv->vis_width);
+        if (priv->cell_failed[cell])
             print_vis(priv->vis, error_vis[3]);
-        else if (!this_cell_fully_processed)
+        else if (priv->cell_processed[cell] < cell_blocks)
             print_vis(priv->vis, bs_vis[0]);
         else
             print_vis(priv->vis, bs_vis[1]);
+        priv->cell_dirty[cell] = 0;
     }
+    priv->nb_dirty_cells = 0;
     wnoutrefresh(priv->vis);
 }
 
 static void render_queued(WholeSpace *priv) {
-    int queue_length = get_queue_length(priv);
-    while (queue_length) {
-        blk_report_t *cur_rep = blk_rep_read(priv);
-        update_blocks_info(priv, cur_rep);
-        queue_length--;
+    const DC_BlockReport *reports;
+    size_t nb_reports;
+    while ((nb_reports = dc_report_queue_peek(priv->queue, &reports))) {
+        for (size_t i = 0; i < nb_reports; i++)
+            update_blocks_info(priv, &reports[i]);
+        dc_report_queue_release(priv->queue, nb_reports);
     }
     render_update_stats(priv);
     render_map(priv);
@@ -147,29 +151,35 @@ static void *render_thread_proc(void *arg) {
     return NULL;
 }
 
-static void update_blocks_info(WholeSpace *priv, blk_report_t *rep) {
-    uint8_t *map_pointer = &priv->blocks_map[rep->report.lba / priv->sectors_per_block];
-    if (rep->report.blk_status)
+static void update_blocks_info(WholeSpace *priv, const DC_BlockReport *report) {
+    if (!report->sectors_processed)
+        return;
+    // Reports need not be aligned to blocks, e.g. with copy resumed with other block size
+    int64_t first_blk_index = report->lba / priv->sectors_per_block;
+    int64_t last_blk_index = (report->lba + report->sectors_processed - 1) / priv->sectors_per_block;
+    if (report->blk_status)
     {
-        priv->error_stats_accum[rep->report.blk_status]++;
-        *map_pointer = 2;  // block processed with failure result
-        priv->errors_count += rep->report.sectors_processed;
+        priv->error_stats_accum[report->blk_status]++;
+        for (int64_t i = first_blk_index; i <= last_blk_index; i++)
+            set_block_state(priv, i, 2);  // block processed with failure result
+        priv->errors_count += report->sectors_processed;
     }
     else
     {
-        *map_pointer = 1;  //block processed successfully
+        for (int64_t i = first_blk_index; i <= last_blk_index; i++)
+            set_block_state(priv, i, 1);  //block processed successfully
+        uint64_t access_time = report->blk_access_time * VIS_BLK_SIZE / priv->blk_size;
         unsigned int i;
         for (i = 0; i < 5; i++)
-            if (rep->report.blk_access_time < bs_vis[i].access_time) {
+            if (access_time < bs_vis[i].access_time) {
                 priv->access_time_stats_accum[i]++;
                 break;
             }
         if (i == 5)
             priv->access_time_stats_accum[5]++; // of exceed
-        priv->read_ok_count += rep->report.sectors_processed;
+        priv->read_ok_count += report->sectors_processed;
     }
-    priv->unread_count -= rep->report.sectors_processed;
-    wnoutrefresh(priv->vis);
+    priv->unread_count -= report->sectors_processed;
 }
 
 static void render_update_stats(WholeSpace *priv) {
@@ -194,6 +204,10 @@ static void render_update_stats(WholeSpace *priv) {
     wprintw(priv->w_cur_lba, "LBA: %14s", comma_lba_p);
     wnoutrefresh(priv->w_cur_lba);
 
+    print_smart_deltas(priv->w_smart, &priv->smart_deltas);
+    print_watchdog_resets(priv->w_smart, &priv->nb_resets);
+    wnoutrefresh(priv->w_smart);
+
     werase(priv->w_stats);
     print_vis(priv->w_stats, bs_vis[0]);
     wattrset(priv->w_stats, A_NORMAL);
@@ -273,41 +287,42 @@ static int Open(DC_RendererCtx *ctx) {
     if (actctx->dev->capacity % actctx->blk_size)
         priv->nb_blocks++;
     priv->unread_count = actctx->progress.den;
-    priv->sectors_per_block = actctx->blk_size / 512;
+    priv->blk_size = actctx->blk_size;
+    priv->sectors_per_block = actctx->blk_size / actctx->dev->logical_sector_size;
     priv->blocks_map = calloc(priv->nb_blocks, sizeof(uint8_t));
     assert(priv->blocks_map);
-    int journal_fd = ((CopyPriv*)actctx->priv)->journal_fd;
-    lseek(journal_fd, 0, SEEK_SET);
+    CopyJournal *journal = ((CopyPriv*)actctx->priv)->journal;
     if (((CopyPriv*)actctx->priv)->use_journal) {
         priv->unread_count = 0;
-        uint8_t journal_chunk[1*1024*1024];
-        int64_t chunklen;
-        int64_t end_lba = ((CopyPriv*)actctx->priv)->end_lba;
-        for (int64_t i = 0; i < priv->nb_blocks; i++) {
-            int64_t lba = i * priv->sectors_per_block;
-            if (lba % sizeof(journal_chunk) == 0) {
-                chunklen = (end_lba - lba) < (int64_t)sizeof(journal_chunk) ? (end_lba - lba) : (int64_t)sizeof(journal_chunk);
-                int ret = read(journal_fd, journal_chunk, chunklen);
-                if (ret != chunklen)
-                    return 1;
-            }
-            char sector_status = journal_chunk[lba % sizeof(journal_chunk)];
-            priv->blocks_map[i] = sector_status;
-            int sectors_in_block = priv->sectors_per_block;
-            if (i == priv->nb_blocks - 1)  // Last block may be smaller
-                sectors_in_block = (actctx->dev->capacity % actctx->blk_size) / 512;
-            switch ((enum SectorStatus)sector_status) {
+        for (int i = 0; i < journal->nb_runs; i++) {
+            JournalRun *run = &journal->runs[i];
+            int64_t run_length = run->end_lba - run->begin_lba;
+            uint8_t block_state;
+            switch (run->status) {
                 case SectorStatus_eUnread:
-                    priv->unread_count += sectors_in_block;
+                    priv->unread_count += run_length;
+                    block_state = 0;
                     break;
                 case SectorStatus_eReadOk:
-                    priv->read_ok_count += sectors_in_block;
+                    priv->read_ok_count += run_length;
+                    block_state = 1;
                     break;
                 case SectorStatus_eBlockReadError:
                 case SectorStatus_eSectorReadError:
-                    priv->errors_count += sectors_in_block;
+                default:
+                    priv->errors_count += run_length;
+                    block_state = 2;
                     break;
             }
+            // Block shows failure if any of its sectors failed, otherwise unread if any is unread
+            int64_t end_blk_index = (run->end_lba - 1) / priv->sectors_per_block;
+            for (int64_t j = run->begin_lba / priv->sectors_per_block; j <= end_blk_index; j++) {
+                if (priv->blocks_map[j] == 2)
+                    continue;
+                if (block_state == 1 && (j * priv->sectors_per_block < run->begin_lba) && priv->blocks_map[j] == 0)
+                    continue;
+                priv->blocks_map[j] = block_state;
+            }
         }
     }
 
@@ -324,6 +339,10 @@ static int Open(DC_RendererCtx *ctx) {
     assert(priv->w_end_lba);
     wbkgd(priv->w_end_lba, COLOR_PAIR(MY_COLOR_GRAY));
 
+    // SMART counters changes are shown left of LBA
+    priv->w_smart = derwin(stdscr, 1, COLS - LEGEND_WIDTH - 1 - (LBA_WIDTH * 2), 0 /* at the top */, 0);
+    assert(priv->w_smart);
+
     priv->eta = derwin(stdscr, 1, LEGEND_WIDTH, 0 /* at the top */, COLS-LEGEND_WIDTH);
     assert(priv->eta);
     wbkgd(priv->eta, COLOR_PAIR(MY_COLOR_GRAY));
@@ -356,13 +375,15 @@ static int Open(DC_RendererCtx *ctx) {
     priv->vis = derwin(stdscr, priv->vis_height, priv->vis_width, 1 /* LBA is above */, 0);
     assert(priv->vis);
     wrefresh(priv->vis);
+    init_cells(priv);
 
     whole_space_show_legend(priv);
 
-    priv->reports[0].seqno = 1; // anything but zero
+    priv->queue = dc_report_queue_open(DC_REPORT_QUEUE_DEFAULT_CAPACITY);
+    assert(priv->queue);
 
     char comma_lba_buf[30], *comma_lba_p;
-    comma_lba_p = commaprint(actctx->dev->capacity / 512, comma_lba_buf, sizeof(comma_lba_buf));
+    comma_lba_p = commaprint(actctx->dev->capacity / actctx->dev->logical_sector_size, comma_lba_buf, sizeof(comma_lba_buf));
     wprintw(priv->w_end_lba, "/ %s", comma_lba_p);
     wnoutrefresh(priv->w_end_lba);
     wprintw(priv->summary,
@@ -381,15 +402,23 @@ static int HandleReport(DC_RendererCtx *ctx) {
     WholeSpace *priv = ctx->priv;
     DC_ProcedureCtx *actctx = ctx->procedure_ctx;
 
-    priv->bytes_processed += actctx->report.sectors_processed * 512;
-    priv->cur_lba = actctx->report.lba + actctx->report.sectors_processed;
-
-    priv->reports_handled++;
-    if (priv->reports_handled == 1) {  // TODO fix priv hack
+    smart_deltas_add(&priv->smart_deltas, actctx->smart_events, actctx->nb_smart_events);
+    watchdog_resets_add(&priv->nb_resets, actctx->watchdog_events, actctx->nb_watchdog_events);
+    if (!actctx->nb_reports)
+        return 0;
+    for (int i = 0; i < actctx->nb_reports; i++)
+        priv->bytes_processed += actctx->reports[i].sectors_processed * actctx->dev->logical_sector_size;
+    DC_BlockReport *last_report = &actctx->reports[actctx->nb_reports - 1];
+    priv->cur_lba = last_report->lba + last_report->sectors_processed;
+
+    uint64_t prev_reports_handled = priv->reports_handled;
+    priv->reports_handled += actctx->nb_reports;
+    if (prev_reports_handled == 0) {  // TODO fix priv hack
         r = clock_gettime(DC_BEST_CLOCK, &priv->start_time);
         assert(!r);
     } else {
-        if ((priv->reports_handled % 10) == 0) {
+        // Every 10 blocks
+        if (prev_reports_handled / 10 != priv->reports_handled / 10) {
             struct timespec now;
             r = clock_gettime(DC_BEST_CLOCK, &now);
             assert(!r);
@@ -407,12 +436,8 @@ static int HandleReport(DC_RendererCtx *ctx) {
         }
     }
 
-    // enqueue block report
-    blk_report_t *rep = blk_rep_get_next_for_write(priv);
-    assert(rep);
-    rep->report = actctx->report;
-    blk_rep_write_finalize(priv, rep);
-    //fprintf(stderr, "finalized %"PRIu64"\n", priv->next_report_seqno_write-1);
+    // Waits if render thread lags, so that no report is lost
+    dc_report_queue_push_wait(priv->queue, actctx->reports, actctx->nb_reports);
     return 0;
 }
 
@@ -426,6 +451,8 @@ static void Close(DC_RendererCtx *ctx) {
         wprintw(priv->summary, "Aborted.\n");
     else
         wprintw(priv->summary, "Completed.\n");
+    if (dc_report_queue_overflows(priv->queue))
+        wprintw(priv->summary, "Display lagged %"PRIu64" times\n", dc_report_queue_overflows(priv->queue));
     wprintw(priv->summary, "Press 'm' for menu");
     wrefresh(priv->summary);
     beep();
@@ -438,8 +465,14 @@ static void Close(DC_RendererCtx *ctx) {
     delwin(priv->summary);
     delwin(priv->w_end_lba);
     delwin(priv->w_cur_lba);
+    delwin(priv->w_smart);
     clear_body();
+    dc_report_queue_close(priv->queue);
     free(priv->blocks_map);
+    free(priv->cell_processed);
+    free(priv->cell_failed);
+    free(priv->cell_dirty);
+    free(priv->dirty_cells);
 }
 
 DC_Renderer whole_space = {
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "ata_session.h"
+
+static void fill_template(ScsiCommand *scsi_command, DC_AtaProtocol protocol) {
+    memset(scsi_command, 0, sizeof(*scsi_command));
+    scsi_command->io_hdr.interface_id = 'S';
+    scsi_command->io_hdr.cmd_len = 16;
+    scsi_command->io_hdr.mx_sb_len = sizeof(scsi_command->sense_buf);
+    scsi_command->io_hdr.timeout = DC_DEFAULT_TIMEOUT_MS;  // In millisec; MAX_UINT is no timeout
+    scsi_command->io_hdr.flags = SG_FLAG_DIRECT_IO;
+    scsi_command->scsi_cmd[0] = 0x85;  // ATA PASS-THROUGH 16 bytes
+    scsi_command->scsi_cmd[13] = 0x40;  // LBA flag; DEV flag is set correctly in kernel
+    switch (protocol) {
+        case DC_AtaProtocol_eNonData:
+            scsi_command->io_hdr.dxfer_direction = SG_DXFER_NONE;
+            scsi_command->scsi_cmd[1] = (3 << 1) + 1;  // Non-data protocol + EXTEND bit
+            scsi_command->scsi_cmd[2] = 0x20;  // Check condition, no off-line, no data xfer
+            break;
+        case DC_AtaProtocol_ePioIn:
+            scsi_command->io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+            scsi_command->scsi_cmd[1] = (4 << 1) + 1;  // PIO_IN protocol + EXTEND bit
+            scsi_command->scsi_cmd[2] = 0x2e;  // CK_COND=1 T_DIR=1 BYTE_BLOCK=1 T_LENGTH=10b
+            break;
+        case DC_AtaProtocol_ePioOut:
+            scsi_command->io_hdr.dxfer_direction = SG_DXFER_TO_DEV;
+            scsi_command->scsi_cmd[1] = (5 << 1) + 1;  // PIO_OUT protocol + EXTEND bit
+            scsi_command->scsi_cmd[2] = 0x26;  // CK_COND=1 T_DIR=0 BYTE_BLOCK=1 T_LENGTH=10b
+            break;
+        case DC_AtaProtocol_eDmaIn:
+            scsi_command->io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+            scsi_command->scsi_cmd[1] = (6 << 1) + 1;  // DMA protocol + EXTEND bit
+            scsi_command->scsi_cmd[2] = 0x0e;  // CK_COND=0 T_DIR=1 BYTE_BLOCK=1 T_LENGTH=10b
+            break;
+        case DC_AtaProtocol_eFpdmaIn:
+            scsi_command->io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+            scsi_command->scsi_cmd[1] = (12 << 1) + 1;  // FPDMA protocol + EXTEND bit
+            scsi_command->scsi_cmd[2] = 0x0d;  // CK_COND=0 T_DIR=1 BYTE_BLOCK=1 T_LENGTH=01b (in features)
+            break;
+        default:
+            break;
+    }
+}
+
+static int sg_io_ioctl(int fd, ScsiCommand *scsi_command) {
+    return ioctl(fd, SG_IO, scsi_command);
+}
+
+DC_AtaSession *dc_ata_session_open_fd(int fd) {
+    DC_AtaSession *session = calloc(1, sizeof(*session));
+    if (!session)
+        return NULL;
+    session->fd = fd;
+    session->sg_io = sg_io_ioctl;
+    for (int i = 0; i < DC_AtaProtocol_eCount; i++)
+        fill_template(&session->templates[i], i);
+    return session;
+}
+
+DC_AtaSession *dc_ata_session_open(const char *dev_path) {
+    int fd = open(dev_path, O_RDWR);
+    if (fd == -1)
+        return NULL;
+    DC_AtaSession *session = dc_ata_session_open_fd(fd);
+    if (!session) {
+        close(fd);
+        return NULL;
+    }
+    session->own_fd = 1;
+    return session;
+}
+
+void dc_ata_session_close(DC_AtaSession *session) {
+    if (session->own_fd)
+        close(session->fd);
+    free(session);
+}
+
+void dc_ata_session_prepare(DC_AtaSession *session, ScsiCommand *scsi_command, DC_AtaProtocol protocol,
+        uint8_t command, uint16_t features, uint64_t lba, uint16_t count, void *buf, unsigned int buf_len) {
+    uint8_t *cdb = scsi_command->scsi_cmd;
+    memcpy(scsi_command, &session->templates[protocol], sizeof(*scsi_command));
+    // Template pointers refer to template itself
+    scsi_command->io_hdr.cmdp = scsi_command->scsi_cmd;
+    scsi_command->io_hdr.sbp = scsi_command->sense_buf;
+    if (protocol != DC_AtaProtocol_eNonData) {
+        scsi_command->io_hdr.dxferp = buf;
+        scsi_command->io_hdr.dxfer_len = buf_len;
+    }
+    cdb[3]  = features >> 8;
+    cdb[4]  = features;
+    cdb[5]  = count >> 8;
+    cdb[6]  = count;
+    cdb[7]  = lba >> 24;  // LBA (31:24)
+    cdb[8]  = lba;        // LBA (7:0)
+    cdb[9]  = lba >> 32;  // LBA (39:32)
+    cdb[10] = lba >> 8;   // LBA (15:8)
+    cdb[11] = lba >> 40;  // LBA (47:40)
+    cdb[12] = lba >> 16;  // LBA (23:16)
+    cdb[14] = command;
+}
+
+int dc_ata_session_exec(DC_AtaSession *session, ScsiCommand *scsi_command) {
+    if (session->sg_io(session->fd, scsi_command))
+        return -1;
+    fill_scsi_ata_return_descriptor(&session->ret, scsi_command);
+    session->sense_key = get_sense_key_from_sense_buffer(scsi_command->sense_buf);
+    // Aborted or lost command leaves buffer stale, with SCSI status 0
+    if (scsi_check_transport_status(scsi_command) != DC_BlockStatus_eOk)
+        return 1;
+    if (session->ret.status & STATUS_BIT_ERR || session->sense_key > 0x01)
+        return 1;
+    return 0;
+}
+
+int dc_ata_ncq_depth(const uint8_t identify[512]) {
+    // Word 76 bit 8: NCQ supported; word 75 bits 4:0: maximal queue depth - 1
+    uint16_t word75 = identify[75 * 2] | (identify[75 * 2 + 1] << 8);
+    uint16_t word76 = identify[76 * 2] | (identify[76 * 2 + 1] << 8);
+    if (word76 == 0xffff || !(word76 & (1 << 8)))
+        return 0;
+    return (word75 & 0x1f) + 1;
+}
+
+int dc_ata_session_identify(DC_AtaSession *session, uint8_t identify[512]) {
+    dc_ata_session_prepare(session, &session->cmd, DC_AtaProtocol_ePioIn,
+            WIN_IDENTIFY /* ECh */, 0, 0, 1, identify, 512);
+    return dc_ata_session_exec(session, &session->cmd) ? -1 : 0;
+}
+
+int dc_ata_session_read_native_max_lba(DC_AtaSession *session, uint64_t *max_lba) {
+    dc_ata_session_prepare(session, &session->cmd, DC_AtaProtocol_eNonData,
+            WIN_READ_NATIVE_MAX_EXT /* 27h */, 0, 0, 0, NULL, 0);
+    if (dc_ata_session_exec(session, &session->cmd))
+        return -1;
+    *max_lba = session->ret.lba;
+    return 0;
+}
+
+int dc_ata_session_set_max_lba(DC_AtaSession *session, uint64_t lba) {
+    uint64_t old_max_lba;
+    // Have read from hdparm.c that this is required by standard before setting
+    dc_ata_session_read_native_max_lba(session, &old_max_lba);
+    dc_ata_session_prepare(session, &session->cmd, DC_AtaProtocol_eNonData,
+            WIN_SET_MAX_EXT /* 37h */, 0, lba, 1 /* value volatile bit */, NULL, 0);
+    return dc_ata_session_exec(session, &session->cmd) ? -1 : 0;
+}
+
+int dc_ata_session_read_log_ext(DC_AtaSession *session, uint8_t log_address, uint16_t page,
+        uint16_t nb_pages, uint8_t *buf) {
+    // Page number goes to LBA (15:8) and LBA (39:32)
+    uint64_t lba = log_address | (uint64_t)(page & 0xff) << 8 | (uint64_t)(page >> 8) << 32;
+    dc_ata_session_prepare(session, &session->cmd, DC_AtaProtocol_ePioIn,
+            0x2f /* READ LOG EXT */, 0, lba, nb_pages, buf, nb_pages * 512);
+    return dc_ata_session_exec(session, &session->cmd) ? -1 : 0;
+}
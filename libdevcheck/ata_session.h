@@ -0,0 +1,66 @@
+#ifndef ATA_SESSION_H
+#define ATA_SESSION_H
+
+#include <inttypes.h>
+
+#include "scsi.h"
+
+// ATA PASS-THROUGH protocols used by us, index of session command templates
+typedef enum {
+    DC_AtaProtocol_eNonData,
+    DC_AtaProtocol_ePioIn,
+    DC_AtaProtocol_ePioOut,
+    DC_AtaProtocol_eDmaIn,
+    DC_AtaProtocol_eFpdmaIn,  // NCQ; sector count goes in features, tag in count
+    DC_AtaProtocol_eCount,
+} DC_AtaProtocol;
+
+/*
+ * Device opened for series of ATA commands through SCSI ATA passthrough.
+ * Commands are made from templates filled once at open,
+ * so issuing one is patching CDB and a single ioctl().
+ */
+typedef struct dc_ata_session {
+    int fd;
+    int own_fd;  // Whether fd is closed along with session
+    // Delivers command to device, ioctl(SG_IO) unless replaced, e.g. by stub responder in tests
+    int (*sg_io)(int fd, ScsiCommand *scsi_command);
+    ScsiCommand templates[DC_AtaProtocol_eCount];
+    ScsiCommand cmd;  // Used by helpers below
+
+    // Result of last executed command
+    ScsiAtaReturnDescriptor ret;
+    int sense_key;
+} DC_AtaSession;
+
+// NULL if device can't be opened
+DC_AtaSession *dc_ata_session_open(const char *dev_path);
+// Session on already opened device, fd is left open on close
+DC_AtaSession *dc_ata_session_open_fd(int fd);
+void dc_ata_session_close(DC_AtaSession *session);
+
+/**
+ * Fill command from template, for submission by session or by other means, e.g. sg queue.
+ * @param buf: data buffer, of buf_len bytes; unused for non-data protocol
+ */
+void dc_ata_session_prepare(DC_AtaSession *session, ScsiCommand *scsi_command, DC_AtaProtocol protocol,
+        uint8_t command, uint16_t features, uint64_t lba, uint16_t count, void *buf, unsigned int buf_len);
+
+/**
+ * Execute prepared command synchronously, parse its status to session->ret and session->sense_key
+ * @return 0 on success, 1 if device reported error or command was aborted, -1 if command wasn't delivered
+ */
+int dc_ata_session_exec(DC_AtaSession *session, ScsiCommand *scsi_command);
+
+// Maximal NCQ queue depth from IDENTIFY DEVICE data, 0 if NCQ isn't supported
+int dc_ata_ncq_depth(const uint8_t identify[512]);
+
+int dc_ata_session_identify(DC_AtaSession *session, uint8_t identify[512]);
+int dc_ata_session_read_native_max_lba(DC_AtaSession *session, uint64_t *max_lba);
+// Volatile setting, it's lost on power cycle
+int dc_ata_session_set_max_lba(DC_AtaSession *session, uint64_t lba);
+// READ LOG EXT of nb_pages 512-byte pages of General Purpose log, starting from given page
+int dc_ata_session_read_log_ext(DC_AtaSession *session, uint8_t log_address, uint16_t page,
+        uint16_t nb_pages, uint8_t *buf);
+
+#endif  // ATA_SESSION_H
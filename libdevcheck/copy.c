@@ -14,10 +14,10 @@
 
 #include "procedure.h"
 #include "scsi.h"
+#include "ata_session.h"
 #include "copy.h"
 
 static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
-    (void)dev;
     if (!strcmp(setting->name, "api")) {
         if (dev->ata_capable)
             setting->value = strdup("ata");
@@ -29,27 +29,36 @@ static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
         setting->value = strdup("/dev/null");
     } else if (!strcmp(setting->name, "use_journal")) {
         setting->value = strdup("yes");
+    } else if (!strcmp(setting->name, "sparse")) {
+        setting->value = strdup("no");
+    } else if (!strcmp(setting->name, "block_sectors")) {
+        // Read errors mark whole blocks, so big blocks would leave more data unrecovered
+        int r = asprintf(&setting->value, "%"PRId64, dc_io_default_block_sectors(dev));
+        assert(r != -1);
     } else if (!strcmp(setting->name, "skip_blocks")) {
         setting->value = strdup("5000");
+    } else if (!strcmp(setting->name, "max_zones")) {
+        setting->value = strdup("1000");
+    } else if (!strcmp(setting->name, "indivisible_zone_sectors")) {
+        setting->value = strdup("1000000");  // 500 MB of 512-byte sectors
+    } else if (!strcmp(setting->name, "smart_interval")) {
+        setting->value = strdup(dev->ata_capable ? "60" : "0");
+    } else if (!strcmp(setting->name, "hang_timeout")) {
+        setting->value = strdup(dev->ata_capable ? "30" : "0");
+    } else if (!strcmp(setting->name, "timeout")) {
+        setting->value = strdup(dev->ata_capable ? "auto" : "0");
+    } else if (!strcmp(setting->name, "erc_timeout")) {
+        setting->value = strdup(dev->ata_capable ? "500" : "0");
+    } else if (!strcmp(setting->name, "queue_depth")) {
+        int ncq_depth = dev->ata_capable ? dc_ata_ncq_depth(dev->identify) : 0;
+        int r = asprintf(&setting->value, "%d", ncq_depth > 1 ? ncq_depth : 1);
+        assert(r != -1);
     } else {
         return 1;
     }
     return 0;
 }
 
-static void append_zone(CopyPriv *priv, Zone *current_zone) {
-    if (!priv->unread_zones) {
-        priv->unread_zones = current_zone;
-    } else {
-        Zone *last_zone = priv->unread_zones;
-        while (last_zone->next)
-            last_zone = last_zone->next;
-        last_zone->next = current_zone;
-    }
-    //fprintf(stderr, "appending %dth zone - begin_lba %"PRId64", end_lba %"PRId64"; begin defective: %d, end defective: %d\n", priv->nb_zones, current_zone->begin_lba, current_zone->end_lba, current_zone->begin_lba_defective, current_zone->end_lba_defective);
-    priv->nb_zones++;
-}
-
 static int Open(DC_ProcedureCtx *ctx) {
     int r;
     CopyPriv *priv = ctx->priv;
@@ -65,6 +74,22 @@ static int Open(DC_ProcedureCtx *ctx) {
 
     if (priv->api == Api_eAta && !ctx->dev->ata_capable)
         return 1;
+    r = dc_io_parse_block_sectors(ctx->dev, priv->api, priv->block_sectors_str, &priv->block_sectors);
+    if (r)
+        return 1;
+    r = dc_procedure_set_timeout(ctx, priv->timeout_str);
+    if (r)
+        return 1;
+    if (priv->max_zones < 1) {
+        dc_log(DC_LOG_ERROR, "max_zones must be at least 1\n");
+        return 1;
+    }
+    // Zone is split in middle, aligned down to block, and both parts must stay non-empty
+    if (priv->indivisible_zone_sectors < 2 * priv->block_sectors) {
+        dc_log(DC_LOG_ERROR, "indivisible_zone_sectors must be at least twice block_sectors (%"PRId64")\n",
+                2 * priv->block_sectors);
+        return 1;
+    }
 
     if (!strcmp(priv->read_strategy_str, "smart")) {
         priv->read_strategy = ReadStrategy_eSmart;
@@ -92,31 +117,27 @@ static int Open(DC_ProcedureCtx *ctx) {
     priv->read_strategy_impl->init(priv);
 
     priv->use_journal = !strcmp(priv->use_journal_str, "yes");
+    priv->sparse = !strcmp(priv->sparse_str, "yes");
 
-    ctx->blk_size = BLK_SIZE;
-    priv->end_lba = ctx->dev->capacity / 512;
+    priv->sector_size = ctx->dev->logical_sector_size;
+    ctx->blk_size = priv->block_sectors * priv->sector_size;
+    priv->end_lba = ctx->dev->capacity / priv->sector_size;
     priv->lba_to_process = priv->end_lba - priv->start_lba;
     ctx->progress.den = priv->lba_to_process;
 
-    r = posix_memalign(&priv->buf, sysconf(_SC_PAGESIZE), ctx->blk_size);
-    if (r)
-        goto fail_buf;
-
-    int open_flags = priv->api == Api_eAta ? O_RDWR : O_RDONLY | O_DIRECT | O_LARGEFILE | O_NOATIME;
-    priv->src_fd = open(ctx->dev->dev_path, open_flags);
-    if (priv->src_fd == -1) {
-        dc_log(DC_LOG_FATAL, "open %s fail\n", ctx->dev->dev_path);
+    if (priv->queue_depth < 1 || priv->queue_depth > DC_IO_MAX_QUEUE_DEPTH) {
+        dc_log(DC_LOG_ERROR, "queue_depth must be from 1 to %d\n", DC_IO_MAX_QUEUE_DEPTH);
+        return 1;
+    }
+    priv->src_io = dc_io_open(ctx->dev, priv->api, priv->queue_depth, 0);
+    if (!priv->src_io)
         goto fail_open;
+    if (priv->src_io->queue_depth > 1) {
+        priv->queued_requests = calloc(priv->src_io->queue_depth, sizeof(DC_IoRequest));
+        assert(priv->queued_requests);
+        priv->queued_reports = calloc(priv->src_io->queue_depth, sizeof(DC_BlockReport));
+        assert(priv->queued_reports);
     }
-    r = ioctl(priv->src_fd, BLKFLSBUF, NULL);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Flushing block device buffers failed\n");
-    r = ioctl(priv->src_fd, BLKRAGET, &priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Getting block device readahead setting failed\n");
-    r = ioctl(priv->src_fd, BLKRASET, 0);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Disabling block device readahead setting failed\n");
 
     // We use no O_DIRECT to allow output to generic file etc.
     priv->dst_fd = open(priv->dst_file, O_WRONLY | O_LARGEFILE | O_NOATIME | O_CREAT, S_IRUSR | S_IWUSR);
@@ -129,135 +150,258 @@ static int Open(DC_ProcedureCtx *ctx) {
     off_t dst_size = lseek(priv->dst_fd, 0, SEEK_END);
     if (dst_size == -1)
         goto fail_dst_open;
-    priv->dst_file_end_lba = dst_size / 512;
+    struct stat dst_stat;
+    if (priv->sparse && dst_size == 0 && !fstat(priv->dst_fd, &dst_stat) && S_ISREG(dst_stat.st_mode)) {
+        // Zero blocks are not written at all, so file must have full size beforehand
+        if (ftruncate(priv->dst_fd, priv->end_lba * priv->sector_size) == -1) {
+            dc_log(DC_LOG_FATAL, "Resizing %s failed\n", priv->dst_file);
+            goto fail_dst_truncate;
+        }
+        dst_size = priv->end_lba * priv->sector_size;
+        priv->dst_all_holes = 1;
+    }
+    priv->dst_file_end_lba = dst_size / priv->sector_size;
     if (priv->dst_file_end_lba && (priv->dst_file_end_lba < priv->end_lba))
-        dc_log(DC_LOG_WARNING, "Size of destination file (%"PRId64" bytes) is less than of source disk (%"PRId64" bytes). Operation will stop with error when exceeding space will be reached.", priv->dst_file_end_lba * 512, priv->end_lba * 512);
+        dc_log(DC_LOG_WARNING, "Size of destination file (%"PRId64" bytes) is less than of source disk (%"PRId64" bytes). Operation will stop with error when exceeding space will be reached.", priv->dst_file_end_lba * priv->sector_size, priv->end_lba * priv->sector_size);
 
-    priv->nb_zones = 1;
-    priv->unread_zones = calloc(1, sizeof(Zone));
-    assert(priv->unread_zones);
-    priv->unread_zones->begin_lba = priv->start_lba;
-    priv->unread_zones->end_lba = priv->end_lba;
+    Zone *whole_zone = calloc(1, sizeof(Zone));
+    assert(whole_zone);
+    whole_zone->begin_lba = priv->start_lba;
+    whole_zone->end_lba = priv->end_lba;
+    zone_map_insert(&priv->unread_zones, whole_zone);
 
     if (priv->use_journal) {
         char journal_file_name[100];
         snprintf(journal_file_name, sizeof(journal_file_name), "whdd_copy_journal__%s__%s", ctx->dev->model_str, ctx->dev->serial_no);
-        struct stat journal_file_stat;
-        int journal_file_exists = 1;
-        r = stat(journal_file_name, &journal_file_stat);
-        if (r == -1) {
-            if (errno == ENOENT)
-                journal_file_exists = 0;
-            else
-                goto fail_journal_open;
-        }
-        if (journal_file_exists) {
-            // Check it for sanity - size, maybe sth else
-            if (journal_file_stat.st_size != priv->end_lba) {
-                dc_log(DC_LOG_ERROR, "Wrong size of journal file");
-                goto fail_journal_open;
-            }
-        }
-
-        // Open file
-        priv->journal_fd = open(journal_file_name, O_RDWR | O_NOATIME | O_CREAT | O_LARGEFILE, S_IRUSR | S_IWUSR );
-        if (priv->journal_fd == -1) {
-            dc_log(DC_LOG_ERROR, "Failed to open journal file");
+        priv->journal = copy_journal_open(journal_file_name, priv->end_lba, priv->sector_size);
+        if (!priv->journal)
             goto fail_journal_open;
-        }
-        if (journal_file_exists) {
-            // Reset zones
-            priv->nb_zones = 0;
-            free(priv->unread_zones);
-            priv->unread_zones = NULL;
-            ctx->progress.den = 0;
-
-            // Parse it to zones structure
-            Zone *current_zone = NULL;
-            char prev_sector_status;
-            uint8_t journal_chunk[1*1024*1024];
-            for (int64_t i = 0; i < priv->end_lba; i++) {
-                char sector_status;
-                if (i % sizeof(journal_chunk) == 0) {
-                    int chunklen = (priv->end_lba - i) < (int64_t)sizeof(journal_chunk) ? (priv->end_lba - i) : (int64_t)sizeof(journal_chunk);
-                    int ret = read(priv->journal_fd, journal_chunk, chunklen);
-                    if (ret != chunklen)
-                        goto fail_journal_read;
-                }
-                sector_status = journal_chunk[i % sizeof(journal_chunk)];
-                switch ((SectorStatus)sector_status) {
-                    case SectorStatus_eUnread:
-                        if (!current_zone) {
-                            current_zone = calloc(1, sizeof(*current_zone));
-                            assert(current_zone);
-                            current_zone->begin_lba = i;
-                            if ((i > 0)
-                                    && ((prev_sector_status == SectorStatus_eBlockReadError)
-                                        || (prev_sector_status == SectorStatus_eSectorReadError)))
-                                current_zone->begin_lba_defective = 1;
-                        }
-                        break;
-                    case SectorStatus_eReadOk:
-                    case SectorStatus_eBlockReadError:
-                    case SectorStatus_eSectorReadError:
-                        if (current_zone) {
-                            current_zone->end_lba = i;
-                            if ((sector_status == SectorStatus_eBlockReadError)
-                                    || (sector_status == SectorStatus_eSectorReadError))
-                                current_zone->end_lba_defective = 1;
-                            ctx->progress.den += current_zone->end_lba - current_zone->begin_lba;
-                            append_zone(priv, current_zone);
-                            current_zone = NULL;
-                        }
-                        break;
-                }
-                prev_sector_status = sector_status;
-            }
-            if (current_zone) {  // Zone finishing at end of disk
-                current_zone->end_lba = priv->end_lba;
-                ctx->progress.den += current_zone->end_lba - current_zone->begin_lba;
-                append_zone(priv, current_zone);
-                current_zone = NULL;
-            }
-        } else {
-            // Fill appropriately
-            char filler[1*1024*1024];
-            memset(filler, 0, sizeof(filler));
-            for (int64_t i = 0; i < priv->end_lba;) {
-                int64_t blocksize = priv->end_lba - i;
-                if (blocksize > (int)sizeof(filler))
-                    blocksize = sizeof(filler);
-                r = write(priv->journal_fd, &filler, blocksize);
-                assert(r == blocksize);
-                i += blocksize;
-            }
-            fdatasync(priv->journal_fd);
+
+        // Reset zones
+        zone_map_clear(&priv->unread_zones);
+        ctx->progress.den = 0;
+
+        // Unread runs of journal become zones
+        for (int i = 0; i < priv->journal->nb_runs; i++) {
+            JournalRun *run = &priv->journal->runs[i];
+            if (run->status != SectorStatus_eUnread)
+                continue;
+            Zone *zone = calloc(1, sizeof(*zone));
+            assert(zone);
+            zone->begin_lba = run->begin_lba;
+            zone->end_lba = run->end_lba;
+            // Neighbour runs are not unread, as adjacent runs differ in status
+            if (i > 0 && run[-1].status != SectorStatus_eReadOk)
+                zone->begin_lba_defective = 1;
+            if (i < priv->journal->nb_runs - 1 && run[1].status != SectorStatus_eReadOk)
+                zone->end_lba_defective = 1;
+            ctx->progress.den += zone->end_lba - zone->begin_lba;
+            zone_map_insert(&priv->unread_zones, zone);
         }
     }
 
+    r = copy_pipeline_start(priv);
+    if (r)
+        goto fail_pipeline;
+    dc_procedure_watch_smart(ctx, priv->src_io->fd, priv->smart_interval);
+    dc_procedure_limit_erc(ctx, priv->src_io->fd, priv->erc_timeout);
+    dc_procedure_watch_hangs(ctx, priv->src_io, priv->hang_timeout);
+
     //fprintf(stderr, "Zones list at beginning of procedure:\n");
-    //for (Zone *iter = priv->unread_zones; iter; iter = iter->next) {
+    //for (Zone *iter = zone_map_first(&priv->unread_zones); iter; iter = zone_map_next(iter)) {
     //    fprintf(stderr, "begin_lba %"PRId64", end_lba %"PRId64"; begin defective: %d, end defective: %d\n", iter->begin_lba, iter->end_lba, iter->begin_lba_defective, iter->end_lba_defective);
     //}
     return 0;
-fail_journal_read:
-    close(priv->journal_fd);
+fail_pipeline:
+    if (priv->use_journal)
+        copy_journal_close(priv->journal);
 fail_journal_open:
+    zone_map_clear(&priv->unread_zones);
+fail_dst_truncate:
     close(priv->dst_fd);
 fail_dst_open:
-    close(priv->src_fd);
-    r = ioctl(priv->src_fd, BLKRASET, priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Restoring block device readahead setting failed\n");
+    dc_io_close(priv->src_io);
+    free(priv->queued_requests);
+    free(priv->queued_reports);
 fail_open:
-    free(priv->buf);
-fail_buf:
     return 1;
 }
 
+/*
+ * Block has failed, and device has told first failed sector. Part of block next to
+ * space read before is read again, only failed sector is marked bad, and the rest
+ * of block is left unread, for strategy to continue with it.
+ * Processed range, adjacent to space read before, is returned for strategy.
+ */
+static int use_error_lba(DC_ProcedureCtx *ctx, CopySlot *slot, int64_t lba, size_t sectors,
+        int64_t *done_lba, size_t *done_sectors) {
+    CopyPriv *priv = ctx->priv;
+    DC_IoRequest *req = &priv->src_request;
+    int reversive = priv->current_zone_read_direction_reversive;
+    DC_BlockReport bad_report = ctx->report;
+    int64_t good_lba;
+    size_t good_sectors;
+    int r;
+
+    bad_report.lba = req->error_lba;
+    bad_report.sectors_processed = 1;
+    if (reversive) {
+        good_lba = bad_report.lba + 1;
+        good_sectors = lba + sectors - good_lba;
+        *done_lba = bad_report.lba;
+    } else {
+        good_lba = lba;
+        good_sectors = bad_report.lba - lba;
+        *done_lba = lba;
+    }
+    *done_sectors = good_sectors + 1;
+    // Reports go in LBA order
+    int good_index = reversive ? 1 : 0;
+    int bad_index = (good_sectors && !reversive) ? 1 : 0;
+
+    if (good_sectors) {
+        req->lba = good_lba;
+        req->sectors = good_sectors;
+        r = dc_io_execute(priv->src_io, req);
+        if (r)
+            return r;
+        DC_BlockReport *good_report = &priv->reports[good_index];
+        good_report->lba = good_lba;
+        good_report->sectors_processed = good_sectors;
+        good_report->blk_status = req->status;
+        good_report->blk_access_time = dc_io_request_access_time(req);
+        good_report->error_lba_valid = req->error_lba_valid;
+        good_report->error_lba = req->error_lba;
+        slot->lba = good_lba;
+        slot->sectors = good_sectors;
+        slot->status = req->status == DC_BlockStatus_eOk ? SectorStatus_eReadOk : SectorStatus_eBlockReadError;
+        copy_pipeline_push(priv);
+        slot = copy_pipeline_get_free_slot(priv);
+        if (!slot)
+            return 1;
+    }
+    slot->lba = bad_report.lba;
+    slot->sectors = 1;
+    slot->status = SectorStatus_eSectorReadError;
+    copy_pipeline_push(priv);
+
+    priv->reports[bad_index] = bad_report;
+    ctx->reports = priv->reports;
+    ctx->nb_reports = good_sectors ? 2 : 1;
+    // Strategy sees processed range as failed, so that its border is taken as defective
+    ctx->report.lba = *done_lba;
+    ctx->report.sectors_processed = *done_sectors;
+    return 0;
+}
+
+// Unread zone bordering on failed sectors is likely to hold more of them
+static int zone_is_suspect(CopyPriv *priv) {
+    Zone *zone = priv->current_zone;
+    return zone && (zone->begin_lba_defective || zone->end_lba_defective);
+}
+
+// Errors are handled by single reads, which tell failed sector exactly
+static int can_queue(CopyPriv *priv) {
+    return priv->src_io->queue_depth > 1 && !priv->single_read && !priv->last_pass
+        && priv->current_zone && !priv->current_zone_read_direction_reversive && !zone_is_suspect(priv);
+}
+
+/*
+ * Reads given block and those following it in current zone, with several requests
+ * in flight. Blocks are used in LBA order up to first failed one; that one and
+ * those after it are left unread, to be read again one by one.
+ */
+static int perform_queued(DC_ProcedureCtx *ctx, int64_t lba, size_t sectors) {
+    CopyPriv *priv = ctx->priv;
+    CopySlot *slots[priv->src_io->queue_depth];
+    int64_t end_lba = priv->current_zone->end_lba;
+    if (priv->dst_file_end_lba && end_lba > priv->dst_file_end_lba)
+        end_lba = priv->dst_file_end_lba;
+    int nb_slots = copy_pipeline_get_free_slots(priv, slots, priv->src_io->queue_depth);
+    int nb_blocks = 0;
+    int ret = 0;
+    int r;
+
+    // Blocks the strategy would give next, had the first one succeeded
+    int64_t next_lba = lba;
+    size_t next_sectors = sectors;
+    while (nb_blocks < nb_slots && next_lba < end_lba) {
+        if (next_sectors > (size_t)(end_lba - next_lba))
+            next_sectors = end_lba - next_lba;
+        DC_IoRequest *req = &priv->queued_requests[nb_blocks++];
+        req->op = DC_IoOp_eRead;
+        req->lba = next_lba;
+        req->sectors = next_sectors;
+        req->buf = slots[nb_blocks - 1]->buf;
+        req->buf_index = -1;
+        next_lba += next_sectors;
+        next_sectors = priv->block_sectors;
+    }
+    int nb_submitted = 0;
+    for (int i = 0; i < nb_blocks; i++) {
+        // Later requests wait for earlier ones in device queue
+        priv->queued_requests[i].timeout_ms = dc_procedure_cmd_timeout(ctx, nb_blocks, 0);
+        r = dc_io_submit(priv->src_io, &priv->queued_requests[i]);
+        if (r) {
+            ret = r;
+            break;
+        }
+        nb_submitted++;
+    }
+    for (int i = 0; i < nb_submitted; i++)
+        if (!dc_io_complete(priv->src_io))
+            return 1;
+    if (ret)
+        return ret;
+
+    struct timespec last_completion = priv->queued_requests[0].submitted;
+    int nb_done = 0;
+    for (int i = 0; i < nb_blocks; i++) {
+        DC_IoRequest *req = &priv->queued_requests[i];
+        // Failure of one NCQ command makes device abort others, so this may not be the bad one.
+        // Backend fails aborted ones too, whatever SCSI status they come back with
+        if (req->status != DC_BlockStatus_eOk) {
+            priv->single_read = 1;
+            break;
+        }
+        CopySlot *slot = slots[i];
+        slot->lba = req->lba;
+        slot->sectors = req->sectors;
+        slot->status = SectorStatus_eReadOk;
+        copy_pipeline_push(priv);
+
+        DC_BlockReport *report = &priv->queued_reports[nb_done++];
+        // Time of block's own service, after previous block has completed
+        struct timespec start = req->submitted;
+        if (last_completion.tv_sec > start.tv_sec
+                || (last_completion.tv_sec == start.tv_sec && last_completion.tv_nsec > start.tv_nsec))
+            start = last_completion;
+        int64_t access_time = (req->completed.tv_sec - start.tv_sec) * 1000000
+            + (req->completed.tv_nsec - start.tv_nsec) / 1000;
+        last_completion = req->completed;
+        report->lba = req->lba;
+        report->sectors_processed = req->sectors;
+        report->blk_status = DC_BlockStatus_eOk;
+        report->blk_access_time = access_time > 0 ? access_time : 0;
+        report->error_lba_valid = 0;
+        priv->blk_index++;
+
+        r = priv->read_strategy_impl->use_results(priv, req->lba, req->sectors, report);
+        if (r)
+            ret = 1;
+        ctx->progress.num += req->sectors;
+        priv->lba_to_process -= req->sectors;
+    }
+    if (nb_done)
+        ctx->report = priv->queued_reports[nb_done - 1];
+    ctx->reports = priv->queued_reports;
+    ctx->nb_reports = nb_done;
+    if (ret)
+        dc_log(DC_LOG_ERROR, "returning non-zero from Perform");
+    return ret;
+}
+
 static int Perform(DC_ProcedureCtx *ctx) {
-    ssize_t read_ret;
-    int ioctl_ret;
     int ret = 0;
     CopyPriv *priv = ctx->priv;
     size_t sectors_to_read;
@@ -265,100 +409,75 @@ static int Perform(DC_ProcedureCtx *ctx) {
     int r;
     int error_flag = 0;
 
+    // Destination writes and journal updates are done by pipeline threads
+    CopySlot *slot = copy_pipeline_get_free_slot(priv);
+    if (!slot)
+        return 1;
+
     // Updating context
     r = priv->read_strategy_impl->get_task(priv, &lba_to_read, &sectors_to_read);
     if (r)
       return r;
+    // Stuck command has come back failed after reset of device by watchdog.
+    // Progress is in journal, so if device is gone, copy can be resumed later
+    if (dc_procedure_io_reset_pending(ctx)) {
+        r = dc_procedure_reopen_io(ctx, lba_to_read);
+        if (r)
+            return r;
+    }
+    // Device may retry remaining bad sectors as long as it likes
+    if (priv->last_pass)
+        dc_procedure_restore_erc(ctx);
     if (priv->dst_file_end_lba && ((int64_t)(lba_to_read + sectors_to_read) > priv->dst_file_end_lba))
         return 1;
-    if (priv->api == Api_ePosix)
-        lseek(priv->src_fd, 512 * lba_to_read, SEEK_SET);
-    lseek(priv->dst_fd, 512 * lba_to_read, SEEK_SET);
+    if (can_queue(priv))
+        return perform_queued(ctx, lba_to_read, sectors_to_read);
+    priv->single_read = 0;
     ctx->report.lba = lba_to_read;
     ctx->report.sectors_processed = sectors_to_read;
     ctx->report.blk_status = DC_BlockStatus_eOk;
     priv->blk_index++;
 
-    // Preparing to act
-    if (priv->api == Api_eAta) {
-        memset(&priv->ata_command, 0, sizeof(priv->ata_command));
-        memset(&priv->scsi_command, 0, sizeof(priv->scsi_command));
-        prepare_ata_command(&priv->ata_command, /* WIN_READ_DMA_EXT */ 0x25, ctx->report.lba, sectors_to_read);
-        prepare_scsi_command_from_ata(&priv->scsi_command, &priv->ata_command);
-        priv->scsi_command.io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-        priv->scsi_command.io_hdr.dxferp = priv->buf;
-        priv->scsi_command.io_hdr.dxfer_len = ctx->blk_size;
-        priv->scsi_command.scsi_cmd[1] = (6 << 1) + 1;  // DMA protocol + EXTEND bit
-        priv->scsi_command.scsi_cmd[2] = 0x0e;  // CK_COND=0 T_DIR=1 BYTE_BLOCK=1 T_LENGTH=10b
-#if 0
-        int i;
-        for (i = 0; i < sizeof(priv->scsi_command.scsi_cmd); i++)
-          fprintf(stderr, "%02hhx", priv->scsi_command.scsi_cmd[i]);
-        fprintf(stderr, "\n");
-#endif
-    }
-
-    // Timing
-    _dc_proc_time_pre(ctx);
-
     // Acting
-    if (priv->api == Api_eAta)
-        ioctl_ret = ioctl(priv->src_fd, SG_IO, &priv->scsi_command);
-    else
-        read_ret = read(priv->src_fd, priv->buf, sectors_to_read * 512);
-
-    // Timing
-    _dc_proc_time_post(ctx);
+    DC_IoRequest *req = &priv->src_request;
+    req->op = DC_IoOp_eRead;
+    req->lba = lba_to_read;
+    req->sectors = sectors_to_read;
+    req->buf = slot->buf;
+    req->buf_index = -1;
+    req->timeout_ms = priv->last_pass ? ctx->timeout_ms : dc_procedure_cmd_timeout(ctx, 1, zone_is_suspect(priv));
+    r = dc_io_execute(priv->src_io, req);
+    if (r)
+        return r;
 
     // Error handling
-    if (priv->api == Api_eAta) {
-        // Updating context
-        if (ioctl_ret) {
-            ctx->report.blk_status = DC_BlockStatus_eError;
-            ret = 1;
-        }
-        ctx->report.blk_status = scsi_ata_check_return_status(&priv->scsi_command);
-        if (ctx->report.blk_status)
-            error_flag = 1;
+    ctx->report.blk_status = req->status;
+    ctx->report.blk_access_time = dc_io_request_access_time(req);
+    ctx->report.error_lba_valid = req->error_lba_valid;
+    ctx->report.error_lba = req->error_lba;
+    if (req->status != DC_BlockStatus_eOk)
+        error_flag = 1;
+
+    if (error_flag && req->error_lba_valid && sectors_to_read > 1) {
+        r = use_error_lba(ctx, slot, lba_to_read, sectors_to_read, &lba_to_read, &sectors_to_read);
+        if (r)
+            return r;
     } else {
-        if (read_ret != (ssize_t)sectors_to_read * 512) {
-            error_flag = 1;
-
-            // Updating context
-            ctx->report.blk_status = DC_BlockStatus_eError;
-        }
-    }
-
-    // Acting: writing; not timed
-    if (!error_flag) {
-        int write_ret = write(priv->dst_fd, priv->buf, sectors_to_read * 512);
-
-        // Error handling
-        if (write_ret != (ssize_t)sectors_to_read * 512) {
-            // Updating context
-            ctx->report.blk_status = DC_BlockStatus_eError;
-            // TODO Transmit to user info that _write phase_ has failed
-        }
-    }
-
-    // Updating context
-    if (priv->use_journal) {
-        char sector_status;
+        // Passing block to writer
+        slot->lba = lba_to_read;
+        slot->sectors = sectors_to_read;
         if (error_flag) {
             if (sectors_to_read == 1)
-                sector_status = SectorStatus_eSectorReadError;
+                slot->status = SectorStatus_eSectorReadError;
             else
-                sector_status = SectorStatus_eBlockReadError;
+                slot->status = SectorStatus_eBlockReadError;
         } else {
-            sector_status = SectorStatus_eReadOk;
+            slot->status = SectorStatus_eReadOk;
         }
-        assert(r != -1);
-        uint8_t journal_write[sectors_to_read];
-        memset(journal_write, sector_status, sectors_to_read);
-        lseek(priv->journal_fd, lba_to_read, SEEK_SET);
-        r = write(priv->journal_fd, journal_write, sectors_to_read);
-        assert(r == (int)sectors_to_read);
+        copy_pipeline_push(priv);
     }
+
+    // Updating context
     r = priv->read_strategy_impl->use_results(priv, lba_to_read, sectors_to_read, &ctx->report);
     if (r)
         ret = 1;
@@ -372,16 +491,16 @@ static int Perform(DC_ProcedureCtx *ctx) {
 
 static void Close(DC_ProcedureCtx *ctx) {
     CopyPriv *priv = ctx->priv;
-    int r = ioctl(priv->src_fd, BLKRASET, priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Restoring block device readahead setting failed\n");
-    free(priv->buf);
-    close(priv->src_fd);
+    copy_pipeline_stop(priv);
+    dc_io_close(priv->src_io);
     close(priv->dst_fd);
     if (priv->use_journal) {
-        close(priv->journal_fd);
+        copy_journal_close(priv->journal);
     }
     priv->read_strategy_impl->close(priv);
+    zone_map_clear(&priv->unread_zones);
+    free(priv->queued_requests);
+    free(priv->queued_reports);
 }
 
 static const char * const api_choices[] = {"ata", "posix", NULL};
@@ -392,7 +511,16 @@ static DC_ProcedureOption options[] = {
     { "read_strategy", "select from options: plain, smart, smart_noreverse, skipfail, skipfail_noreverse. See help on copy procedure for details.", offsetof(CopyPriv, read_strategy_str), DC_ProcedureOptionType_eString, strategy_choices },
     { "dst_file", "set destination file path", offsetof(CopyPriv, dst_file), DC_ProcedureOptionType_eString },
     { "use_journal", "set whether to generate and use journal for operation resume possibility (yes/no)", offsetof(CopyPriv, use_journal_str), DC_ProcedureOptionType_eString, yesno_choices },
-    { "skip_blocks", "set jump size in blocks of 256*512 bytes, when read error is met (for skipfail* strategies)", offsetof(CopyPriv, skip_blocks), DC_ProcedureOptionType_eInt64 },
+    { "sparse", "set whether to leave holes in destination instead of writing zero blocks (yes/no)", offsetof(CopyPriv, sparse_str), DC_ProcedureOptionType_eString, yesno_choices },
+    { "block_sectors", "set number of sectors read at once, or \"auto\" for largest request device takes unsplit", offsetof(CopyPriv, block_sectors_str), DC_ProcedureOptionType_eString },
+    { "skip_blocks", "set jump size in blocks, when read error is met (for skipfail* strategies)", offsetof(CopyPriv, skip_blocks), DC_ProcedureOptionType_eInt64 },
+    { "max_zones", "set maximal number of unread zones to split into (for smart* strategies)", offsetof(CopyPriv, max_zones), DC_ProcedureOptionType_eInt64 },
+    { "indivisible_zone_sectors", "set size in sectors of unread zone which is not split further (for smart* strategies)", offsetof(CopyPriv, indivisible_zone_sectors), DC_ProcedureOptionType_eInt64 },
+    { "smart_interval", "set seconds between SMART reads watching error counters, or 0 not to watch", offsetof(CopyPriv, smart_interval), DC_ProcedureOptionType_eInt64 },
+    { "timeout", "set milliseconds after which command is aborted as timed out, 0 for default, or \"auto\" to derive it from access times of healthy blocks, shorter near bad zones", offsetof(CopyPriv, timeout_str), DC_ProcedureOptionType_eString },
+    { "hang_timeout", "set seconds without completion after which stuck command is aborted by device reset, then bus reset, and device is reopened; 0 not to watch", offsetof(CopyPriv, hang_timeout), DC_ProcedureOptionType_eInt64 },
+    { "erc_timeout", "set milliseconds device may spend retrying bad sector before first pass goes on, or 0 to leave device setting", offsetof(CopyPriv, erc_timeout), DC_ProcedureOptionType_eInt64 },
+    { "queue_depth", "set number of reads in flight over healthy zones; with \"ata\" API they are NCQ commands (\"READ FPDMA QUEUED\"), and device's queue limits it. Near errors, blocks are read one by one", offsetof(CopyPriv, queue_depth), DC_ProcedureOptionType_eInt64 },
     { NULL }
 };
 
@@ -406,11 +534,18 @@ DC_Procedure copy = {
         "    ata: use ATA \"READ DMA EXT\" command.\n"
         "    posix: use POSIX read() in direct mode.\n"
         "\n"
+        "queue_depth: keep this many reads in flight while zone is healthy. With \"ata\" API and device supporting NCQ,\n"
+        "    \"READ FPDMA QUEUED\" commands are used; by default queue is as deep as device's one.\n"
+        "    Once queued read fails, blocks are read one by one, as they are near bad zones and on last pass.\n"
+        "\n"
+        "sparse: when source block is all zeros, don't write it. If destination is a new file, it is just skipped;\n"
+        "    otherwise a hole is punched in place of it, or zeros are written if destination doesn't support that.\n"
+        "\n"
         "read_strategy: choose read strategy. All strategies are designed to make least possible harm to defective source device.\n"
         "    plain: read sequentially, abort on first read fail.\n"
-        "    smart: read sequentially until read error is met. Then it reads from another end of disk space. When this ends with read error, too, it jumps to the middle of unread zone and reads forward from there. This results in having two zones of unread data. This way it jumps into middle of unread zones until there are < 1000 of them in table, and they are > 500 MB. When it cannot further jump into zones, it just reads sequentially remaining unread zones. Thus reading near failure points is delayed.\n"
+        "    smart: read sequentially until read error is met. Then it reads from another end of disk space. When this ends with read error, too, it jumps to the middle of unread zone and reads forward from there. This results in having two zones of unread data. This way it jumps into middle of unread zones until there are max_zones of them in table (1000 by default), or they are smaller than indivisible_zone_sectors (1000000 sectors by default). When it cannot further jump into zones, it just reads sequentially remaining unread zones. Thus reading near failure points is delayed.\n"
         "    smart_noreverse: same as \"smart\", but reverse reading is prohibited; jump into middle of zone is considered on forward read failure.\n"
-	"    skipfail: read sequentially until fail. Then jump skip_blocks blocks (of 256*512 bytes), and read backward up to failure. Then go forward.\n"
+	"    skipfail: read sequentially until fail. Then jump skip_blocks blocks (of block_sectors sectors), and read backward up to failure. Then go forward.\n"
 	"    skipfail_noreverse: same as \"skipfail\", but after jump data is read forward (the gap is omitted).\n"
         "",
     .suggest_default_value = SuggestDefaultValue,
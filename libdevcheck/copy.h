@@ -2,17 +2,11 @@
 #define COPY_H
 
 #include <stdlib.h>
+#include <pthread.h>
 #include "procedure.h"
-#include "scsi.h"
-
-typedef struct zone {
-    // begin_lba < end_lba
-    int64_t begin_lba;
-    int64_t end_lba;  // LBA of the first sector beyond zone
-    int begin_lba_defective;  // Whether reading near begin_lba failed
-    int end_lba_defective;  // Whether reading near end_lba failed
-    struct zone *next;
-} Zone;
+#include "io_backend.h"
+#include "copy_journal.h"
+#include "zone_map.h"
 
 enum ReadStrategy {
     ReadStrategy_ePlain,
@@ -24,33 +18,82 @@ enum ReadStrategy {
 
 typedef struct ReadStrategyImpl ReadStrategyImpl;
 
+#define COPY_PIPELINE_DEPTH 64  // Blocks read ahead of destination writes, at most
+#define COPY_PIPELINE_MAX_BYTES (64 * 1024 * 1024)  // Limits depth for big blocks
+
+typedef struct copy_slot {
+    void *buf;
+    int64_t lba;
+    size_t sectors;
+    SectorStatus status;  // Result of reading; unread if writing failed
+} CopySlot;
+
+/*
+ * Ring of blocks passing through stages: read from source (by Perform()),
+ * written to destination (by writer thread), committed to journal (by committer thread).
+ * Slot i is owned by writer if write_index <= i < read_index,
+ * by committer if commit_index <= i < write_index, and free otherwise.
+ */
+typedef struct copy_pipeline {
+    CopySlot slots[COPY_PIPELINE_DEPTH];
+    int depth;
+    void *bufs;
+    uint64_t read_index;
+    uint64_t write_index;
+    uint64_t commit_index;
+    int stop;
+    int writer_done;
+    int write_failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer_thread;
+    pthread_t committer_thread;
+} CopyPipeline;
+
 struct copy_priv {
     const char *api_str;
     const char *read_strategy_str;
     const char *dst_file;
     const char *use_journal_str;
-    int skip_blocks;
+    const char *sparse_str;
+    const char *block_sectors_str;
+    const char *timeout_str;
+    int64_t skip_blocks;
+    int64_t max_zones;
+    int64_t indivisible_zone_sectors;
+    int64_t smart_interval;
+    int64_t erc_timeout;
+    int64_t hang_timeout;
+    int64_t queue_depth;
     enum Api api;
     enum ReadStrategy read_strategy;
     ReadStrategyImpl *read_strategy_impl;
     int use_journal;
+    int sparse;
+    int dst_all_holes;  // Destination was created empty by us, so unwritten ranges read as zeros
+    int punch_hole_unsupported;
+    int64_t block_sectors;
+    int sector_size;  // Logical sector of source, in bytes
     int64_t start_lba;
     int64_t end_lba;
     int64_t lba_to_process;
-    int src_fd;
+    DC_Io *src_io;
+    DC_IoRequest src_request;
     int dst_fd;
     int64_t dst_file_end_lba;
-    void *buf;
-    AtaCommand ata_command;
-    ScsiCommand scsi_command;
-    int old_readahead;
+    CopyPipeline pipeline;
     uint64_t blk_index;
-    Zone *unread_zones;
-    int nb_zones;
+    ZoneMap unread_zones;
     Zone *current_zone;
     int current_zone_read_direction_reversive;
     void *read_strategy_priv;
-    int journal_fd;
+    int last_pass;  // Set by strategy when it goes over what is left, not avoiding errors anymore
+    CopyJournal *journal;
+    DC_BlockReport reports[2];  // Block split by failed sector, device has told which
+    // Healthy zones are read by several requests in flight, src_io->queue_depth of them
+    DC_IoRequest *queued_requests;
+    DC_BlockReport *queued_reports;
+    int single_read;  // Queued block has failed, it is read again alone to handle error exactly
 };
 typedef struct copy_priv CopyPriv;
 
@@ -62,15 +105,14 @@ struct ReadStrategyImpl {
     void (*close)(CopyPriv *copy_ctx);
 };
 
-#define SECTORS_AT_ONCE 256
-#define BLK_SIZE (SECTORS_AT_ONCE * 512) // FIXME hardcode
-#define INDIVISIBLE_DEFECT_ZONE_SIZE_SECTORS 1000*1000  // 500 MB
-
-typedef enum SectorStatus {
-    SectorStatus_eUnread = 0,
-    SectorStatus_eReadOk = 1,
-    SectorStatus_eBlockReadError = 2,
-    SectorStatus_eSectorReadError = 3,
-} SectorStatus;
+int copy_pipeline_start(CopyPriv *priv);
+// Drains pending blocks to destination and journal, then stops threads
+void copy_pipeline_stop(CopyPriv *priv);
+// Waits for free slot; NULL if writing to destination has failed
+CopySlot *copy_pipeline_get_free_slot(CopyPriv *priv);
+// Free slots in order they are to be pushed, without waiting; returns their number, 0 if writing has failed
+int copy_pipeline_get_free_slots(CopyPriv *priv, CopySlot **slots, int max_slots);
+// Passes slot returned by copy_pipeline_get_free_slot() to writer
+void copy_pipeline_push(CopyPriv *priv);
 
 #endif  // COPY_H
@@ -0,0 +1,380 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <libgen.h>
+
+#include "libdevcheck.h"
+#include "copy_journal.h"
+
+// Status characters as in ddrescue mapfiles
+static const char status_chars[] = {
+    [SectorStatus_eUnread] = '?',  // non-tried
+    [SectorStatus_eReadOk] = '+',  // finished
+    [SectorStatus_eBlockReadError] = '*',  // non-trimmed
+    [SectorStatus_eSectorReadError] = '-',  // bad sector
+};
+
+static int status_from_char(char c, SectorStatus *status) {
+    switch (c) {
+        case '?': *status = SectorStatus_eUnread; return 0;
+        case '+': *status = SectorStatus_eReadOk; return 0;
+        case '*':
+        case '/': *status = SectorStatus_eBlockReadError; return 0;
+        case '-': *status = SectorStatus_eSectorReadError; return 0;
+        default: return 1;
+    }
+}
+
+// Index of run containing lba
+static int find_run(CopyJournal *journal, int64_t lba) {
+    int lo = 0;
+    int hi = journal->nb_runs - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (journal->runs[mid].begin_lba <= lba)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Replace runs [index, index + old_count) with given ones
+static void replace_runs(CopyJournal *journal, int index, int old_count, JournalRun *new_runs, int new_count) {
+    int needed = journal->nb_runs - old_count + new_count;
+    if (needed > journal->runs_allocated) {
+        int allocated = journal->runs_allocated * 2 > needed ? journal->runs_allocated * 2 : needed;
+        journal->runs = realloc(journal->runs, allocated * sizeof(JournalRun));
+        assert(journal->runs);
+        journal->runs_allocated = allocated;
+    }
+    memmove(&journal->runs[index + new_count], &journal->runs[index + old_count],
+            (journal->nb_runs - index - old_count) * sizeof(JournalRun));
+    memcpy(&journal->runs[index], new_runs, new_count * sizeof(JournalRun));
+    journal->nb_runs = needed;
+}
+
+static void journal_apply(CopyJournal *journal, int64_t lba, int64_t sectors, SectorStatus status) {
+    assert(lba >= 0 && sectors > 0 && lba + sectors <= journal->end_lba);
+    int first = find_run(journal, lba);
+    int last = find_run(journal, lba + sectors - 1);
+    // Cover neighbours too, to merge with them
+    if (first > 0)
+        first--;
+    if (last < journal->nb_runs - 1)
+        last++;
+
+    JournalRun pieces[5];
+    int nb_pieces = 0;
+    for (int i = first; i <= last; i++) {
+        JournalRun run = journal->runs[i];
+        if (run.begin_lba < lba) {
+            pieces[nb_pieces] = run;
+            if (pieces[nb_pieces].end_lba > lba)
+                pieces[nb_pieces].end_lba = lba;
+            nb_pieces++;
+        }
+        if (run.begin_lba <= lba && lba < run.end_lba)
+            pieces[nb_pieces++] = (JournalRun){ .begin_lba = lba, .end_lba = lba + sectors, .status = status };
+        if (run.end_lba > lba + sectors) {
+            pieces[nb_pieces] = run;
+            if (pieces[nb_pieces].begin_lba < lba + sectors)
+                pieces[nb_pieces].begin_lba = lba + sectors;
+            nb_pieces++;
+        }
+    }
+
+    // Merge pieces of same status
+    int nb_merged = 1;
+    for (int i = 1; i < nb_pieces; i++) {
+        if (pieces[i].status == pieces[nb_merged - 1].status)
+            pieces[nb_merged - 1].end_lba = pieces[i].end_lba;
+        else
+            pieces[nb_merged++] = pieces[i];
+    }
+    replace_runs(journal, first, last - first + 1, pieces, nb_merged);
+}
+
+static int format_run(CopyJournal *journal, char *buf, size_t bufsize, int64_t lba, int64_t sectors, SectorStatus status) {
+    return snprintf(buf, bufsize, "0x%08"PRIX64"  0x%08"PRIX64"  %c\n",
+            lba * journal->sector_size, sectors * journal->sector_size, status_chars[status]);
+}
+
+static int parse_run(CopyJournal *journal, const char *line, int64_t *lba, int64_t *sectors, SectorStatus *status) {
+    uint64_t pos, size;
+    char status_char;
+    if (sscanf(line, "%"SCNx64" %"SCNx64" %c", &pos, &size, &status_char) != 3)
+        return 1;
+    if ((pos % journal->sector_size) || (size % journal->sector_size) || !size)
+        return 1;
+    *lba = pos / journal->sector_size;
+    *sectors = size / journal->sector_size;
+    return status_from_char(status_char, status);
+}
+
+static int journal_load_mapfile(CopyJournal *journal, FILE *f) {
+    char line[200];
+    int status_line_seen = 0;
+    int64_t expected_lba = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (!status_line_seen) {  // "current_pos current_status [current_pass]", not used by us
+            status_line_seen = 1;
+            continue;
+        }
+        int64_t lba, sectors;
+        SectorStatus status;
+        if (parse_run(journal, line, &lba, &sectors, &status) || lba != expected_lba || lba + sectors > journal->end_lba) {
+            dc_log(DC_LOG_ERROR, "Malformed journal line: %s", line);
+            return 1;
+        }
+        journal_apply(journal, lba, sectors, status);
+        expected_lba = lba + sectors;
+    }
+    if (expected_lba != journal->end_lba) {
+        dc_log(DC_LOG_ERROR, "Journal covers %"PRId64" sectors, while device has %"PRId64"\n",
+                expected_lba, journal->end_lba);
+        return 1;
+    }
+    return 0;
+}
+
+static int journal_replay_log(CopyJournal *journal) {
+    FILE *f = fopen(journal->log_path, "r");
+    if (!f)
+        return errno == ENOENT ? 0 : 1;
+    char line[200];
+    int64_t lba, sectors;
+    SectorStatus status;
+    while (fgets(line, sizeof(line), f)) {
+        // Last line may be torn if we were interrupted while writing it
+        if (parse_run(journal, line, &lba, &sectors, &status) || lba + sectors > journal->end_lba)
+            break;
+        journal_apply(journal, lba, sectors, status);
+    }
+    fclose(f);
+    return 0;
+}
+
+// Journal of former format has one byte per 512-byte sector, holding SectorStatus
+#define LEGACY_SECTOR_SIZE 512
+
+/*
+ * Status of logical sector from its 512-byte parts. It is read only as a whole,
+ * so any unread part makes it unread to be read again, else any failed part fails it.
+ */
+static int legacy_status(const uint8_t *parts, int nb_parts, uint8_t *status) {
+    *status = SectorStatus_eReadOk;
+    for (int i = 0; i < nb_parts; i++) {
+        if (parts[i] > SectorStatus_eSectorReadError)
+            return 1;
+        if (parts[i] == SectorStatus_eUnread)
+            *status = SectorStatus_eUnread;
+        else if (parts[i] != SectorStatus_eReadOk && *status != SectorStatus_eUnread)
+            *status = parts[i];
+    }
+    return 0;
+}
+
+static int journal_load_legacy(CopyJournal *journal, int fd) {
+    uint8_t chunk[1*1024*1024];  // Holds whole logical sectors, as their size is a power of two
+    int nb_parts = journal->sector_size / LEGACY_SECTOR_SIZE;
+    int64_t legacy_end = journal->end_lba * nb_parts;
+    int64_t run_begin = 0;
+    uint8_t run_status = SectorStatus_eUnread;
+    int64_t pos = 0;
+    while (pos < legacy_end) {
+        int64_t chunklen = legacy_end - pos < (int64_t)sizeof(chunk) ? legacy_end - pos : (int64_t)sizeof(chunk);
+        ssize_t r = read(fd, chunk, chunklen);
+        if (r != chunklen)
+            return 1;
+        for (int64_t i = 0; i < chunklen; i += nb_parts) {
+            int64_t lba = (pos + i) / nb_parts;
+            uint8_t status;
+            if (legacy_status(chunk + i, nb_parts, &status))
+                return 1;
+            if (status == run_status)
+                continue;
+            if (lba > run_begin)
+                journal_apply(journal, run_begin, lba - run_begin, run_status);
+            run_begin = lba;
+            run_status = status;
+        }
+        pos += chunklen;
+    }
+    journal_apply(journal, run_begin, journal->end_lba - run_begin, run_status);
+    return 0;
+}
+
+static int journal_load(CopyJournal *journal) {
+    struct stat st;
+    if (stat(journal->path, &st) == -1)
+        return errno == ENOENT ? 0 : 1;
+
+    int fd = open(journal->path, O_RDONLY | O_LARGEFILE);
+    if (fd == -1)
+        return 1;
+    uint8_t first_byte = '#';
+    int r = read(fd, &first_byte, 1);
+    if (r == 1 && first_byte <= SectorStatus_eSectorReadError) {
+        // Sector size of source isn't recorded, so legacy size is checked against capacity
+        int64_t capacity = journal->end_lba * journal->sector_size;
+        if (journal->sector_size % LEGACY_SECTOR_SIZE || st.st_size != capacity / LEGACY_SECTOR_SIZE) {
+            dc_log(DC_LOG_ERROR, "Size of journal file %s of former format (%"PRId64" bytes) doesn't match "
+                    "source capacity (%"PRId64" bytes, one byte per 512-byte sector expected)\n",
+                    journal->path, (int64_t)st.st_size, capacity);
+            close(fd);
+            return 1;
+        }
+        dc_log(DC_LOG_INFO, "Converting journal %s to mapfile format\n", journal->path);
+        lseek(fd, 0, SEEK_SET);
+        r = journal_load_legacy(journal, fd);
+        close(fd);
+        return r;  // Mapfile will replace it on first checkpoint
+    }
+    close(fd);
+
+    FILE *f = fopen(journal->path, "r");
+    if (!f)
+        return 1;
+    r = journal_load_mapfile(journal, f);
+    fclose(f);
+    if (r)
+        return r;
+    return journal_replay_log(journal);
+}
+
+CopyJournal *copy_journal_open(const char *path, int64_t end_lba, int sector_size) {
+    int r;
+    CopyJournal *journal = calloc(1, sizeof(*journal));
+    assert(journal);
+    journal->end_lba = end_lba;
+    journal->sector_size = sector_size;
+    journal->path = strdup(path);
+    r = asprintf(&journal->log_path, "%s.log", path);
+    assert(journal->path && r != -1);
+    journal->runs_allocated = 16;
+    journal->runs = calloc(journal->runs_allocated, sizeof(JournalRun));
+    assert(journal->runs);
+    journal->runs[0] = (JournalRun){ .begin_lba = 0, .end_lba = end_lba, .status = SectorStatus_eUnread };
+    journal->nb_runs = 1;
+    journal->log_fd = -1;
+
+    r = journal_load(journal);
+    if (r)
+        goto fail;
+    journal->log_fd = open(journal->log_path, O_WRONLY | O_APPEND | O_CREAT | O_NOATIME, S_IRUSR | S_IWUSR);
+    if (journal->log_fd == -1)
+        goto fail;
+    // Fold replayed log into mapfile, this also creates mapfile if it's missing
+    r = copy_journal_checkpoint(journal);
+    if (r)
+        goto fail;
+    return journal;
+
+fail:
+    dc_log(DC_LOG_ERROR, "Failed to open journal file %s\n", path);
+    copy_journal_close(journal);
+    return NULL;
+}
+
+void copy_journal_close(CopyJournal *journal) {
+    if (journal->log_fd != -1) {
+        copy_journal_checkpoint(journal);
+        close(journal->log_fd);
+    }
+    free(journal->runs);
+    free(journal->log_path);
+    free(journal->path);
+    free(journal);
+}
+
+void copy_journal_set(CopyJournal *journal, int64_t lba, int64_t sectors, SectorStatus status) {
+    char line[80];
+    int len;
+    struct timespec now;
+    journal_apply(journal, lba, sectors, status);
+
+    clock_gettime(DC_BEST_CLOCK, &now);
+    if (now.tv_sec - journal->last_checkpoint.tv_sec >= JOURNAL_CHECKPOINT_INTERVAL_SEC) {
+        copy_journal_checkpoint(journal);
+        return;
+    }
+    len = format_run(journal, line, sizeof(line), lba, sectors, status);
+    if (write(journal->log_fd, line, len) != len)
+        dc_log(DC_LOG_WARNING, "Writing journal log failed\n");
+    // Syncing every update would cost a disk flush per block
+    if (now.tv_sec - journal->last_log_sync.tv_sec >= JOURNAL_LOG_SYNC_INTERVAL_SEC) {
+        if (fdatasync(journal->log_fd))
+            dc_log(DC_LOG_WARNING, "Syncing journal log failed\n");
+        journal->last_log_sync = now;
+    }
+}
+
+// Makes rename in directory of path durable
+static int fsync_parent_dir(const char *path) {
+    char *dir_path = strdup(path);
+    assert(dir_path);
+    int fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY);
+    free(dir_path);
+    if (fd == -1)
+        return 1;
+    int r = fsync(fd);
+    close(fd);
+    return r ? 1 : 0;
+}
+
+int copy_journal_checkpoint(CopyJournal *journal) {
+    char *tmp_path;
+    char line[80];
+    int r = asprintf(&tmp_path, "%s.tmp", journal->path);
+    assert(r != -1);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f)
+        goto fail_open;
+    fprintf(f, "# Mapfile. Created by WHDD " WHDD_VERSION "\n"
+            "# current_pos  current_status\n"
+            "0x%08X     ?\n"
+            "#      pos        size  status\n", 0);
+    for (int i = 0; i < journal->nb_runs; i++) {
+        JournalRun *run = &journal->runs[i];
+        format_run(journal, line, sizeof(line), run->begin_lba, run->end_lba - run->begin_lba, run->status);
+        fputs(line, f);
+    }
+    if (fflush(f) || fdatasync(fileno(f))) {
+        fclose(f);
+        goto fail_write;
+    }
+    if (fclose(f))
+        goto fail_write;
+    if (rename(tmp_path, journal->path) == -1)
+        goto fail_write;
+    free(tmp_path);
+    // Else old mapfile may come back after crash, while log is truncated below
+    if (fsync_parent_dir(journal->path)) {
+        dc_log(DC_LOG_ERROR, "Failed to sync directory of journal file %s\n", journal->path);
+        return 1;
+    }
+
+    // Everything in log is in mapfile now
+    if (journal->log_fd != -1 && ftruncate(journal->log_fd, 0) == -1)
+        dc_log(DC_LOG_WARNING, "Truncating journal log failed\n");
+    clock_gettime(DC_BEST_CLOCK, &journal->last_checkpoint);
+    journal->last_log_sync = journal->last_checkpoint;
+    return 0;
+
+fail_write:
+    unlink(tmp_path);
+fail_open:
+    dc_log(DC_LOG_ERROR, "Failed to write journal file %s\n", journal->path);
+    free(tmp_path);
+    return 1;
+}
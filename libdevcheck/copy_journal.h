@@ -0,0 +1,57 @@
+#ifndef COPY_JOURNAL_H
+#define COPY_JOURNAL_H
+
+#include <inttypes.h>
+#include <time.h>
+
+typedef enum SectorStatus {
+    SectorStatus_eUnread = 0,
+    SectorStatus_eReadOk = 1,
+    SectorStatus_eBlockReadError = 2,
+    SectorStatus_eSectorReadError = 3,
+} SectorStatus;
+
+typedef struct journal_run {
+    int64_t begin_lba;
+    int64_t end_lba;  // LBA of the first sector beyond run
+    SectorStatus status;
+} JournalRun;
+
+/*
+ * Copy journal is kept in memory as sorted array of runs, covering whole device space.
+ * Adjacent runs always have different status.
+ *
+ * On disk it is stored as ddrescue-compatible mapfile, which is rewritten atomically on checkpoints.
+ * Between checkpoints, updates are appended to "<journal>.log" and replayed on open.
+ * Log is synced at most JOURNAL_LOG_SYNC_INTERVAL_SEC after update, so crash loses no older ones.
+ */
+typedef struct copy_journal {
+    char *path;
+    char *log_path;
+    int64_t end_lba;
+    int sector_size;  // Mapfile is in bytes, runs are in sectors
+    JournalRun *runs;
+    int nb_runs;
+    int runs_allocated;
+    int log_fd;
+    struct timespec last_checkpoint;
+    struct timespec last_log_sync;
+} CopyJournal;
+
+#define JOURNAL_CHECKPOINT_INTERVAL_SEC 10
+#define JOURNAL_LOG_SYNC_INTERVAL_SEC 1
+
+/**
+ * Open journal at path, or create new one with all space unread.
+ * Legacy journals with one byte per sector are converted.
+ * @return NULL on failure
+ */
+CopyJournal *copy_journal_open(const char *path, int64_t end_lba, int sector_size);
+void copy_journal_close(CopyJournal *journal);
+
+void copy_journal_set(CopyJournal *journal, int64_t lba, int64_t sectors, SectorStatus status);
+
+// Atomically rewrite mapfile with current state, and truncate update log
+int copy_journal_checkpoint(CopyJournal *journal);
+
+#endif  // COPY_JOURNAL_H
@@ -0,0 +1,173 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "libdevcheck.h"
+#include "utils.h"
+#include "copy.h"
+
+// Returns 0 if destination range now reads as zeros without writing to it
+static int make_hole(CopyPriv *priv, CopySlot *slot) {
+    if (priv->dst_all_holes)
+        return 0;
+    if (priv->punch_hole_unsupported)
+        return 1;
+    if (!fallocate(priv->dst_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, slot->lba * priv->sector_size, slot->sectors * priv->sector_size))
+        return 0;
+    dc_log(DC_LOG_WARNING, "Destination doesn't support punching holes, zero blocks will be written\n");
+    priv->punch_hole_unsupported = 1;
+    return 1;
+}
+
+static void *writer_thread_routine(void *arg) {
+    CopyPriv *priv = arg;
+    CopyPipeline *pipeline = &priv->pipeline;
+    pthread_mutex_lock(&pipeline->lock);
+    while (1) {
+        while (pipeline->write_index == pipeline->read_index && !pipeline->stop)
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        if (pipeline->write_index == pipeline->read_index)
+            break;  // Stopped and drained
+        CopySlot *slot = &pipeline->slots[pipeline->write_index % pipeline->depth];
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int failed = 0;
+        if (slot->status == SectorStatus_eReadOk) {
+            ssize_t len = slot->sectors * priv->sector_size;
+            if (priv->sparse && dc_buffer_is_zero(slot->buf, len) && !make_hole(priv, slot))
+                len = 0;  // Nothing to write; journal gets it as copied all the same
+            if (len && pwrite(priv->dst_fd, slot->buf, len, slot->lba * priv->sector_size) != len) {
+                // Keep journal telling these sectors are still to be copied
+                slot->status = SectorStatus_eUnread;
+                failed = 1;
+            }
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (failed && !pipeline->write_failed) {
+            dc_log(DC_LOG_ERROR, "Writing to destination failed at LBA %"PRId64"\n", slot->lba);
+            pipeline->write_failed = 1;
+        }
+        pipeline->write_index++;
+        pthread_cond_broadcast(&pipeline->cond);
+    }
+    pipeline->writer_done = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+// Journal checkpoints do fsync, so they are kept away from both reading and writing
+static void *committer_thread_routine(void *arg) {
+    CopyPriv *priv = arg;
+    CopyPipeline *pipeline = &priv->pipeline;
+    pthread_mutex_lock(&pipeline->lock);
+    while (1) {
+        while (pipeline->commit_index == pipeline->write_index && !pipeline->writer_done)
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        if (pipeline->commit_index == pipeline->write_index)
+            break;  // Writer has finished, and all it wrote is committed
+        CopySlot *slot = &pipeline->slots[pipeline->commit_index % pipeline->depth];
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (priv->use_journal && slot->status != SectorStatus_eUnread)
+            copy_journal_set(priv->journal, slot->lba, slot->sectors, slot->status);
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->commit_index++;
+        pthread_cond_broadcast(&pipeline->cond);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+int copy_pipeline_start(CopyPriv *priv) {
+    CopyPipeline *pipeline = &priv->pipeline;
+    int r;
+    size_t blk_size = priv->block_sectors * priv->sector_size;
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->depth = COPY_PIPELINE_MAX_BYTES / blk_size;
+    if (pipeline->depth > COPY_PIPELINE_DEPTH)
+        pipeline->depth = COPY_PIPELINE_DEPTH;
+    if (pipeline->depth < 2)
+        pipeline->depth = 2;
+    r = posix_memalign(&pipeline->bufs, sysconf(_SC_PAGESIZE), pipeline->depth * blk_size);
+    if (r)
+        goto fail_buf;
+    for (int i = 0; i < pipeline->depth; i++)
+        pipeline->slots[i].buf = (uint8_t*)pipeline->bufs + i * blk_size;
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+
+    r = pthread_create(&pipeline->writer_thread, NULL, writer_thread_routine, priv);
+    if (r)
+        goto fail_writer;
+    r = pthread_create(&pipeline->committer_thread, NULL, committer_thread_routine, priv);
+    if (r)
+        goto fail_committer;
+    return 0;
+
+fail_committer:
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stop = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+    pthread_join(pipeline->writer_thread, NULL);
+fail_writer:
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline->bufs);
+fail_buf:
+    dc_log(DC_LOG_FATAL, "Failed to start copy pipeline\n");
+    return 1;
+}
+
+void copy_pipeline_stop(CopyPriv *priv) {
+    CopyPipeline *pipeline = &priv->pipeline;
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stop = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+    pthread_join(pipeline->writer_thread, NULL);
+    pthread_join(pipeline->committer_thread, NULL);
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline->bufs);
+}
+
+CopySlot *copy_pipeline_get_free_slot(CopyPriv *priv) {
+    CopyPipeline *pipeline = &priv->pipeline;
+    CopySlot *slot = NULL;
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->read_index - pipeline->commit_index == (uint64_t)pipeline->depth && !pipeline->write_failed)
+        pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    if (!pipeline->write_failed)
+        slot = &pipeline->slots[pipeline->read_index % pipeline->depth];
+    pthread_mutex_unlock(&pipeline->lock);
+    return slot;
+}
+
+int copy_pipeline_get_free_slots(CopyPriv *priv, CopySlot **slots, int max_slots) {
+    CopyPipeline *pipeline = &priv->pipeline;
+    int nb_slots = 0;
+    pthread_mutex_lock(&pipeline->lock);
+    if (!pipeline->write_failed)
+        nb_slots = pipeline->depth - (pipeline->read_index - pipeline->commit_index);
+    if (nb_slots > max_slots)
+        nb_slots = max_slots;
+    for (int i = 0; i < nb_slots; i++)
+        slots[i] = &pipeline->slots[(pipeline->read_index + i) % pipeline->depth];
+    pthread_mutex_unlock(&pipeline->lock);
+    return nb_slots;
+}
+
+void copy_pipeline_push(CopyPriv *priv) {
+    CopyPipeline *pipeline = &priv->pipeline;
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->read_index++;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
@@ -14,12 +14,12 @@ typedef struct SkipfailStrategyCtx {
 static int common_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t sectors_to_read, DC_BlockReport *report);
 
 static int plain_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_to_read) {
-    Zone *zone = priv->unread_zones;
+    Zone *zone = zone_map_first(&priv->unread_zones);
     priv->current_zone = zone;
     *lba_to_read = zone->begin_lba;
     *sectors_to_read = zone->end_lba - zone->begin_lba;
-    if (*sectors_to_read > SECTORS_AT_ONCE)
-        *sectors_to_read = SECTORS_AT_ONCE;
+    if (*sectors_to_read > (size_t)priv->block_sectors)
+        *sectors_to_read = priv->block_sectors;
     return 0;
 }
 
@@ -28,21 +28,26 @@ static int plain_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t sector
     return report->blk_status;
 }
 
-static Zone *find_largest_zone(CopyPriv *priv) {
-    Zone *largest_zone = priv->unread_zones;
-    Zone *entry;
-    for (entry = priv->unread_zones->next; entry; entry = entry->next) {
-        if ((largest_zone->end_lba - largest_zone->begin_lba)
-                < (entry->end_lba - entry->begin_lba))
-            largest_zone = entry;
-    }
-    return largest_zone;
+// Splits zone in two at given LBA, returns the latter part
+static Zone *split_zone(CopyPriv *priv, Zone *entry, int64_t split_lba) {
+    Zone *newentry = calloc(1, sizeof(Zone));
+    assert(newentry);
+    newentry->end_lba = entry->end_lba;
+    newentry->end_lba_defective = entry->end_lba_defective;
+    newentry->begin_lba = split_lba;
+    newentry->begin_lba -= (newentry->begin_lba % priv->block_sectors);  // align to block size
+    assert((entry->begin_lba < newentry->begin_lba) && (newentry->begin_lba < newentry->end_lba));
+    entry->end_lba = newentry->begin_lba;
+    entry->end_lba_defective = 0;
+    zone_map_update(&priv->unread_zones, entry);
+    zone_map_insert(&priv->unread_zones, newentry);
+    return newentry;
 }
 
 static int give_task_proceeding_current_zone(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_to_read) {
     Zone *entry = priv->current_zone;
     int64_t zone_length_sectors = entry->end_lba - entry->begin_lba;
-    *sectors_to_read = (zone_length_sectors < SECTORS_AT_ONCE) ? zone_length_sectors : SECTORS_AT_ONCE;
+    *sectors_to_read = (zone_length_sectors < priv->block_sectors) ? zone_length_sectors : priv->block_sectors;
     if (priv->current_zone_read_direction_reversive)
         *lba_to_read = entry->end_lba - *sectors_to_read;
     else
@@ -51,31 +56,24 @@ static int give_task_proceeding_current_zone(CopyPriv *priv, int64_t *lba_to_rea
 }
 
 static int smart_set_first_processable_zone_current(CopyPriv *priv) {
-    Zone *entry;
     // Search for zone with non-defective border (beginning or end)
-    for (entry = priv->unread_zones; entry; entry = entry->next) {
-        if (!entry->begin_lba_defective) {
-            priv->current_zone = entry;
-            priv->current_zone_read_direction_reversive = 0;
-            return 0;
-        }
-        if (priv->read_strategy == ReadStrategy_eSmartNoReverse)
-            continue;
-        if (!entry->end_lba_defective) {
-            priv->current_zone = entry;
-            priv->current_zone_read_direction_reversive = 1;
-            return 0;
-        }
-    }
-    return 1;
+    ZoneQuery query = {
+        .clean_begin = 1,
+        .clean_end = priv->read_strategy != ReadStrategy_eSmartNoReverse,
+    };
+    Zone *entry = zone_map_find_first(&priv->unread_zones, &query);
+    if (!entry)
+        return 1;
+    priv->current_zone = entry;
+    priv->current_zone_read_direction_reversive = entry->begin_lba_defective;
+    return 0;
 }
 
 static int smart_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_to_read) {
     int r;
     Zone *entry;
     SmartStrategyCtx *smart_ctx = priv->read_strategy_priv;
-    assert(priv->unread_zones);  // We should not be there if all space has been read
-    assert(priv->nb_zones);
+    assert(priv->unread_zones.root);  // We should not be there if all space has been read
 
     // If we have current zone and it is ok, proceed with it to avoid jumps
     if (priv->current_zone)
@@ -83,7 +81,7 @@ static int smart_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_
 
     if (smart_ctx->stage == 1) {
         // Consequentially read forward, ignoring errors
-        priv->current_zone = priv->unread_zones;
+        priv->current_zone = zone_map_first(&priv->unread_zones);
         priv->current_zone_read_direction_reversive = 0;
         return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
     }
@@ -95,24 +93,13 @@ static int smart_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_
 
     // There are only zones with defective borders (both ends, in case of ReadStrategy_eSmart)
     // Find largest unread zone
-    entry = find_largest_zone(priv);
+    entry = zone_map_largest(&priv->unread_zones);
     assert(entry->begin_lba_defective);
     assert((priv->read_strategy == ReadStrategy_eSmartNoReverse) || entry->end_lba_defective);
     int64_t zone_length_sectors = entry->end_lba - entry->begin_lba;
-    if ((zone_length_sectors > INDIVISIBLE_DEFECT_ZONE_SIZE_SECTORS)  // Enough big zone to try in middle of it
-            && (priv->nb_zones < 1000)) {  // And we won't get in trouble of inflation of zones list
-        priv->nb_zones++;
-        Zone *newentry = calloc(1, sizeof(Zone));
-        assert(newentry);
-        newentry->next = entry->next;
-        entry->next = newentry;
-        newentry->end_lba = entry->end_lba;
-        newentry->end_lba_defective = entry->end_lba_defective;
-        newentry->begin_lba = entry->begin_lba + (zone_length_sectors / 2);
-        newentry->begin_lba -= (newentry->begin_lba % SECTORS_AT_ONCE);  // align to block size
-        assert((entry->begin_lba < newentry->begin_lba) && (newentry->begin_lba < newentry->end_lba));
-        entry->end_lba = newentry->begin_lba;
-        entry->end_lba_defective = 0;
+    if ((zone_length_sectors > priv->indivisible_zone_sectors)  // Enough big zone to try in middle of it
+            && (priv->unread_zones.nb_zones < priv->max_zones)) {  // And we won't get in trouble of inflation of zones list
+        split_zone(priv, entry, entry->begin_lba + (zone_length_sectors / 2));
 
         r = smart_set_first_processable_zone_current(priv);
         if (r)
@@ -120,7 +107,8 @@ static int smart_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_
         return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
     } else {
         smart_ctx->stage = 1;
-        priv->current_zone = priv->unread_zones;
+        priv->last_pass = 1;
+        priv->current_zone = zone_map_first(&priv->unread_zones);
         priv->current_zone_read_direction_reversive = 0;
         return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
     }
@@ -152,20 +140,11 @@ static int common_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t secto
     assert(zone->begin_lba <= zone->end_lba);
     // Check if zone got zero length and remove it in such case
     if (zone->begin_lba == zone->end_lba) {
-        Zone *prev;
-        Zone *entry;
-        for (prev = NULL, entry = priv->unread_zones; entry; prev = entry, entry = entry->next) {
-            if (entry == zone) {
-                if (prev)
-                    prev->next = entry->next;
-                else
-                    priv->unread_zones = entry->next;
-                free(entry);
-                priv->nb_zones--;
-                break;
-            }
-        }
+        zone_map_remove(&priv->unread_zones, zone);
+        free(zone);
         priv->current_zone = NULL;
+    } else {
+        zone_map_update(&priv->unread_zones, zone);
     }
     return 0;
 }
@@ -174,57 +153,48 @@ static int skipfail_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *secto
     Zone *entry;
     SkipfailStrategyCtx *skipfail_ctx = priv->read_strategy_priv;
     (void)skipfail_ctx;
-    assert(priv->unread_zones);  // We should not be there if all space has been read
-    assert(priv->nb_zones);
+    assert(priv->unread_zones.root);  // We should not be there if all space has been read
 
     // If we have current zone and it is ok, proceed with it to avoid jumps
     if (priv->current_zone)
         return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
 
-    // There are only zones with defective borders
-    entry = priv->unread_zones;
-    while (entry) {
-        int64_t zone_length_sectors = entry->end_lba - entry->begin_lba;
-        if (!entry->begin_lba_defective) {
-            priv->current_zone = entry;
+    // Find first zone which we can read from either border, or jump into
+    ZoneQuery query = {
+        .clean_begin = 1,
+        .clean_end = priv->read_strategy != ReadStrategy_eSkipfailNoReverse,
+        .longer_than = priv->skip_blocks * priv->block_sectors,
+    };
+    entry = zone_map_find_first(&priv->unread_zones, &query);
+    if (!entry)
+        return 1;  // All remaining zones are too small to jump into them
+    int64_t zone_length_sectors = entry->end_lba - entry->begin_lba;
+    if (!entry->begin_lba_defective) {
+        priv->current_zone = entry;
+        priv->current_zone_read_direction_reversive = 0;
+        return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
+    } else if ((priv->read_strategy != ReadStrategy_eSkipfailNoReverse)
+            && !entry->end_lba_defective
+            && zone_map_next(entry) /* Don't read from end of disk */) {
+        priv->current_zone = entry;
+        priv->current_zone_read_direction_reversive = 1;
+        return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
+    } else if (zone_length_sectors > priv->skip_blocks * priv->block_sectors) {  // Enough big zone to try in middle of it
+        Zone *newentry = split_zone(priv, entry, entry->begin_lba + priv->skip_blocks * priv->block_sectors);
+        //fprintf(stderr, "Made up new zone. New zones list:\n");
+        //for (Zone *iter = zone_map_first(&priv->unread_zones); iter; iter = zone_map_next(iter)) {
+        //    fprintf(stderr, "begin_lba %"PRId64", end_lba %"PRId64"; begin defective: %d, end defective: %d\n", iter->begin_lba, iter->end_lba, iter->begin_lba_defective, iter->end_lba_defective);
+        //}
+        if (priv->read_strategy == ReadStrategy_eSkipfailNoReverse) {
+            priv->current_zone = newentry;
             priv->current_zone_read_direction_reversive = 0;
-            return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
-        } else if ((priv->read_strategy != ReadStrategy_eSkipfailNoReverse)
-                && !entry->end_lba_defective
-                && entry->next /* Don't read from end of disk */) {
+        } else {
             priv->current_zone = entry;
             priv->current_zone_read_direction_reversive = 1;
-            return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
-        } else if ((zone_length_sectors > priv->skip_blocks * SECTORS_AT_ONCE)  // Enough big zone to try in middle of it
-                ) {
-            priv->nb_zones++;
-            Zone *newentry = calloc(1, sizeof(Zone));
-            assert(newentry);
-            newentry->next = entry->next;
-            entry->next = newentry;
-            newentry->end_lba = entry->end_lba;
-            newentry->end_lba_defective = entry->end_lba_defective;
-            newentry->begin_lba = entry->begin_lba + priv->skip_blocks * SECTORS_AT_ONCE;
-            newentry->begin_lba -= (newentry->begin_lba % SECTORS_AT_ONCE);  // align to block size
-            assert((entry->begin_lba < newentry->begin_lba) && (newentry->begin_lba < newentry->end_lba));
-            entry->end_lba = newentry->begin_lba;
-            entry->end_lba_defective = 0;
-            //fprintf(stderr, "Made up new zone. New zones list:\n");
-            //for (Zone *iter = priv->unread_zones; iter; iter = iter->next) {
-            //    fprintf(stderr, "begin_lba %"PRId64", end_lba %"PRId64"; begin defective: %d, end defective: %d\n", iter->begin_lba, iter->end_lba, iter->begin_lba_defective, iter->end_lba_defective);
-            //}
-            if (priv->read_strategy == ReadStrategy_eSkipfailNoReverse) {
-                priv->current_zone = newentry;
-                priv->current_zone_read_direction_reversive = 0;
-            } else {
-                priv->current_zone = entry;
-                priv->current_zone_read_direction_reversive = 1;
-            }
-            return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
         }
-        entry = entry->next;
+        return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
     }
-    return 1;  // All remaining zones are too small to jump into them
+    return 1;  // Only the last zone is left, and it can only be read from end of disk
 }
 
 static int skipfail_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t sectors_to_read, DC_BlockReport *report) {
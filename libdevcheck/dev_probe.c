@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "libdevcheck.h"
+#include "utils.h"
+#include "ata_session.h"
+#include "dev_probe.h"
+
+static void *probe_thread_routine(void *arg) {
+    DC_DevProbe *probe = arg;
+    // Single open for all commands. Non-blocking, so that drive without media doesn't hold us
+    int fd = open(probe->dev_path, O_RDWR | O_NONBLOCK);
+    if (fd == -1)
+        fd = open(probe->dev_path, O_RDONLY | O_NONBLOCK);
+    if (fd != -1) {
+        int logical, physical;
+        if (!ioctl(fd, BLKSSZGET, &logical) && !ioctl(fd, BLKPBSZGET, &physical)
+                && logical >= 512 && physical >= logical) {
+            probe->kernel_logical_sector_size = logical;
+            probe->kernel_physical_sector_size = physical;
+        }
+        DC_AtaSession *session = dc_ata_session_open_fd(fd);
+        probe->ata_capable = session && !dc_ata_session_identify(session, probe->identify);
+        if (probe->ata_capable) {
+            dc_ata_identify_sector_sizes(probe->identify,
+                    &probe->ata_logical_sector_size, &probe->ata_physical_sector_size);
+            probe->max_lba = dc_ata_identify_max_lba(probe->identify);
+            probe->native_max_lba_valid = !dc_ata_session_read_native_max_lba(session, &probe->native_max_lba);
+            dc_ata_ascii_to_c_string(probe->identify + 20, 10, probe->serial_no);
+            dc_ata_ascii_to_c_string(probe->identify + 54, 20, probe->model_str);
+        }
+        if (session)
+            dc_ata_session_close(session);
+        close(fd);
+    }
+    // Publishes results along with flag
+    __atomic_store_n(&probe->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void probe_free(DC_DevProbe *probe) {
+    free(probe->dev_path);
+    free(probe);
+}
+
+DC_DevProbe *dc_dev_probe_get(dev_t devno, uint64_t size, const char *dev_path) {
+    DC_DevProbe **link = &dc_ctx_global->dev_probe_cache;
+    while (*link) {
+        DC_DevProbe *probe = *link;
+        if (probe->devno == devno && !strcmp(probe->dev_path, dev_path)) {
+            if (probe->size == size)
+                return probe;
+            // Other media or device under same number, forget old one
+            *link = probe->next;
+            if (dc_dev_probe_done(probe))
+                probe_free(probe);
+            // Otherwise it's leaked, as its thread still writes to it
+            break;
+        }
+        link = &probe->next;
+    }
+
+    DC_DevProbe *probe = calloc(1, sizeof(*probe));
+    assert(probe);
+    probe->devno = devno;
+    probe->size = size;
+    probe->dev_path = strdup(dev_path);
+    assert(probe->dev_path);
+    clock_gettime(DC_BEST_CLOCK, &probe->started);
+    probe->next = dc_ctx_global->dev_probe_cache;
+    dc_ctx_global->dev_probe_cache = probe;
+
+    // Devices are probed concurrently, so that slow or hung one doesn't delay others
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&tid, &attr, probe_thread_routine, probe);
+    pthread_attr_destroy(&attr);
+    if (r)
+        probe_thread_routine(probe);
+    return probe;
+}
+
+int dc_dev_probe_done(DC_DevProbe *probe) {
+    return __atomic_load_n(&probe->done, __ATOMIC_ACQUIRE);
+}
+
+uint64_t dc_dev_probe_age(DC_DevProbe *probe) {
+    struct timespec now;
+    clock_gettime(DC_BEST_CLOCK, &now);
+    return (now.tv_sec - probe->started.tv_sec) * 1000 + (now.tv_nsec - probe->started.tv_nsec) / 1000000;
+}
+
+void dc_dev_probe_cache_free(void) {
+    DC_DevProbe *probe = dc_ctx_global->dev_probe_cache;
+    while (probe) {
+        DC_DevProbe *next = probe->next;
+        if (dc_dev_probe_done(probe))
+            probe_free(probe);
+        probe = next;
+    }
+    dc_ctx_global->dev_probe_cache = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef DEV_PROBE_H
+#define DEV_PROBE_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Details of device which take commands to device to learn,
+ * so they are read in background thread, once per device.
+ * Probes are cached in DC_Ctx, because hung thread may outlive device list.
+ */
+typedef struct dc_dev_probe {
+    dev_t devno;
+    uint64_t size;  // By /proc/partitions, to notice media change
+    char *dev_path;
+    struct timespec started;
+    int done;  // Set by probing thread after filling results below
+
+    int kernel_logical_sector_size;  // 0 if kernel didn't tell
+    int kernel_physical_sector_size;
+    int ata_capable;
+    uint8_t identify[512];
+    int ata_logical_sector_size;
+    int ata_physical_sector_size;
+    uint64_t max_lba;
+    int native_max_lba_valid;
+    uint64_t native_max_lba;
+    char serial_no[21];
+    char model_str[41];
+
+    struct dc_dev_probe *next;
+} DC_DevProbe;
+
+// Cached probe of device, new one is started if there's none or device size has changed
+DC_DevProbe *dc_dev_probe_get(dev_t devno, uint64_t size, const char *dev_path);
+int dc_dev_probe_done(DC_DevProbe *probe);
+// Time since probe start, in ms
+uint64_t dc_dev_probe_age(DC_DevProbe *probe);
+// Frees finished probes; unfinished are left to their threads
+void dc_dev_probe_cache_free(void);
+
+#endif  // DEV_PROBE_H
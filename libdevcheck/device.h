@@ -2,17 +2,33 @@
 #define DEVICE_H
 
 #include <inttypes.h>
+#include <sys/types.h>
+
+struct dc_io_backend;
+struct dc_dev_probe;
+
+enum DC_DevProbeState {
+    DC_DevProbeState_ePending,  // Details are still being read from device
+    DC_DevProbeState_eDone,
+    DC_DevProbeState_eTimedOut,  // Device doesn't answer for too long; details may arrive later yet
+};
 
 struct dc_dev {
     char *dev_fs_name;
     char *dev_path;
+    dev_t devno;  // Major:minor, 0 for image files
+    enum DC_DevProbeState probe_state;
+    struct dc_dev_probe *probe;
     uint8_t identify[512];
     char *model_str;
     char *serial_no;
     int ata_capable;
     uint64_t capacity;
     uint64_t native_capacity;
+    int logical_sector_size;  // Unit of LBA, in bytes
+    int physical_sector_size;  // Unit of media access, I/O should be aligned to it
     int mounted;
+    const struct dc_io_backend *io_backend;  // Backend to use regardless of procedure settings, e.g. for image files
     struct dc_dev *next;
 };
 
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "libdevcheck.h"
+#include "hotplug.h"
+
+// Kernel multicast group of uevents; group 2 is for udev rebroadcasts, which need udev running
+#define UEVENT_GROUP_KERNEL 1
+
+DC_Hotplug *dc_hotplug_open(void) {
+    struct sockaddr_nl addr;
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd == -1) {
+        dc_log(DC_LOG_WARNING, "Hotplug events unavailable, socket errno %d\n", errno);
+        return NULL;
+    }
+    // Bench rigs may swap many drives at once, don't lose their events
+    int rcvbuf = 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UEVENT_GROUP_KERNEL;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        dc_log(DC_LOG_WARNING, "Hotplug events unavailable, bind errno %d\n", errno);
+        close(fd);
+        return NULL;
+    }
+    DC_Hotplug *hotplug = calloc(1, sizeof(*hotplug));
+    if (!hotplug) {
+        close(fd);
+        return NULL;
+    }
+    hotplug->fd = fd;
+    return hotplug;
+}
+
+void dc_hotplug_close(DC_Hotplug *hotplug) {
+    close(hotplug->fd);
+    free(hotplug);
+}
+
+// Events were lost, so every device is checked
+static int resync_all(DC_DevList *list) {
+    int changed = 0;
+    char line[128], name[128];
+    // Entries may be removed while iterating, so names are collected first
+    int nb_names = 0;
+    char **names = NULL;
+    for (DC_Dev *dev = list->arr; dev; dev = dev->next) {
+        if (!dev->devno)
+            continue;
+        names = realloc(names, (nb_names + 1) * sizeof(char*));
+        assert(names);
+        names[nb_names] = strdup(dev->dev_fs_name);
+        assert(names[nb_names]);
+        nb_names++;
+    }
+    for (int i = 0; i < nb_names; i++) {
+        changed |= dc_dev_list_sync_device(list, names[i]);
+        free(names[i]);
+    }
+    free(names);
+
+    FILE *procpt = fopen("/proc/partitions", "r");
+    if (!procpt)
+        return changed;
+    while (fgets(line, sizeof(line), procpt))
+        if (sscanf(line, " %*d %*d %*u %127[^\n ]", name) == 1)
+            changed |= dc_dev_list_sync_device(list, name);
+    fclose(procpt);
+    return changed;
+}
+
+int dc_hotplug_handle_events(DC_Hotplug *hotplug, DC_DevList *list) {
+    char buf[8192];
+    int changed = 0;
+    while (1) {
+        struct sockaddr_nl sender;
+        socklen_t sender_len = sizeof(sender);
+        ssize_t len = recvfrom(hotplug->fd, buf, sizeof(buf) - 1, 0, (struct sockaddr*)&sender, &sender_len);
+        if (len == -1) {
+            if (errno == ENOBUFS) {
+                changed |= resync_all(list);
+                continue;
+            }
+            break;  // EAGAIN: no more events
+        }
+        if (sender.nl_pid != 0)
+            continue;  // Only kernel is trusted
+        buf[len] = '\0';
+
+        // Message is "action@devpath" followed by KEY=value strings, each zero-terminated
+        const char *subsystem = NULL;
+        const char *devname = NULL;
+        const char *devtype = NULL;
+        for (char *s = buf + strlen(buf) + 1; s < buf + len; s += strlen(s) + 1) {
+            if (!strncmp(s, "SUBSYSTEM=", 10))
+                subsystem = s + 10;
+            else if (!strncmp(s, "DEVNAME=", 8))
+                devname = s + 8;
+            else if (!strncmp(s, "DEVTYPE=", 8))
+                devtype = s + 8;
+        }
+        if (!subsystem || strcmp(subsystem, "block") || !devname || !devtype || strcmp(devtype, "disk"))
+            continue;
+        // Current state is read from sysfs, so any action is handled the same way
+        changed |= dc_dev_list_sync_device(list, devname);
+    }
+    return changed;
+}
@@ -0,0 +1,21 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include "objects_def.h"
+
+// Listener of kernel uevents about block devices appearing, disappearing and changing size
+typedef struct dc_hotplug {
+    int fd;  // Netlink socket; becomes readable on events, for use with poll()
+} DC_Hotplug;
+
+// NULL if kernel events are unavailable, e.g. without privileges
+DC_Hotplug *dc_hotplug_open(void);
+void dc_hotplug_close(DC_Hotplug *hotplug);
+
+/**
+ * Apply pending events to device list, without waiting for new ones.
+ * @return 1 if list has changed
+ */
+int dc_hotplug_handle_events(DC_Hotplug *hotplug, DC_DevList *list);
+
+#endif  // HOTPLUG_H
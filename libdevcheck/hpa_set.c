@@ -12,6 +12,7 @@
 #include <assert.h>
 #include "procedure.h"
 #include "utils.h"
+#include "ata_session.h"
 
 struct hpa_set_priv {
     int64_t max_lba;
@@ -20,7 +21,7 @@ typedef struct hpa_set_priv HpaSetPriv;
 
 static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
     if (!strcmp(setting->name, "max_lba")) {
-        int64_t native_max_lba = dev->native_capacity / 512 - 1;  // TODO Request via ATA
+        int64_t native_max_lba = dev->native_capacity / dev->logical_sector_size - 1;  // TODO Request via ATA
         char *string;
         int r = asprintf(&string, "%"PRId64, native_max_lba);
         assert(r != -1);
@@ -34,8 +35,14 @@ static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
 static int Open(DC_ProcedureCtx *ctx) {
     HpaSetPriv *priv = ctx->priv;
 
-    dc_dev_set_max_lba(ctx->dev->dev_path, ctx->dev->native_capacity / 512 - 1);
-    int ret = dc_dev_set_max_lba(ctx->dev->dev_path, priv->max_lba);
+    DC_AtaSession *session = dc_ata_session_open(ctx->dev->dev_path);
+    if (!session) {
+        dc_log(DC_LOG_FATAL, "open %s fail\n", ctx->dev->dev_path);
+        return 1;
+    }
+    dc_ata_session_set_max_lba(session, ctx->dev->native_capacity / ctx->dev->logical_sector_size - 1);
+    int ret = dc_ata_session_set_max_lba(session, priv->max_lba);
+    dc_ata_session_close(session);
     if (ret)
         dc_log(DC_LOG_ERROR, "Command SET MAX ADDRESS EXT failed");
     return 0;
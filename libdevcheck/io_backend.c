@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+
+#include "libdevcheck.h"
+#include "io_backend.h"
+
+static int io_open_backend(DC_Io *io, const DC_IoBackend *backend, int queue_depth) {
+    io->backend = backend;
+    io->queue_depth = queue_depth;
+    io->fd = -1;
+    io->priv = calloc(1, backend->priv_data_size);
+    assert(io->priv);
+    int r = backend->open(io);
+    if (r) {
+        free(io->priv);
+        io->priv = NULL;
+    }
+    return r;
+}
+
+DC_Io *dc_io_open(DC_Dev *dev, enum Api api, int queue_depth, int flags) {
+    const DC_IoBackend *backend;
+    int r;
+    DC_Io *io = calloc(1, sizeof(*io));
+    assert(io);
+    io->dev = dev;
+    io->flags = flags;
+
+    if (dev->io_backend)
+        backend = dev->io_backend;
+    else if (api == Api_eAta)
+        backend = &dc_io_backend_ata;
+    else if (queue_depth > 1)
+        backend = &dc_io_backend_uring;
+    else
+        backend = &dc_io_backend_posix;
+
+    r = io_open_backend(io, backend, queue_depth);
+    if (r && backend == &dc_io_backend_uring) {
+        dc_log(DC_LOG_WARNING, "io_uring is unavailable, falling back to synchronous reads\n");
+        r = io_open_backend(io, &dc_io_backend_posix, 1);
+    }
+    if (r) {
+        free(io);
+        return NULL;
+    }
+    dc_log(DC_LOG_DEBUG, "Using %s I/O backend, queue depth %d\n", io->backend->name, io->queue_depth);
+    return io;
+}
+
+void dc_io_close(DC_Io *io) {
+    if (io->priv)
+        io->backend->close(io);
+    else if (io->fd != -1)
+        close(io->fd);  // Kept by failed reopen
+    free(io->priv);
+    free(io->iovecs);
+    free(io);
+}
+
+int dc_io_reopen(DC_Io *io) {
+    assert(!io->nb_inflight);
+    // Number stays taken by old file until new one takes its place, so nobody else gets it meanwhile
+    int fd = io->fd;
+    if (io->priv) {
+        if (fd != -1)
+            io->fd = dup(fd);
+        io->backend->close(io);
+        memset(io->priv, 0, io->backend->priv_data_size);
+    } else {
+        // Previous reopen has failed
+        io->priv = calloc(1, io->backend->priv_data_size);
+        assert(io->priv);
+    }
+    int r = io->backend->open(io);
+    if (r) {
+        free(io->priv);
+        io->priv = NULL;
+        io->fd = fd;
+        return 1;
+    }
+    if (fd != -1 && io->fd != fd) {
+        if (dup2(io->fd, fd) != -1) {
+            close(io->fd);
+            io->fd = fd;
+        } else {
+            // Others keep stale fd, but our own I/O goes on
+            close(fd);
+        }
+    }
+    if (io->iovecs)
+        return io->backend->register_buffers(io, io->iovecs, io->nb_iovecs);
+    return 0;
+}
+
+int dc_io_register_buffers(DC_Io *io, struct iovec *iovecs, int nb_iovecs) {
+    if (!io->backend->register_buffers)
+        return 0;
+    free(io->iovecs);
+    io->iovecs = malloc(nb_iovecs * sizeof(*iovecs));
+    assert(io->iovecs);
+    memcpy(io->iovecs, iovecs, nb_iovecs * sizeof(*iovecs));
+    io->nb_iovecs = nb_iovecs;
+    return io->backend->register_buffers(io, iovecs, nb_iovecs);
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int dc_io_submit(DC_Io *io, DC_IoRequest *req) {
+    assert(io->nb_inflight < io->queue_depth);
+    req->error_lba_valid = 0;
+    // Set before submission, as synchronous backends return after completion
+    if (!io->nb_inflight)
+        __atomic_store_n(&io->last_progress_ms, monotonic_ms(), __ATOMIC_RELAXED);
+    __atomic_store_n(&io->last_lba, req->lba, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&io->nb_inflight, 1, __ATOMIC_RELEASE);
+    int r = io->backend->submit(io, req);
+    if (r)
+        __atomic_sub_fetch(&io->nb_inflight, 1, __ATOMIC_RELEASE);
+    return r;
+}
+
+DC_IoRequest *dc_io_complete(DC_Io *io) {
+    if (!io->nb_inflight)
+        return NULL;
+    DC_IoRequest *req = io->backend->complete(io);
+    if (!req)
+        return NULL;
+    __atomic_store_n(&io->last_progress_ms, monotonic_ms(), __ATOMIC_RELAXED);
+    int nb_inflight = __atomic_sub_fetch(&io->nb_inflight, 1, __ATOMIC_RELEASE);
+    // With more in flight, time since submission includes waiting for others
+    if (req->timeout_ms && req->status == DC_BlockStatus_eOk && !nb_inflight
+            && dc_io_request_access_time(req) >= (uint64_t)req->timeout_ms * 1000)
+        req->status = DC_BlockStatus_eTimeout;
+    return req;
+}
+
+int dc_io_execute(DC_Io *io, DC_IoRequest *req) {
+    assert(!io->nb_inflight);
+    int r = dc_io_submit(io, req);
+    if (r)
+        return r;
+    return dc_io_complete(io) != req;
+}
+
+void dc_io_set_short_transfer(DC_Io *io, DC_IoRequest *req, int64_t bytes_done) {
+    if (bytes_done <= 0 || bytes_done >= (int64_t)(req->sectors * io->dev->logical_sector_size))
+        return;
+    req->error_lba = req->lba + bytes_done / io->dev->logical_sector_size;
+    req->error_lba_valid = 1;
+}
+
+uint64_t dc_io_request_access_time(DC_IoRequest *req) {
+    int64_t diff = (req->completed.tv_sec - req->submitted.tv_sec) * 1000000 +
+        (req->completed.tv_nsec - req->submitted.tv_nsec) / 1000;
+    return diff > 0 ? diff : 0;
+}
+
+void dc_io_blkdev_setup(DC_Io *io) {
+    int r = ioctl(io->fd, BLKFLSBUF, NULL);
+    if (r == -1)
+      dc_log(DC_LOG_WARNING, "Flushing block device buffers failed\n");
+    r = ioctl(io->fd, BLKRAGET, &io->old_readahead);
+    if (r == -1)
+      dc_log(DC_LOG_WARNING, "Getting block device readahead setting failed\n");
+    r = ioctl(io->fd, BLKRASET, 0);
+    if (r == -1)
+      dc_log(DC_LOG_WARNING, "Disabling block device readahead setting failed\n");
+}
+
+void dc_io_blkdev_restore(DC_Io *io) {
+    int r = ioctl(io->fd, BLKRASET, io->old_readahead);
+    if (r == -1)
+      dc_log(DC_LOG_WARNING, "Restoring block device readahead setting failed\n");
+}
+
+// Reads value from /sys/block/<dev>/queue/; 0 if unavailable
+static uint64_t read_queue_limit(const char *dev_fs_name, const char *attr) {
+    char path[200];
+    uint64_t value = 0;
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/%s", dev_fs_name, attr);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%"SCNu64, &value) != 1)
+        value = 0;
+    fclose(f);
+    return value;
+}
+
+int64_t dc_io_default_block_sectors(DC_Dev *dev) {
+    int64_t sectors = DC_DEFAULT_BLOCK_SIZE / dev->logical_sector_size;
+    return sectors ? sectors : 1;
+}
+
+int64_t dc_io_auto_block_sectors(DC_Dev *dev, enum Api api) {
+    uint64_t limit_kb;
+    int64_t min_sectors = dev->physical_sector_size / dev->logical_sector_size;
+    if (dev->io_backend)
+        return dc_io_default_block_sectors(dev);
+    if (api == Api_eAta)
+        // Passthrough commands are never split, they just must fit in hardware limit
+        limit_kb = read_queue_limit(dev->dev_fs_name, "max_hw_sectors_kb");
+    else
+        // Block layer splits requests above its soft limit
+        limit_kb = read_queue_limit(dev->dev_fs_name, "max_sectors_kb");
+    if (!limit_kb)
+        return dc_io_default_block_sectors(dev);
+
+    uint64_t limit = limit_kb * 1024 / dev->logical_sector_size;
+    if (api == Api_eAta && limit > 65536)
+        limit = 65536;  // 16-bit sector count of 48-bit commands
+    uint64_t max_sectors = DC_MAX_AUTO_BLOCK_SIZE / dev->logical_sector_size;
+    if (limit > max_sectors)
+        limit = max_sectors;
+    // Power of 2 keeps blocks aligned to physical sectors and to each other
+    int64_t sectors = 1;
+    while ((uint64_t)sectors * 2 <= limit)
+        sectors *= 2;
+    if (sectors < min_sectors)
+        sectors = min_sectors;
+    dc_log(DC_LOG_DEBUG, "Device takes requests up to %"PRIu64" KiB, using blocks of %"PRId64" sectors\n",
+            limit_kb, sectors);
+    return sectors;
+}
+
+int dc_io_parse_block_sectors(DC_Dev *dev, enum Api api, const char *str, int64_t *sectors) {
+    if (!strcmp(str, "auto")) {
+        *sectors = dc_io_auto_block_sectors(dev, api);
+        return 0;
+    }
+    if (sscanf(str, "%"SCNd64, sectors) != 1 || *sectors <= 0 || *sectors > 65536) {
+        dc_log(DC_LOG_FATAL, "Invalid block size %s\n", str);
+        return 1;
+    }
+    // Partial physical sector writes are read-modify-write, and reads straddle two sectors
+    int64_t physical_sectors = dev->physical_sector_size / dev->logical_sector_size;
+    if (*sectors % physical_sectors) {
+        dc_log(DC_LOG_FATAL, "Block size %s is not a multiple of physical sector (%"PRId64" sectors)\n",
+                str, physical_sectors);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <inttypes.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "procedure.h"
+#include "scsi.h"
+
+typedef enum {
+    DC_IoOp_eRead,
+    DC_IoOp_eVerify,  // Check readability; backends which cannot do it without transfer read into buf
+    DC_IoOp_eWrite,
+} DC_IoOp;
+
+typedef struct dc_io_request {
+    // Set by caller
+    DC_IoOp op;
+    uint64_t lba;
+    size_t sectors;
+    void *buf;  // Page-aligned
+    int buf_index;  // Index of buf in dc_io_register_buffers() array, or -1
+    unsigned int timeout_ms;  // 0 for default of backend
+    void *user_data;
+
+    // Set by backend
+    DC_BlockStatus status;
+    int error_lba_valid;  // Whether device told first failed sector
+    uint64_t error_lba;
+    struct timespec submitted;
+    struct timespec completed;
+    ScsiCommand scsi_command;
+} DC_IoRequest;
+
+typedef struct dc_io DC_Io;
+
+typedef struct dc_io_backend {
+    const char *name;
+    int priv_data_size;
+    // May lower io->queue_depth
+    int (*open)(DC_Io *io);
+    // Optional
+    int (*register_buffers)(DC_Io *io, struct iovec *iovecs, int nb_iovecs);
+    int (*submit)(DC_Io *io, DC_IoRequest *req);
+    // Wait for any submitted request to complete; NULL on failure
+    DC_IoRequest *(*complete)(DC_Io *io);
+    void (*close)(DC_Io *io);
+} DC_IoBackend;
+
+struct dc_io {
+    const DC_IoBackend *backend;
+    void *priv;  // Backend private context
+    DC_Dev *dev;
+    int flags;  // For DC_IO_FLAG_*
+    int queue_depth;  // Maximal number of requests in flight
+    int nb_inflight;
+    int fd;
+    int old_readahead;
+    struct iovec *iovecs;  // Registered buffers, kept to register them again on reopen
+    int nb_iovecs;
+
+    // Progress of requests, for watching from other threads; read with __atomic builtins
+    uint64_t last_progress_ms;  // Monotonic time of last completion, or of submission to idle device
+    uint64_t last_lba;  // Of last submitted request
+};
+
+#define DC_IO_FLAG_WRITE 1  // Open device for writing
+// Queue depth procedures take from user, at most; backends may lower it further
+#define DC_IO_MAX_QUEUE_DEPTH 256
+
+extern const DC_IoBackend dc_io_backend_ata;
+extern const DC_IoBackend dc_io_backend_posix;
+extern const DC_IoBackend dc_io_backend_uring;
+extern const DC_IoBackend dc_io_backend_file;
+extern const DC_IoBackend dc_io_backend_sim;
+
+/**
+ * Bind device to I/O backend. Backend is forced by device (dev->io_backend),
+ * or chosen by API: ATA passthrough for Api_eAta; for Api_ePosix, io_uring
+ * if queue_depth is above 1, else pread()/pwrite().
+ * Actual queue depth is in returned io->queue_depth.
+ * @return NULL on failure
+ */
+DC_Io *dc_io_open(DC_Dev *dev, enum Api api, int queue_depth, int flags);
+void dc_io_close(DC_Io *io);
+/**
+ * Close and open device again with same backend, e.g. after device reset.
+ * fd keeps its number, so that others using it stay valid. Only when nothing is in flight.
+ * @return 1 on failure; io is unusable then, except for dc_io_close() and another dc_io_reopen()
+ */
+int dc_io_reopen(DC_Io *io);
+
+// Optional, lets backend avoid mapping buffers on each request
+int dc_io_register_buffers(DC_Io *io, struct iovec *iovecs, int nb_iovecs);
+
+// Request must stay untouched until returned by dc_io_complete()
+int dc_io_submit(DC_Io *io, DC_IoRequest *req);
+// Request which has outlived its timeout is reported as DC_BlockStatus_eTimeout,
+// also by backends which can't abort it
+DC_IoRequest *dc_io_complete(DC_Io *io);
+
+// Submit and wait for completion of single request; only when nothing else is in flight
+int dc_io_execute(DC_Io *io, DC_IoRequest *req);
+
+// For backends: failed transfer has done given number of bytes, so sector past them is the failed one
+void dc_io_set_short_transfer(DC_Io *io, DC_IoRequest *req, int64_t bytes_done);
+
+// Time from submission to completion of request, in mcs
+uint64_t dc_io_request_access_time(DC_IoRequest *req);
+
+// Block size procedures used to have, before it became an option, in bytes
+#define DC_DEFAULT_BLOCK_SIZE (128 * 1024)
+// Auto block size is limited, so that read errors and progress stay fine-grained
+#define DC_MAX_AUTO_BLOCK_SIZE (4 * 1024 * 1024)
+
+// DC_DEFAULT_BLOCK_SIZE in logical sectors of device
+int64_t dc_io_default_block_sectors(DC_Dev *dev);
+/**
+ * Largest request size in sectors which device takes without splitting it: by sysfs
+ * queue limits and, for ATA passthrough, by sector count of the command. Power of 2,
+ * not less than physical sector.
+ * Default block size if limits are unknown, e.g. for image files.
+ */
+int64_t dc_io_auto_block_sectors(DC_Dev *dev, enum Api api);
+/**
+ * Parse block size option: number of sectors, or "auto".
+ * Size must be a multiple of physical sector.
+ * @return 1 if value is invalid
+ */
+int dc_io_parse_block_sectors(DC_Dev *dev, enum Api api, const char *str, int64_t *sectors);
+
+// For backends on block devices: flush buffers and disable readahead, restore it on close
+void dc_io_blkdev_setup(DC_Io *io);
+void dc_io_blkdev_restore(DC_Io *io);
+
+#endif  // IO_BACKEND_H
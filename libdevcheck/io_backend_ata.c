@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libdevcheck.h"
+#include "io_backend.h"
+#include "ata.h"
+#include "scsi.h"
+#include "ata_session.h"
+
+// ATA commands through SCSI ATA passthrough: synchronous by ioctl(SG_IO),
+// or queued through asynchronous interface of /dev/sgN if queue depth is above 1
+typedef struct ata_io_priv {
+    DC_AtaSession *session;  // On io->fd, holds command templates
+    int sg_fd;
+    int ncq;  // Reads are queued as READ FPDMA QUEUED
+    DC_IoRequest *done;
+} AtaIoPriv;
+
+static int ata_io_open(DC_Io *io) {
+    AtaIoPriv *priv = io->priv;
+    priv->sg_fd = -1;
+    io->fd = open(io->dev->dev_path, O_RDWR);
+    if (io->fd == -1) {
+        dc_log(DC_LOG_FATAL, "open %s fail\n", io->dev->dev_path);
+        return 1;
+    }
+    priv->session = dc_ata_session_open_fd(io->fd);
+    if (!priv->session) {
+        close(io->fd);
+        return 1;
+    }
+    dc_io_blkdev_setup(io);
+
+    if (io->queue_depth > SG_MAX_QUEUE) {
+        dc_log(DC_LOG_WARNING, "Limiting queue depth to %d commands\n", SG_MAX_QUEUE);
+        io->queue_depth = SG_MAX_QUEUE;
+    }
+    if (io->queue_depth > 1) {
+        priv->sg_fd = scsi_sg_open(io->dev->dev_fs_name);
+        if (priv->sg_fd == -1) {
+            dc_log(DC_LOG_WARNING, "Asynchronous SCSI generic interface is unavailable, falling back to synchronous commands\n");
+            io->queue_depth = 1;
+        }
+    }
+    // Without NCQ, queued commands are still passed to device one at a time
+    int ncq_depth = dc_ata_ncq_depth(io->dev->identify);
+    if (priv->sg_fd != -1 && ncq_depth > 1) {
+        priv->ncq = 1;
+        if (io->queue_depth > ncq_depth)
+            io->queue_depth = ncq_depth;
+        dc_log(DC_LOG_DEBUG, "Using NCQ reads, device queue depth %d\n", ncq_depth);
+    }
+    return 0;
+}
+
+static int prepare_command(DC_Io *io, DC_IoRequest *req) {
+    AtaIoPriv *priv = io->priv;
+    switch (req->op) {
+        case DC_IoOp_eVerify:
+            dc_ata_session_prepare(priv->session, &req->scsi_command, DC_AtaProtocol_eNonData,
+                    WIN_VERIFY_EXT /* 42h */, 0, req->lba, req->sectors, NULL, 0);
+            return 0;
+        case DC_IoOp_eRead:
+            if (priv->ncq) {
+                // Tag in count (7:3) is left 0, libata puts its own one there
+                dc_ata_session_prepare(priv->session, &req->scsi_command, DC_AtaProtocol_eFpdmaIn,
+                        /* READ FPDMA QUEUED */ 0x60, req->sectors, req->lba, 0,
+                        req->buf, req->sectors * io->dev->logical_sector_size);
+            } else {
+                dc_ata_session_prepare(priv->session, &req->scsi_command, DC_AtaProtocol_eDmaIn,
+                        /* WIN_READ_DMA_EXT */ 0x25, 0, req->lba, req->sectors,
+                        req->buf, req->sectors * io->dev->logical_sector_size);
+            }
+            // Templates count transfer in 512-byte blocks; T_TYPE=1 counts it in logical sectors
+            if (io->dev->logical_sector_size != 512)
+                req->scsi_command.scsi_cmd[2] |= 0x10;
+            return 0;
+        default:
+            dc_log(DC_LOG_ERROR, "Operation is not supported by ATA backend\n");
+            return 1;
+    }
+}
+
+static void check_status(AtaIoPriv *priv, DC_IoRequest *req) {
+    uint64_t error_lba;
+    req->status = scsi_ata_check_return_status(&req->scsi_command);
+    // Clean NCQ completion has no sense data at all (CK_COND is off). Sibling of failed
+    // command, given back by libata error handling, may carry it with SCSI status 0
+    if (priv->ncq && req->op == DC_IoOp_eRead && req->status == DC_BlockStatus_eOk
+            && (req->scsi_command.io_hdr.info & SG_INFO_OK_MASK) != SG_INFO_OK)
+        req->status = DC_BlockStatus_eAbrt;
+    if (req->status != DC_BlockStatus_eOk && !scsi_ata_get_error_lba(&req->scsi_command, &error_lba)
+            && error_lba >= req->lba && error_lba < req->lba + req->sectors) {
+        req->error_lba = error_lba;
+        req->error_lba_valid = 1;
+    }
+}
+
+static int ata_io_submit(DC_Io *io, DC_IoRequest *req) {
+    AtaIoPriv *priv = io->priv;
+    int r = prepare_command(io, req);
+    if (r)
+        return r;
+    if (req->timeout_ms)
+        req->scsi_command.io_hdr.timeout = req->timeout_ms;
+    clock_gettime(DC_BEST_CLOCK, &req->submitted);
+    if (priv->sg_fd != -1)
+        return scsi_sg_submit(priv->sg_fd, &req->scsi_command);
+
+    r = dc_ata_session_exec(priv->session, &req->scsi_command);
+    clock_gettime(DC_BEST_CLOCK, &req->completed);
+    if (r == -1)
+        return 1;
+    check_status(priv, req);
+    priv->done = req;
+    return 0;
+}
+
+static DC_IoRequest *ata_io_complete(DC_Io *io) {
+    AtaIoPriv *priv = io->priv;
+    if (priv->sg_fd == -1) {
+        DC_IoRequest *req = priv->done;
+        priv->done = NULL;
+        return req;
+    }
+    ScsiCommand *scsi_command = scsi_sg_receive(priv->sg_fd);
+    if (!scsi_command)
+        return NULL;
+    DC_IoRequest *req = (DC_IoRequest*)((uint8_t*)scsi_command - offsetof(DC_IoRequest, scsi_command));
+    clock_gettime(DC_BEST_CLOCK, &req->completed);
+    check_status(priv, req);
+    return req;
+}
+
+static void ata_io_close(DC_Io *io) {
+    AtaIoPriv *priv = io->priv;
+    // Closing queue fd makes kernel drop or wait for commands in flight
+    if (priv->sg_fd != -1)
+        close(priv->sg_fd);
+    dc_ata_session_close(priv->session);
+    dc_io_blkdev_restore(io);
+    close(io->fd);
+}
+
+const DC_IoBackend dc_io_backend_ata = {
+    .name = "ata",
+    .priv_data_size = sizeof(AtaIoPriv),
+    .open = ata_io_open,
+    .submit = ata_io_submit,
+    .complete = ata_io_complete,
+    .close = ata_io_close,
+};
@@ -0,0 +1,94 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libdevcheck.h"
+#include "io_backend.h"
+
+// Requests are done synchronously on submit
+typedef struct posix_io_priv {
+    DC_IoRequest *done;
+} PosixIoPriv;
+
+static int open_flags(DC_Io *io) {
+    return ((io->flags & DC_IO_FLAG_WRITE) ? O_WRONLY : O_RDONLY) | O_LARGEFILE | O_NOATIME;
+}
+
+static int posix_open(DC_Io *io) {
+    io->queue_depth = 1;
+    io->fd = open(io->dev->dev_path, open_flags(io) | O_DIRECT);
+    if (io->fd == -1) {
+        dc_log(DC_LOG_FATAL, "open %s fail\n", io->dev->dev_path);
+        return 1;
+    }
+    dc_io_blkdev_setup(io);
+    return 0;
+}
+
+static int file_open(DC_Io *io) {
+    io->queue_depth = 1;
+    io->fd = open(io->dev->dev_path, open_flags(io) | O_DIRECT);
+    if (io->fd == -1 && errno == EINVAL) {
+        // Some filesystems, like tmpfs, have no direct I/O
+        dc_log(DC_LOG_INFO, "%s doesn't support direct I/O, using page cache\n", io->dev->dev_path);
+        io->fd = open(io->dev->dev_path, open_flags(io));
+    }
+    if (io->fd == -1) {
+        dc_log(DC_LOG_FATAL, "open %s fail\n", io->dev->dev_path);
+        return 1;
+    }
+    return 0;
+}
+
+static int posix_submit(DC_Io *io, DC_IoRequest *req) {
+    PosixIoPriv *priv = io->priv;
+    ssize_t len = req->sectors * io->dev->logical_sector_size;
+    ssize_t ret;
+    clock_gettime(DC_BEST_CLOCK, &req->submitted);
+    if (req->op == DC_IoOp_eWrite)
+        ret = pwrite(io->fd, req->buf, len, req->lba * io->dev->logical_sector_size);
+    else
+        ret = pread(io->fd, req->buf, len, req->lba * io->dev->logical_sector_size);
+    clock_gettime(DC_BEST_CLOCK, &req->completed);
+    req->status = (ret == len) ? DC_BlockStatus_eOk : DC_BlockStatus_eError;
+    if (req->status)
+        dc_io_set_short_transfer(io, req, ret);
+    priv->done = req;
+    return 0;
+}
+
+static DC_IoRequest *posix_complete(DC_Io *io) {
+    PosixIoPriv *priv = io->priv;
+    DC_IoRequest *req = priv->done;
+    priv->done = NULL;
+    return req;
+}
+
+static void posix_close(DC_Io *io) {
+    dc_io_blkdev_restore(io);
+    close(io->fd);
+}
+
+static void file_close(DC_Io *io) {
+    close(io->fd);
+}
+
+const DC_IoBackend dc_io_backend_posix = {
+    .name = "posix",
+    .priv_data_size = sizeof(PosixIoPriv),
+    .open = posix_open,
+    .submit = posix_submit,
+    .complete = posix_complete,
+    .close = posix_close,
+};
+
+const DC_IoBackend dc_io_backend_file = {
+    .name = "file",
+    .priv_data_size = sizeof(PosixIoPriv),
+    .open = file_open,
+    .submit = posix_submit,
+    .complete = posix_complete,
+    .close = file_close,
+};
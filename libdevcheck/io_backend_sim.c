@@ -0,0 +1,348 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "libdevcheck.h"
+#include "io_backend.h"
+#include "sim_device.h"
+
+typedef struct sim_range {
+    uint64_t begin_lba;
+    uint64_t end_lba;
+    DC_BlockStatus status;  // For bad ranges
+    uint64_t delay;  // For bad ranges, mcs
+    double slowdown;  // For slow ranges
+} SimRange;
+
+typedef struct sim_spec {
+    uint64_t capacity;  // In sectors
+    int logical_sector_size, physical_sector_size;  // In bytes
+    double rate_begin, rate_end;  // Bytes per mcs at first and last LBA
+    uint64_t seek_min, seek_max;  // Seek time in mcs, for adjacent track and for full stroke
+    uint64_t bad_delay;  // Default time spent on bad range, mcs
+    int realtime;
+    int no_data;
+    SimRange *bad;  // Sorted by LBA, non-overlapping
+    int nb_bad;
+    SimRange *slow;
+    int nb_slow;
+} SimSpec;
+
+// Like NCQ limit of ATA devices
+#define SIM_MAX_QUEUE_DEPTH 32
+
+typedef struct sim_io_priv {
+    SimSpec spec;
+    uint64_t head_lba;
+    // Requests are served one after another, in order of submission
+    DC_IoRequest *done[SIM_MAX_QUEUE_DEPTH];
+    int done_head;
+    int nb_done;
+    struct timespec busy_until;  // Completion of last submitted request
+} SimIoPriv;
+
+static const struct {
+    const char *name;
+    DC_BlockStatus status;
+} status_names[] = {
+    { "error", DC_BlockStatus_eError },
+    { "timeout", DC_BlockStatus_eTimeout },
+    { "unc", DC_BlockStatus_eUnc },
+    { "idnf", DC_BlockStatus_eIdnf },
+    { "abrt", DC_BlockStatus_eAbrt },
+    { "amnf", DC_BlockStatus_eAmnf },
+};
+
+static int parse_status(const char *name, DC_BlockStatus *status) {
+    for (unsigned i = 0; i < sizeof(status_names) / sizeof(status_names[0]); i++)
+        if (!strcmp(name, status_names[i].name)) {
+            *status = status_names[i].status;
+            return 0;
+        }
+    return 1;
+}
+
+static void add_range(SimRange **ranges, int *nb_ranges, SimRange *range) {
+    *ranges = realloc(*ranges, (*nb_ranges + 1) * sizeof(SimRange));
+    assert(*ranges);
+    (*ranges)[(*nb_ranges)++] = *range;
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    const SimRange *ra = a;
+    const SimRange *rb = b;
+    return (ra->begin_lba > rb->begin_lba) - (ra->begin_lba < rb->begin_lba);
+}
+
+static void spec_free(SimSpec *spec) {
+    free(spec->bad);
+    free(spec->slow);
+}
+
+static int spec_load(const char *path, SimSpec *spec) {
+    char line[200];
+    int line_no = 0;
+    memset(spec, 0, sizeof(*spec));
+    spec->rate_begin = spec->rate_end = 150;
+    spec->seek_min = 1000;
+    spec->seek_max = 15000;
+    spec->bad_delay = 2000000;
+    spec->logical_sector_size = spec->physical_sector_size = 512;
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 1;
+    if (!fgets(line, sizeof(line), f) || strncmp(line, SIM_DEVICE_MAGIC, strlen(SIM_DEVICE_MAGIC)))
+        goto fail;
+    line_no++;
+    while (fgets(line, sizeof(line), f)) {
+        char key[32], arg[32];
+        SimRange range = { .slowdown = 1 };
+        int n;
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        if (sscanf(line, "%31s", key) != 1)
+            continue;
+        if (!strcmp(key, "capacity")) {
+            n = sscanf(line, "%*s %"SCNu64, &spec->capacity);
+            if (n != 1)
+                goto fail_line;
+        } else if (!strcmp(key, "rate")) {
+            n = sscanf(line, "%*s %lf %lf", &spec->rate_begin, &spec->rate_end);
+            if (n < 1 || spec->rate_begin <= 0)
+                goto fail_line;
+            if (n == 1)
+                spec->rate_end = spec->rate_begin;
+            if (spec->rate_end <= 0)
+                goto fail_line;
+        } else if (!strcmp(key, "seek")) {
+            n = sscanf(line, "%*s %"SCNu64" %"SCNu64, &spec->seek_min, &spec->seek_max);
+            if (n != 2)
+                goto fail_line;
+        } else if (!strcmp(key, "bad_delay")) {
+            n = sscanf(line, "%*s %"SCNu64, &spec->bad_delay);
+            if (n != 1)
+                goto fail_line;
+        } else if (!strcmp(key, "realtime")) {
+            n = sscanf(line, "%*s %31s", arg);
+            if (n != 1)
+                goto fail_line;
+            spec->realtime = !strcmp(arg, "yes");
+        } else if (!strcmp(key, "data")) {
+            n = sscanf(line, "%*s %31s", arg);
+            if (n != 1)
+                goto fail_line;
+            spec->no_data = !strcmp(arg, "no");
+        } else if (!strcmp(key, "sector_size")) {
+            n = sscanf(line, "%*s %d %d", &spec->logical_sector_size, &spec->physical_sector_size);
+            if (n < 1)
+                goto fail_line;
+            if (n == 1)
+                spec->physical_sector_size = spec->logical_sector_size;
+            if (spec->logical_sector_size < 512 || (spec->logical_sector_size & (spec->logical_sector_size - 1))
+                    || spec->physical_sector_size % spec->logical_sector_size
+                    || (spec->physical_sector_size & (spec->physical_sector_size - 1)))
+                goto fail_line;
+        } else if (!strcmp(key, "bad")) {
+            uint64_t sectors;
+            range.status = DC_BlockStatus_eUnc;
+            range.delay = 0;
+            arg[0] = '\0';
+            n = sscanf(line, "%*s %"SCNu64" %"SCNu64" %31s %"SCNu64, &range.begin_lba, &sectors, arg, &range.delay);
+            if (n < 2 || !sectors || (n >= 3 && parse_status(arg, &range.status)))
+                goto fail_line;
+            range.end_lba = range.begin_lba + sectors;
+            add_range(&spec->bad, &spec->nb_bad, &range);
+        } else if (!strcmp(key, "slow")) {
+            uint64_t sectors;
+            n = sscanf(line, "%*s %"SCNu64" %"SCNu64" %lf", &range.begin_lba, &sectors, &range.slowdown);
+            if (n != 3 || !sectors || range.slowdown <= 0)
+                goto fail_line;
+            range.end_lba = range.begin_lba + sectors;
+            add_range(&spec->slow, &spec->nb_slow, &range);
+        } else {
+            goto fail_line;
+        }
+    }
+    fclose(f);
+    if (!spec->capacity) {
+        dc_log(DC_LOG_ERROR, "%s: capacity is not set\n", path);
+        spec_free(spec);
+        return 1;
+    }
+
+    qsort(spec->bad, spec->nb_bad, sizeof(SimRange), compare_ranges);
+    for (int i = 1; i < spec->nb_bad; i++)
+        if (spec->bad[i].begin_lba < spec->bad[i - 1].end_lba) {
+            dc_log(DC_LOG_ERROR, "%s: bad ranges overlap at LBA %"PRIu64"\n", path, spec->bad[i].begin_lba);
+            spec_free(spec);
+            return 1;
+        }
+    return 0;
+
+fail_line:
+    dc_log(DC_LOG_ERROR, "%s:%d: malformed line\n", path, line_no);
+fail:
+    fclose(f);
+    spec_free(spec);
+    return 1;
+}
+
+int sim_device_probe(const char *path, uint64_t *capacity, int *logical_sector_size, int *physical_sector_size) {
+    SimSpec spec;
+    FILE *f = fopen(path, "r");
+    char line[sizeof(SIM_DEVICE_MAGIC)];
+    if (!f)
+        return 1;
+    int is_sim = fgets(line, sizeof(line), f) && !strncmp(line, SIM_DEVICE_MAGIC, strlen(SIM_DEVICE_MAGIC));
+    fclose(f);
+    if (!is_sim)
+        return 1;
+    if (spec_load(path, &spec))
+        return -1;
+    *capacity = spec.capacity * spec.logical_sector_size;
+    *logical_sector_size = spec.logical_sector_size;
+    *physical_sector_size = spec.physical_sector_size;
+    spec_free(&spec);
+    return 0;
+}
+
+// First bad range overlapping [lba, lba + sectors), or NULL
+static SimRange *find_bad(SimSpec *spec, uint64_t lba, uint64_t sectors) {
+    int lo = 0;
+    int hi = spec->nb_bad;
+    // First range ending after lba
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (spec->bad[mid].end_lba <= lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < spec->nb_bad && spec->bad[lo].begin_lba < lba + sectors)
+        return &spec->bad[lo];
+    return NULL;
+}
+
+static uint64_t model_time(SimIoPriv *priv, DC_IoRequest *req) {
+    SimSpec *spec = &priv->spec;
+    double t = 0;
+
+    // Seek grows as square root of distance, roughly as with real actuators
+    uint64_t distance = req->lba > priv->head_lba ? req->lba - priv->head_lba : priv->head_lba - req->lba;
+    if (distance)
+        t += spec->seek_min + (spec->seek_max - spec->seek_min) * sqrt((double)distance / spec->capacity);
+
+    // Rate drops linearly from outer to inner tracks
+    double rate = spec->rate_begin + (spec->rate_end - spec->rate_begin) * req->lba / spec->capacity;
+    double transfer = req->sectors * spec->logical_sector_size / rate;
+    for (int i = 0; i < spec->nb_slow; i++)
+        if (spec->slow[i].begin_lba < req->lba + req->sectors && req->lba < spec->slow[i].end_lba)
+            transfer *= spec->slow[i].slowdown;
+    t += transfer;
+
+    req->status = DC_BlockStatus_eOk;
+    if (req->op != DC_IoOp_eWrite) {
+        SimRange *bad = find_bad(spec, req->lba, req->sectors);
+        if (bad) {
+            req->status = bad->status;
+            // Like ATA devices, tell first failed sector on media errors
+            if (bad->status == DC_BlockStatus_eUnc || bad->status == DC_BlockStatus_eIdnf
+                    || bad->status == DC_BlockStatus_eAmnf) {
+                req->error_lba = bad->begin_lba > req->lba ? bad->begin_lba : req->lba;
+                req->error_lba_valid = 1;
+            }
+            t += bad->delay ? bad->delay : spec->bad_delay;
+        }
+    }
+    priv->head_lba = req->lba + req->sectors;
+    // Like kernel, abort command at timeout
+    if (req->timeout_ms && t >= req->timeout_ms * 1000.0) {
+        req->status = DC_BlockStatus_eTimeout;
+        req->error_lba_valid = 0;
+        t = req->timeout_ms * 1000.0;
+    }
+    return t;
+}
+
+// Each 8-byte word of sector holds its LBA, so that copies can be checked
+static void fill_data(SimSpec *spec, DC_IoRequest *req) {
+    uint64_t *words = req->buf;
+    for (size_t s = 0; s < req->sectors; s++)
+        for (size_t w = 0; w < spec->logical_sector_size / sizeof(uint64_t); w++)
+            *words++ = req->lba + s;
+}
+
+static int sim_open(DC_Io *io) {
+    SimIoPriv *priv = io->priv;
+    if (io->queue_depth > SIM_MAX_QUEUE_DEPTH)
+        io->queue_depth = SIM_MAX_QUEUE_DEPTH;
+    int r = spec_load(io->dev->dev_path, &priv->spec);
+    if (r) {
+        dc_log(DC_LOG_FATAL, "Failed to load simulated device %s\n", io->dev->dev_path);
+        return 1;
+    }
+    return 0;
+}
+
+static int sim_submit(DC_Io *io, DC_IoRequest *req) {
+    SimIoPriv *priv = io->priv;
+    if (req->lba + req->sectors > priv->spec.capacity)
+        return 1;
+    uint64_t t = model_time(priv, req);
+    if ((req->op == DC_IoOp_eRead || (req->op == DC_IoOp_eVerify && req->buf))
+            && req->status == DC_BlockStatus_eOk && !priv->spec.no_data)
+        fill_data(&priv->spec, req);
+
+    clock_gettime(DC_BEST_CLOCK, &req->submitted);
+    if (priv->spec.realtime) {
+        struct timespec delay = { .tv_sec = t / 1000000, .tv_nsec = (t % 1000000) * 1000 };
+        while (nanosleep(&delay, &delay))
+            ;
+        clock_gettime(DC_BEST_CLOCK, &req->completed);
+    } else {
+        // Modeled time is reported, without waiting for it; queued request starts after previous one
+        struct timespec start = req->submitted;
+        if (priv->nb_done && (priv->busy_until.tv_sec > start.tv_sec
+                    || (priv->busy_until.tv_sec == start.tv_sec && priv->busy_until.tv_nsec > start.tv_nsec)))
+            start = priv->busy_until;
+        req->completed.tv_sec = start.tv_sec + t / 1000000;
+        req->completed.tv_nsec = start.tv_nsec + (t % 1000000) * 1000;
+        if (req->completed.tv_nsec >= 1000000000) {
+            req->completed.tv_sec++;
+            req->completed.tv_nsec -= 1000000000;
+        }
+    }
+    priv->busy_until = req->completed;
+    priv->done[(priv->done_head + priv->nb_done++) % SIM_MAX_QUEUE_DEPTH] = req;
+    return 0;
+}
+
+static DC_IoRequest *sim_complete(DC_Io *io) {
+    SimIoPriv *priv = io->priv;
+    if (!priv->nb_done)
+        return NULL;
+    DC_IoRequest *req = priv->done[priv->done_head];
+    priv->done_head = (priv->done_head + 1) % SIM_MAX_QUEUE_DEPTH;
+    priv->nb_done--;
+    return req;
+}
+
+static void sim_close(DC_Io *io) {
+    SimIoPriv *priv = io->priv;
+    spec_free(&priv->spec);
+}
+
+const DC_IoBackend dc_io_backend_sim = {
+    .name = "sim",
+    .priv_data_size = sizeof(SimIoPriv),
+    .open = sim_open,
+    .submit = sim_submit,
+    .complete = sim_complete,
+    .close = sim_close,
+};
@@ -0,0 +1,91 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libdevcheck.h"
+#include "io_backend.h"
+#include "uring.h"
+
+typedef struct uring_io_priv {
+    Uring ring;
+    int buffers_registered;
+} UringIoPriv;
+
+static int uring_io_open(DC_Io *io) {
+    UringIoPriv *priv = io->priv;
+    int open_flags = ((io->flags & DC_IO_FLAG_WRITE) ? O_WRONLY : O_RDONLY) | O_DIRECT | O_LARGEFILE | O_NOATIME;
+    int r = uring_init(&priv->ring, io->queue_depth, uring_dev_supports_iopoll(io->dev->dev_fs_name));
+    if (r)
+        return 1;
+    io->fd = open(io->dev->dev_path, open_flags);
+    if (io->fd == -1) {
+        dc_log(DC_LOG_FATAL, "open %s fail\n", io->dev->dev_path);
+        uring_free(&priv->ring);
+        return 1;
+    }
+    dc_io_blkdev_setup(io);
+    return 0;
+}
+
+static int uring_io_register_buffers(DC_Io *io, struct iovec *iovecs, int nb_iovecs) {
+    UringIoPriv *priv = io->priv;
+    // Unregistered buffers just cost more per request
+    priv->buffers_registered = !uring_register_buffers(&priv->ring, iovecs, nb_iovecs);
+    return 0;
+}
+
+static int uring_io_submit(DC_Io *io, DC_IoRequest *req) {
+    UringIoPriv *priv = io->priv;
+    int fixed = priv->buffers_registered && req->buf_index >= 0;
+    int opcode;
+    if (req->op == DC_IoOp_eWrite)
+        opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    else
+        opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    // Passed to kernel in batch, when caller waits for completion
+    uring_prep_rw(&priv->ring, opcode, io->fd, req->buf,
+            req->sectors * io->dev->logical_sector_size, req->lba * io->dev->logical_sector_size,
+            fixed ? req->buf_index : 0, (uint64_t)(uintptr_t)req);
+    clock_gettime(DC_BEST_CLOCK, &req->submitted);
+    return 0;
+}
+
+static DC_IoRequest *uring_io_complete(DC_Io *io) {
+    UringIoPriv *priv = io->priv;
+    struct io_uring_cqe *cqe;
+    if (priv->ring.to_submit && uring_submit_and_wait(&priv->ring, 0))
+        return NULL;
+    while (!(cqe = uring_peek_cqe(&priv->ring))) {
+        if (uring_submit_and_wait(&priv->ring, 1))
+            return NULL;
+    }
+    DC_IoRequest *req = (DC_IoRequest*)(uintptr_t)cqe->user_data;
+    clock_gettime(DC_BEST_CLOCK, &req->completed);
+    if (cqe->res == (int32_t)(req->sectors * io->dev->logical_sector_size))
+        req->status = DC_BlockStatus_eOk;
+    else {
+        req->status = DC_BlockStatus_eError;
+        dc_io_set_short_transfer(io, req, cqe->res);
+    }
+    uring_cqe_seen(&priv->ring);
+    return req;
+}
+
+static void uring_io_close(DC_Io *io) {
+    UringIoPriv *priv = io->priv;
+    // Closing ring makes kernel wait for requests in flight
+    uring_free(&priv->ring);
+    dc_io_blkdev_restore(io);
+    close(io->fd);
+}
+
+const DC_IoBackend dc_io_backend_uring = {
+    .name = "uring",
+    .priv_data_size = sizeof(UringIoPriv),
+    .open = uring_io_open,
+    .register_buffers = uring_io_register_buffers,
+    .submit = uring_io_submit,
+    .complete = uring_io_complete,
+    .close = uring_io_close,
+};
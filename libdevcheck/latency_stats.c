@@ -0,0 +1,43 @@
+#include "latency_stats.h"
+
+static int bucket_index(uint64_t access_time) {
+    if (access_time < 4)
+        return access_time;
+    if (access_time >= (UINT64_C(1) << 32))
+        return DC_LATENCY_NB_BUCKETS - 1;
+    int order = 63 - __builtin_clzll(access_time);
+    // Two bits next to the highest one tell quarter within power of two
+    return order * 4 + ((access_time >> (order - 2)) & 3);
+}
+
+static uint64_t bucket_upper_bound(int index) {
+    if (index < 4)
+        return index + 1;
+    int order = index / 4;
+    return (uint64_t)(4 + index % 4 + 1) << (order - 2);
+}
+
+void dc_latency_stats_add(DC_LatencyStats *stats, uint64_t access_time) {
+    if (stats->nb_samples >= DC_LATENCY_WINDOW) {
+        stats->nb_samples = 0;
+        for (int i = 0; i < DC_LATENCY_NB_BUCKETS; i++) {
+            stats->buckets[i] /= 2;
+            stats->nb_samples += stats->buckets[i];
+        }
+    }
+    stats->buckets[bucket_index(access_time)]++;
+    stats->nb_samples++;
+}
+
+uint64_t dc_latency_stats_percentile(const DC_LatencyStats *stats, double fraction) {
+    if (!stats->nb_samples)
+        return 0;
+    uint64_t rank = stats->nb_samples * fraction;
+    uint64_t count = 0;
+    for (int i = 0; i < DC_LATENCY_NB_BUCKETS; i++) {
+        count += stats->buckets[i];
+        if (count > rank)
+            return bucket_upper_bound(i);
+    }
+    return bucket_upper_bound(DC_LATENCY_NB_BUCKETS - 1);
+}
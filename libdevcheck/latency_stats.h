@@ -0,0 +1,27 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <inttypes.h>
+
+// Four buckets per power of two, so percentiles are within 25%, up to 2^32 mcs
+#define DC_LATENCY_NB_BUCKETS 128
+// Older samples fade out, so that distribution follows device from zone to zone
+#define DC_LATENCY_WINDOW 4096
+
+/*
+ * Running distribution of access times of blocks, in mcs.
+ */
+typedef struct dc_latency_stats {
+    uint64_t buckets[DC_LATENCY_NB_BUCKETS];
+    uint64_t nb_samples;
+} DC_LatencyStats;
+
+void dc_latency_stats_add(DC_LatencyStats *stats, uint64_t access_time);
+
+/**
+ * Access time which given fraction of samples doesn't exceed, e.g. 0.99
+ * @return upper bound of bucket holding the percentile, 0 if there are no samples
+ */
+uint64_t dc_latency_stats_percentile(const DC_LatencyStats *stats, double fraction);
+
+#endif  // LATENCY_STATS_H
@@ -5,10 +5,17 @@
 #include <string.h>
 #include <sched.h>
 #include <time.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include "libdevcheck.h"
 #include "procedure.h"
 #include "utils.h"
+#include "io_backend.h"
+#include "sim_device.h"
+#include "dev_probe.h"
 
 clockid_t DC_BEST_CLOCK;
 
@@ -57,12 +64,15 @@ int dc_init(void) {
 }
 
 void dc_finish(void) {
+    dc_dev_probe_cache_free();
     free(dc_ctx_global);
     dc_ctx_global = NULL;
 }
 
 static void dev_list_build(DC_DevList *dc_devlist);
-static void dev_list_fill_info(DC_DevList *list);
+static void dev_list_mounted_fill(DC_DevList *list);
+static void dev_modelname_fill(DC_Dev *dev);
+static void dev_probe_apply(DC_Dev *dev);
 
 DC_DevList *dc_dev_list(void) {
     DC_DevList *list = calloc(1, sizeof(*list));
@@ -70,14 +80,53 @@ DC_DevList *dc_dev_list(void) {
     list->arr = NULL;
     list->arr_size = 0;
     dev_list_build(list);
-    dev_list_fill_info(list);
+    dev_list_mounted_fill(list);
+    // Picks up what is already known, e.g. from previous listing
+    dc_dev_list_update(list, 0);
     return list;
 }
 
+int dc_dev_list_update(DC_DevList *list, int timeout_ms) {
+    struct timespec start, now;
+    clock_gettime(DC_BEST_CLOCK, &start);
+    while (1) {
+        int nb_pending = 0;
+        for (DC_Dev *dev = list->arr; dev; dev = dev->next) {
+            dev_probe_apply(dev);
+            if (dev->probe_state != DC_DevProbeState_eDone)
+                nb_pending++;
+        }
+        clock_gettime(DC_BEST_CLOCK, &now);
+        int64_t elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (!nb_pending || elapsed_ms >= timeout_ms)
+            return nb_pending;
+        usleep(10000);
+    }
+}
+
+int dc_dev_wait_probed(DC_Dev *dev, int timeout_ms) {
+    for (int waited_ms = 0; ; waited_ms += 10) {
+        dev_probe_apply(dev);
+        if (dev->probe_state == DC_DevProbeState_eDone)
+            return 0;
+        if (waited_ms >= timeout_ms)
+            return 1;
+        usleep(10000);
+    }
+}
+
+static void dev_free(DC_Dev *dev) {
+    free(dev->dev_fs_name);
+    free(dev->dev_path);
+    free(dev->model_str);
+    free(dev->serial_no);
+    free(dev);
+}
+
 void dc_dev_list_free(DC_DevList *list) {
     while (list->arr) {
         DC_Dev *next = list->arr->next;
-        free(list->arr);
+        dev_free(list->arr);
         list->arr = next;
     }
     free(list);
@@ -98,6 +147,46 @@ DC_Dev *dc_dev_list_get_entry(DC_DevList *list, int index) {
     return dev;
 }
 
+DC_Dev *dc_dev_list_add_image(DC_DevList *list, const char *path) {
+    struct stat st;
+    uint64_t sim_capacity;
+    int sim_logical_sector_size, sim_physical_sector_size;
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+        dc_log(DC_LOG_ERROR, "%s is not a regular file\n", path);
+        return NULL;
+    }
+    int r = sim_device_probe(path, &sim_capacity, &sim_logical_sector_size, &sim_physical_sector_size);
+    if (r == -1)
+        return NULL;
+    int is_sim = (r == 0);
+    DC_Dev *dc_dev = calloc(1, sizeof(*dc_dev));
+    assert(dc_dev);
+    char *path_copy = strdup(path);
+    assert(path_copy);
+    dc_dev->dev_fs_name = strdup(basename(path_copy));
+    free(path_copy);
+    dc_dev->dev_path = strdup(path);
+    assert(dc_dev->dev_fs_name && dc_dev->dev_path);
+    dc_dev->model_str = strdup(is_sim ? "Simulated device" : "Image file");
+    dc_dev->serial_no = strdup(dc_dev->dev_fs_name);
+    assert(dc_dev->model_str && dc_dev->serial_no);
+    if (is_sim) {
+        dc_dev->capacity = sim_capacity;
+        dc_dev->logical_sector_size = sim_logical_sector_size;
+        dc_dev->physical_sector_size = sim_physical_sector_size;
+        dc_dev->io_backend = &dc_io_backend_sim;
+    } else {
+        dc_dev->logical_sector_size = dc_dev->physical_sector_size = 512;
+        dc_dev->capacity = st.st_size / 512 * 512;
+        dc_dev->io_backend = &dc_io_backend_file;
+    }
+    dc_dev->native_capacity = dc_dev->capacity;
+    dc_dev->probe_state = DC_DevProbeState_eDone;
+    dc_dev->next = list->arr;
+    list->arr = dc_dev;
+    list->arr_size++;
+    return dc_dev;
+}
 
 static int is_whole_disk(const char *name) {
     // SD cards have "mmcblkN" for whole devices,
@@ -110,12 +199,82 @@ static int is_whole_disk(const char *name) {
     if (!strncmp(name, "nvme", 4)) {
         return !strchr(name + 4, 'p');
     }
+    // Loop devices have "loopN" for whole devices,
+    // and "loopNpM" for partitions
+    if (!strncmp(name, "loop", 4)) {
+        return !strchr(name + 4, 'p');
+    }
     // taken from util-linux-2.19.1/lib/wholedisk.c
     while (*name)
         name++;
     return !isdigit(name[-1]);
 }
 
+static DC_Dev *dev_list_add_blkdev(DC_DevList *list, const char *name, dev_t devno, uint64_t capacity) {
+    int ret;
+    DC_Dev *dc_dev = calloc(1, sizeof(*dc_dev));
+    assert(dc_dev);
+    dc_dev->dev_fs_name = strdup(name);
+    assert(dc_dev->dev_fs_name);
+    ret = asprintf(&dc_dev->dev_path, "/dev/%s", name);
+    assert(ret != -1 && dc_dev->dev_path);
+    dc_dev->capacity = capacity;
+    dc_dev->devno = devno;
+    // Details are unknown until probe is done
+    dc_dev->logical_sector_size = dc_dev->physical_sector_size = 512;
+    dc_dev->probe = dc_dev_probe_get(dc_dev->devno, dc_dev->capacity, dc_dev->dev_path);
+    dc_dev->probe_state = DC_DevProbeState_ePending;
+    dev_modelname_fill(dc_dev);
+    dc_dev->next = list->arr;
+    list->arr = dc_dev;
+    list->arr_size++;
+    return dc_dev;
+}
+
+int dc_dev_list_sync_device(DC_DevList *list, const char *dev_fs_name) {
+    char path[200];
+    unsigned int ma, mi;
+    uint64_t size = 0;  // In 512-byte units, regardless of sector size
+    int present = 0;
+    if (!is_whole_disk(dev_fs_name))
+        return 0;
+    // Zero-sized disks, e.g. detached loop devices, are not listed, as in /proc/partitions
+    snprintf(path, sizeof(path), "/sys/class/block/%s/size", dev_fs_name);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        present = (fscanf(f, "%"SCNu64, &size) == 1 && size);
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "/sys/class/block/%s/dev", dev_fs_name);
+    f = present ? fopen(path, "r") : NULL;
+    if (f) {
+        present = (fscanf(f, "%u:%u", &ma, &mi) == 2);
+        fclose(f);
+    } else {
+        present = 0;
+    }
+
+    DC_Dev **link = &list->arr;
+    while (*link) {
+        DC_Dev *dev = *link;
+        if (dev->devno && !strcmp(dev->dev_fs_name, dev_fs_name)) {
+            if (present && dev->devno == makedev(ma, mi) && dev->capacity == size * 512)
+                return 0;  // Not changed
+            *link = dev->next;
+            list->arr_size--;
+            dev_free(dev);
+            break;
+        }
+        link = &dev->next;
+    }
+    if (present) {
+        DC_Dev *dev = dev_list_add_blkdev(list, dev_fs_name, makedev(ma, mi), size * 512);
+        dev_probe_apply(dev);
+    }
+    dev_list_mounted_fill(list);
+    return 1;
+}
+
 /*
  * try all things in /proc/partitions that look like a full disk
  * Taken from util-linux-2.19.1/fdisk/fdisk.c tryprocpt()
@@ -125,7 +284,6 @@ static void dev_list_build(DC_DevList *dc_devlist) {
 	char line[128], ptname[128];
 	int ma, mi;
 	unsigned long long sz;
-	int ret;
 
 	procpt = fopen("/proc/partitions", "r");
 	if (procpt == NULL) {
@@ -137,45 +295,49 @@ static void dev_list_build(DC_DevList *dc_devlist) {
 		if (sscanf (line, " %d %d %llu %127[^\n ]",
 			    &ma, &mi, &sz, ptname) != 4)
 			continue;
-		if (is_whole_disk(ptname)) {
-            DC_Dev *dc_dev = calloc(1, sizeof(*dc_dev));
-            assert(dc_dev);
-            dc_dev->dev_fs_name = strdup(ptname);
-            assert(dc_dev->dev_fs_name);
-            ret = asprintf(&dc_dev->dev_path, "/dev/%s", ptname);
-            assert(ret != -1 && dc_dev->dev_path);
-            dc_dev->capacity = sz * 1024;
-            dc_dev->next = dc_devlist->arr;
-            dc_devlist->arr = dc_dev;
-            dc_devlist->arr_size++;
-		}
+		if (is_whole_disk(ptname))
+            dev_list_add_blkdev(dc_devlist, ptname, makedev(ma, mi), sz * 1024);
 	}
 	fclose(procpt);
 }
 
-static void dev_modelname_fill(DC_Dev *dev);
-static void dev_mounted_fill(DC_Dev *dev);
-
-static void dev_list_fill_info(DC_DevList *list) {
-    DC_Dev *dev = list->arr;
-    while (dev) {
-        memset(dev->identify, 0, sizeof(dev->identify));
-        dev->ata_capable = !dc_dev_ata_identify(dev->dev_path, dev->identify);
-        if (dev->ata_capable) {
-            dc_dev_get_capacity(dev->dev_path, &dev->capacity);
-            dc_dev_get_native_capacity(dev->dev_path, &dev->native_capacity);
-            dev->serial_no = calloc(1, 21);
-            dc_ata_ascii_to_c_string(dev->identify + 20, 10, dev->serial_no);
-            dev->model_str = calloc(1, 41);
-            dc_ata_ascii_to_c_string(dev->identify + 54, 20, dev->model_str);
-            // for (int i = 0; i < 512; i++)
-            //     fprintf(stderr, "%c", dev->identify[i]);
+static void dev_probe_apply(DC_Dev *dev) {
+    DC_DevProbe *probe = dev->probe;
+    if (dev->probe_state == DC_DevProbeState_eDone)
+        return;
+    if (!dc_dev_probe_done(probe)) {
+        if (dc_dev_probe_age(probe) >= DC_DEV_PROBE_TIMEOUT_MS)
+            dev->probe_state = DC_DevProbeState_eTimedOut;
+        return;
+    }
+    memcpy(dev->identify, probe->identify, sizeof(dev->identify));
+    dev->ata_capable = probe->ata_capable;
+    // Kernel knows sector sizes of any block device, so it's asked first
+    if (probe->kernel_logical_sector_size) {
+        dev->logical_sector_size = probe->kernel_logical_sector_size;
+        dev->physical_sector_size = probe->kernel_physical_sector_size;
+        if (dev->ata_capable && probe->ata_logical_sector_size != dev->logical_sector_size) {
+            // LBAs of passthrough commands would address other sectors than LBAs of kernel
+            dc_log(DC_LOG_WARNING, "%s: logical sector size is %d by kernel, but %d by IDENTIFY; ATA commands disabled\n",
+                    dev->dev_path, dev->logical_sector_size, probe->ata_logical_sector_size);
+            dev->ata_capable = 0;
         }
-        if (!dev->model_str)
-            dev_modelname_fill(dev);
-        dev_mounted_fill(dev);
-        dev = dev->next;
+    } else if (dev->ata_capable) {
+        dev->logical_sector_size = probe->ata_logical_sector_size;
+        dev->physical_sector_size = probe->ata_physical_sector_size;
+    }
+    if (dev->ata_capable) {
+        dev->capacity = (probe->max_lba + 1) * dev->logical_sector_size;
+        if (probe->native_max_lba_valid)
+            dev->native_capacity = (probe->native_max_lba + 1) * dev->logical_sector_size;
+        // Probe may be replaced while list is still used
+        free(dev->serial_no);
+        dev->serial_no = strdup(probe->serial_no);
+        free(dev->model_str);
+        dev->model_str = strdup(probe->model_str);
+        assert(dev->serial_no && dev->model_str);
     }
+    dev->probe_state = DC_DevProbeState_eDone;
 }
 
 static void dev_modelname_fill(DC_Dev *dev) {
@@ -200,15 +362,42 @@ static void dev_modelname_fill(DC_Dev *dev) {
     assert(dev->model_str);
 }
 
-static void dev_mounted_fill(DC_Dev *dev) {
-    FILE *mtab = fopen("/etc/mtab", "r");
-    if (!mtab)
+// Device number of disk which partition belongs to, or the same if it's not partition
+static dev_t whole_disk_devno(dev_t devno) {
+    char path[100];
+    unsigned int ma, mi;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", major(devno), minor(devno));
+    if (access(path, F_OK))
+        return devno;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", major(devno), minor(devno));
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return devno;
+    if (fscanf(f, "%u:%u", &ma, &mi) == 2)
+        devno = makedev(ma, mi);
+    fclose(f);
+    return devno;
+}
+
+// Single pass over mount table for all devices, matched by device numbers rather than names
+static void dev_list_mounted_fill(DC_DevList *list) {
+    FILE *mountinfo = fopen("/proc/self/mountinfo", "r");
+    if (!mountinfo)
         return;
-    char line[200];
-    while (fgets(line, sizeof(line), mtab))
-        if (!strncmp(line, dev->dev_path, strlen(dev->dev_path))) {
-            dev->mounted = 1;
-            break;
-        }
-    fclose(mtab);
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned int ma, mi;
+    for (DC_Dev *dev = list->arr; dev; dev = dev->next)
+        if (dev->devno)
+            dev->mounted = 0;
+    while (getline(&line, &line_size, mountinfo) != -1) {
+        if (sscanf(line, "%*d %*d %u:%u", &ma, &mi) != 2 || !ma)
+            continue;  // Major 0 is for virtual filesystems
+        dev_t devno = whole_disk_devno(makedev(ma, mi));
+        for (DC_Dev *dev = list->arr; dev; dev = dev->next)
+            if (dev->devno == devno)
+                dev->mounted = 1;
+    }
+    free(line);
+    fclose(mountinfo);
 }
@@ -25,6 +25,7 @@ struct dc_ctx {
     enum DC_LogLevel log_level;
     void (*log_func)(void *priv, enum DC_LogLevel level, const char* fmt, va_list vl);
     void *logger_priv;
+    struct dc_dev_probe *dev_probe_cache;
 };
 
 extern DC_Ctx *dc_ctx_global;
@@ -43,12 +44,43 @@ struct dc_dev_list {
 int dc_init(void);
 void dc_finish(void);
 
+// Devices not answering for this long are reported as timed out
+#define DC_DEV_PROBE_TIMEOUT_MS 5000
+
 /**
- * Return array of testable block devices
+ * Return array of testable block devices.
+ * Returns without waiting for devices to answer: their details are probed in background,
+ * and are picked up by dc_dev_list_update(). Devices seen before are not probed again.
  */
 DC_DevList *dc_dev_list(void);
+/**
+ * Fill details of devices which have been probed since last call,
+ * waiting up to timeout_ms for all of them.
+ * @return number of devices still being probed
+ */
+int dc_dev_list_update(DC_DevList *list, int timeout_ms);
+/**
+ * Wait up to timeout_ms for single device to be probed.
+ * @return 0 if its details are filled
+ */
+int dc_dev_wait_probed(DC_Dev *dev, int timeout_ms);
 void dc_dev_list_free(DC_DevList *list);
 int dc_dev_list_size(DC_DevList *list);
 DC_Dev *dc_dev_list_get_entry(DC_DevList *list, int index);
 
+/**
+ * Bring list entry of block device in line with its current state: add it, remove it,
+ * or probe it again if its size has changed. Other entries are left untouched.
+ * @return 1 if list has changed
+ */
+int dc_dev_list_sync_device(DC_DevList *list, const char *dev_fs_name);
+
+/**
+ * Add regular file to list, to run procedures on it as on device.
+ * Useful with disk images, for reproducible testing.
+ * Simulated device spec (see sim_device.h) is added as device it describes.
+ * @return new list entry, or NULL on failure
+ */
+DC_Dev *dc_dev_list_add_image(DC_DevList *list, const char *path);
+
 #endif // LIBDEVCHECK_H
@@ -14,6 +14,11 @@ typedef struct dc_procedure DC_Procedure;
 struct dc_procedure_ctx;
 typedef struct dc_procedure_ctx DC_ProcedureCtx;
 
+struct dc_smart_event;
+typedef struct dc_smart_event DC_SmartEvent;
+struct dc_watchdog_event;
+typedef struct dc_watchdog_event DC_WatchdogEvent;
+
 typedef struct dc_renderer DC_Renderer;
 typedef struct dc_renderer_ctx DC_RendererCtx;
 
@@ -6,30 +6,55 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
 
 #include "procedure.h"
+#include "io_backend.h"
+
+// In order of preference; on lack of support next one is tried
+enum ZeroingMethod {
+    ZeroingMethod_eZeroout,  // BLKZEROOUT: kernel issues WRITE ZEROES / WRITE SAME to device
+    ZeroingMethod_eDiscard,  // BLKDISCARD, if device guarantees discarded blocks read as zeros
+    ZeroingMethod_eZeroRange,  // FALLOC_FL_ZERO_RANGE, for regular files
+    ZeroingMethod_eWrite,  // Writing buffer of zeros
+};
+
+static const char * const zeroing_method_names[] = {
+    [ZeroingMethod_eZeroout] = "BLKZEROOUT",
+    [ZeroingMethod_eDiscard] = "BLKDISCARD",
+    [ZeroingMethod_eZeroRange] = "fallocate(FALLOC_FL_ZERO_RANGE)",
+    [ZeroingMethod_eWrite] = "write()",
+};
 
 struct posix_write_zeros_priv {
     int64_t start_lba;
+    const char *offload_str;
+    const char *block_sectors_str;
+    int64_t block_sectors;
     int64_t end_lba;
+    int64_t current_lba;
     int64_t lba_to_process;
-    int fd;
+    DC_Io *io;
+    DC_IoRequest write_request;
     void *buf;
-    uint64_t blk_index;
+    enum ZeroingMethod method;
+    int discard_zeroes_data;
 };
 typedef struct posix_write_zeros_priv PosixWriteZerosPriv;
 
-#define SECTORS_AT_ONCE 256
-#define BLK_SIZE (SECTORS_AT_ONCE * 512) // FIXME hardcode
-
 static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
     (void)dev;
     if (!strcmp(setting->name, "start_lba")) {
         setting->value = strdup("0");
+    } else if (!strcmp(setting->name, "offload")) {
+        setting->value = strdup("yes");
+    } else if (!strcmp(setting->name, "block_sectors")) {
+        setting->value = strdup("auto");
     } else {
         return 1;
     }
@@ -41,27 +66,34 @@ static int Open(DC_ProcedureCtx *ctx) {
     PosixWriteZerosPriv *priv = ctx->priv;
 
     // Setting context
-    ctx->blk_size = BLK_SIZE;
-    priv->end_lba = ctx->dev->capacity / 512;
+    r = dc_io_parse_block_sectors(ctx->dev, Api_ePosix, priv->block_sectors_str, &priv->block_sectors);
+    if (r)
+        return 1;
+    ctx->blk_size = priv->block_sectors * ctx->dev->logical_sector_size;
+    priv->end_lba = ctx->dev->capacity / ctx->dev->logical_sector_size;
+    priv->current_lba = priv->start_lba;
     priv->lba_to_process = priv->end_lba - priv->start_lba;
-    ctx->progress.den = priv->lba_to_process / SECTORS_AT_ONCE;
-    if (priv->lba_to_process % SECTORS_AT_ONCE)
-        ctx->progress.den++;
+    if (priv->lba_to_process <= 0)
+        return 1;
+    // Blocks are aligned to block size, so first one is shorter if start_lba is not
+    ctx->progress.den = (priv->end_lba - 1) / priv->block_sectors - priv->start_lba / priv->block_sectors + 1;
 
     r = posix_memalign(&priv->buf, sysconf(_SC_PAGESIZE), ctx->blk_size);
     if (r)
         goto fail_buf;
     memset(priv->buf, 0, ctx->blk_size);
 
-    priv->fd = open(ctx->dev->dev_path, O_WRONLY | O_DIRECT | O_LARGEFILE | O_NOATIME);
-    if (priv->fd == -1) {
-        dc_log(DC_LOG_FATAL, "open %s fail\n", ctx->dev->dev_path);
+    priv->io = dc_io_open(ctx->dev, Api_ePosix, 1, DC_IO_FLAG_WRITE);
+    if (!priv->io)
         goto fail_open;
-    }
-    lseek(priv->fd, 512 * priv->start_lba, SEEK_SET);
-    r = ioctl(priv->fd, BLKFLSBUF, NULL);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Flushing block device buffers failed\n");
+
+    priv->method = strcmp(priv->offload_str, "yes") ? ZeroingMethod_eWrite : ZeroingMethod_eZeroout;
+    // Backends other than file, like simulated device, have no fd to offload zeroing to
+    if (ctx->dev->io_backend && ctx->dev->io_backend != &dc_io_backend_file)
+        priv->method = ZeroingMethod_eWrite;
+    unsigned int discard_zeroes_data = 0;
+    if (!ioctl(priv->io->fd, BLKDISCARDZEROES, &discard_zeroes_data))
+        priv->discard_zeroes_data = discard_zeroes_data;
     return 0;
 
 fail_open:
@@ -70,28 +102,66 @@ fail_buf:
     return 1;
 }
 
+static int is_unsupported_errno(int err) {
+    return err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == ENODEV;
+}
+
+// Returns 0 on success, errno otherwise
+static int zero_range(PosixWriteZerosPriv *priv, int64_t lba, size_t sectors) {
+    int sector_size = priv->io->dev->logical_sector_size;
+    uint64_t range[2] = { lba * sector_size, sectors * sector_size };
+    int fd = priv->io->fd;
+    int r;
+    switch (priv->method) {
+        case ZeroingMethod_eZeroout:
+            r = ioctl(fd, BLKZEROOUT, range);
+            break;
+        case ZeroingMethod_eDiscard:
+            if (!priv->discard_zeroes_data)
+                return EOPNOTSUPP;
+            r = ioctl(fd, BLKDISCARD, range);
+            break;
+        case ZeroingMethod_eZeroRange:
+            r = fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+            break;
+        default: {
+            DC_IoRequest *req = &priv->write_request;
+            req->op = DC_IoOp_eWrite;
+            req->lba = lba;
+            req->sectors = sectors;
+            req->buf = priv->buf;
+            req->buf_index = -1;
+            if (dc_io_execute(priv->io, req) || req->status != DC_BlockStatus_eOk)
+                return EIO;
+            return 0;
+        }
+    }
+    return r ? errno : 0;
+}
+
 static int Perform(DC_ProcedureCtx *ctx) {
-    ssize_t write_ret;
+    int err;
     PosixWriteZerosPriv *priv = ctx->priv;
-    size_t sectors_to_write = (priv->lba_to_process < SECTORS_AT_ONCE) ? priv->lba_to_process : SECTORS_AT_ONCE;
+    int64_t sectors_to_boundary = priv->block_sectors - priv->current_lba % priv->block_sectors;
+    size_t sectors_to_write = (priv->lba_to_process < sectors_to_boundary) ? priv->lba_to_process : sectors_to_boundary;
 
     // Updating context
-    ctx->report.lba = priv->start_lba + SECTORS_AT_ONCE * priv->blk_index;
+    ctx->report.lba = priv->current_lba;
     ctx->report.sectors_processed = sectors_to_write;
     ctx->report.blk_status = DC_BlockStatus_eOk;
-    priv->blk_index++;
 
     // Timing
     _dc_proc_time_pre(ctx);
 
     // Acting
-    write_ret = write(priv->fd, priv->buf, sectors_to_write * 512);
+    while ((err = zero_range(priv, ctx->report.lba, sectors_to_write))
+            && priv->method != ZeroingMethod_eWrite && is_unsupported_errno(err)) {
+        priv->method++;
+        dc_log(DC_LOG_INFO, "Falling back to zeroing with %s\n", zeroing_method_names[priv->method]);
+    }
 
     // Error handling
-    if (write_ret != (int)sectors_to_write * 512) {
-        // fd position is undefined, set it to write to next block
-        lseek(priv->fd, 512 * priv->start_lba + ctx->blk_size * priv->blk_index, SEEK_SET);
-
+    if (err) {
         // Updating context
         ctx->report.blk_status = DC_BlockStatus_eError;
     }
@@ -102,25 +172,33 @@ static int Perform(DC_ProcedureCtx *ctx) {
     // Updating context
     ctx->progress.num++;
     priv->lba_to_process -= sectors_to_write;
+    priv->current_lba += sectors_to_write;
 
     return 0;
 }
 
 static void Close(DC_ProcedureCtx *ctx) {
     PosixWriteZerosPriv *priv = ctx->priv;
+    dc_io_close(priv->io);
     free(priv->buf);
-    close(priv->fd);
 }
 
+static const char * const yesno_choices[] = {"yes", "no", NULL};
 static DC_ProcedureOption options[] = {
     { "start_lba", "set LBA address to begin from", offsetof(PosixWriteZerosPriv, start_lba), DC_ProcedureOptionType_eInt64 },
+    { "offload", "set whether to let device zero blocks by itself, where supported (yes/no)", offsetof(PosixWriteZerosPriv, offload_str), DC_ProcedureOptionType_eString, yesno_choices },
+    { "block_sectors", "set number of sectors written at once, or \"auto\" for largest request device takes unsplit", offsetof(PosixWriteZerosPriv, block_sectors_str), DC_ProcedureOptionType_eString },
     { NULL }
 };
 
 DC_Procedure posix_write_zeros = {
     .name = "posix_write_zeros",
     .display_name = "Write zeros",
-    .help = "Fills device space with zeros. Uses POSIX write() call, in direct mode",
+    .help = "Fills device space with zeros. Uses POSIX write() call, in direct mode.\n"
+        "With offload enabled, device is asked to zero blocks itself, and data is not transferred:\n"
+        "BLKZEROOUT is tried first (WRITE ZEROES or WRITE SAME on devices supporting these),\n"
+        "then BLKDISCARD if discarded blocks are guaranteed to read as zeros,\n"
+        "then fallocate() zeroing for regular files; write() is used if none of these works.",
     .flags = DC_PROC_FLAG_INVASIVE,
     .suggest_default_value = SuggestDefaultValue,
     .open = Open,
@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include "utils.h"
 #include "procedure.h"
+#include "smart_sampler.h"
+#include "sct.h"
+#include "watchdog.h"
 
 int dc_procedure_register(DC_Procedure *procedure) {
     procedure->next = dc_ctx_global->procedure_list;
@@ -102,7 +105,13 @@ fail_ctx:
 }
 
 void dc_procedure_close(DC_ProcedureCtx *ctx) {
+    // Before procedure closes fd
+    if (ctx->watchdog)
+        dc_watchdog_stop(ctx->watchdog);
+    dc_procedure_restore_erc(ctx);
     ctx->procedure->close(ctx);
+    if (ctx->smart_sampler)
+        dc_smart_sampler_close(ctx->smart_sampler);
     free(ctx->priv);
     free(ctx);
 }
@@ -114,7 +123,20 @@ int dc_procedure_perform_loop(DC_ProcedureCtx *ctx, ProcedureDetachedLoopCB call
     while (!ctx->interrupt) {
         if (ctx->progress.num >= ctx->progress.den)
             break;
+        ctx->reports = &ctx->report;
+        ctx->nb_reports = 1;
         perform_ret = ctx->procedure->perform(ctx);
+        if (ctx->timeout_adaptive)
+            for (int i = 0; i < ctx->nb_reports; i++)
+                if (ctx->reports[i].blk_status == DC_BlockStatus_eOk)
+                    dc_latency_stats_add(&ctx->latency, ctx->reports[i].blk_access_time);
+        ctx->nb_watchdog_events = 0;
+        if (ctx->watchdog)
+            ctx->nb_watchdog_events = dc_watchdog_poll(ctx->watchdog, &ctx->watchdog_events);
+        ctx->nb_smart_events = 0;
+        if (ctx->smart_sampler && !perform_ret)
+            ctx->nb_smart_events = dc_smart_sampler_poll(ctx->smart_sampler,
+                    ctx->reports, ctx->nb_reports, &ctx->smart_events);
         r = callback(ctx, callback_priv);
         if (perform_ret) {
             ret = perform_ret;
@@ -161,6 +183,29 @@ int dc_procedure_perform_loop_detached(DC_ProcedureCtx *ctx, ProcedureDetachedLo
     return 0;
 }
 
+void dc_procedure_watch_smart(DC_ProcedureCtx *ctx, int fd, int64_t interval_s) {
+    if (interval_s <= 0 || !ctx->dev->ata_capable)
+        return;
+    ctx->smart_sampler = dc_smart_sampler_open(fd, interval_s * 1000);
+    if (!ctx->smart_sampler)
+        dc_log(DC_LOG_WARNING, "SMART data is unavailable, error counters won't be watched\n");
+}
+
+void dc_procedure_limit_erc(DC_ProcedureCtx *ctx, int fd, int64_t timeout_ms) {
+    if (timeout_ms <= 0 || !ctx->dev->ata_capable)
+        return;
+    ctx->erc_limit = dc_sct_erc_limit_open(fd, timeout_ms);
+    if (!ctx->erc_limit)
+        dc_log(DC_LOG_WARNING, "SCT Error Recovery Control is unavailable, device may retry bad sectors for long\n");
+}
+
+void dc_procedure_restore_erc(DC_ProcedureCtx *ctx) {
+    if (!ctx->erc_limit)
+        return;
+    dc_sct_erc_limit_close(ctx->erc_limit);
+    ctx->erc_limit = NULL;
+}
+
 void _dc_proc_time_pre(DC_ProcedureCtx *ctx) {
     int r = clock_gettime(DC_BEST_CLOCK, &ctx->time_pre);
     assert(!r);
@@ -172,3 +217,47 @@ void _dc_proc_time_post(DC_ProcedureCtx *ctx) {
     ctx->report.blk_access_time = (ctx->time_post.tv_sec - ctx->time_pre.tv_sec) * 1000000 +
         (ctx->time_post.tv_nsec - ctx->time_pre.tv_nsec) / 1000;
 }
+
+void dc_procedure_watch_hangs(DC_ProcedureCtx *ctx, struct dc_io *io, int64_t hang_timeout_s) {
+    if (hang_timeout_s <= 0 || !ctx->dev->ata_capable)
+        return;
+    ctx->watchdog = dc_watchdog_start(io, hang_timeout_s * 1000);
+    if (!ctx->watchdog)
+        dc_log(DC_LOG_WARNING, "Starting watchdog failed, hung commands won't be reset\n");
+}
+
+int dc_procedure_io_reset_pending(DC_ProcedureCtx *ctx) {
+    return ctx->watchdog && dc_watchdog_reset_pending(ctx->watchdog);
+}
+
+int dc_procedure_reopen_io(DC_ProcedureCtx *ctx, uint64_t lba) {
+    return dc_watchdog_reopen(ctx->watchdog, lba);
+}
+
+int dc_procedure_set_timeout(DC_ProcedureCtx *ctx, const char *str) {
+    int64_t timeout_ms;
+    if (!strcmp(str, "auto")) {
+        ctx->timeout_ms = DC_DEFAULT_TIMEOUT_MS;
+        ctx->timeout_adaptive = 1;
+        return 0;
+    }
+    if (sscanf(str, "%"SCNd64, &timeout_ms) != 1 || timeout_ms < 0 || timeout_ms > UINT32_MAX)
+        return 1;
+    ctx->timeout_ms = timeout_ms;
+    ctx->timeout_adaptive = 0;
+    return 0;
+}
+
+unsigned int dc_procedure_cmd_timeout(DC_ProcedureCtx *ctx, int queue_depth, int suspect) {
+    if (!ctx->timeout_adaptive || ctx->latency.nb_samples < DC_ADAPTIVE_TIMEOUT_MIN_SAMPLES)
+        return ctx->timeout_ms;
+    uint64_t p99_mcs = dc_latency_stats_percentile(&ctx->latency, 0.99);
+    uint64_t factor = suspect ? DC_ADAPTIVE_TIMEOUT_FACTOR / 2 : DC_ADAPTIVE_TIMEOUT_FACTOR;
+    uint64_t timeout_ms = p99_mcs * factor * queue_depth / 1000;
+    // Tightening near defects goes no lower than floor either
+    if (timeout_ms < DC_ADAPTIVE_TIMEOUT_MIN_MS)
+        timeout_ms = DC_ADAPTIVE_TIMEOUT_MIN_MS;
+    if (timeout_ms > ctx->timeout_ms)
+        timeout_ms = ctx->timeout_ms;
+    return timeout_ms;
+}
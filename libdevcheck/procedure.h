@@ -3,9 +3,12 @@
 
 #include "libdevcheck.h"
 #include "device.h"
+#include "latency_stats.h"
 #include <pthread.h>
 #include <stddef.h>
 
+struct dc_io;
+
 #define DC_PROC_FLAG_INVASIVE 1
 #define DC_PROC_FLAG_REQUIRES_ATA 2
 
@@ -59,6 +62,16 @@ typedef struct dc_rational {
     uint64_t den;  // denominator
 } DC_Rational;
 
+// Of commands whose procedure hasn't set its own timeout, and ceiling of adaptive timeout
+#define DC_DEFAULT_TIMEOUT_MS 1000
+// Adaptive timeout is this many times 99th percentile of access time of healthy blocks
+#define DC_ADAPTIVE_TIMEOUT_FACTOR 8
+// Timeout makes kernel error handling reset the link, taking seconds, so short seek or
+// remap hiccup of healthy device must not reach it, even near defects
+#define DC_ADAPTIVE_TIMEOUT_MIN_MS 500
+// Till this many healthy blocks are seen, ceiling is used
+#define DC_ADAPTIVE_TIMEOUT_MIN_SAMPLES 100
+
 typedef enum {
     DC_BlockStatus_eOk = 0,
     DC_BlockStatus_eError,   // Generic error condition
@@ -74,6 +87,8 @@ typedef struct dc_block_report {
     uint64_t sectors_processed;
     uint64_t blk_access_time; // in mcs
     DC_BlockStatus blk_status;
+    int error_lba_valid;  // On failure, whether device told first failed sector
+    uint64_t error_lba;
 } DC_BlockReport;
 
 struct dc_procedure_ctx {
@@ -86,7 +101,27 @@ struct dc_procedure_ctx {
     int interrupt; // if set to 1 by frontend, then looped processing must stop
     // TODO interrupt is now meant for loop, think of interrupting blocking perform operation
     int finished; // if 1, then looped processing has finished
-    DC_BlockReport report; // updated by procedure on .perform()
+    DC_BlockReport report; // updated by single-report procedure on .perform()
+    // Reports of last .perform(). Before each call these are set to point to .report, so
+    // procedures which process one block per call need not care; others set their own batch
+    DC_BlockReport *reports;
+    int nb_reports;
+    // SMART sampler, if procedure has set it on .open(); closed along with context
+    struct dc_smart_sampler *smart_sampler;
+    // Changes of SMART error counters noticed after last .perform()
+    DC_SmartEvent *smart_events;
+    int nb_smart_events;
+    // Device error recovery timers limited by procedure on .open(); restored along with context
+    struct dc_sct_erc_limit *erc_limit;
+    // Watchdog of hung commands, if procedure has set it on .open(); stopped along with context
+    struct dc_watchdog *watchdog;
+    // Resets and reopens of device done after last .perform()
+    DC_WatchdogEvent *watchdog_events;
+    int nb_watchdog_events;
+    // Command timeout in ms, 0 for default of I/O backend; set by procedure on .open()
+    unsigned int timeout_ms;
+    int timeout_adaptive;  // Derive timeout from access times, up to timeout_ms
+    DC_LatencyStats latency;  // Of healthy blocks, kept for adaptive timeout
     void *user_priv;  // pointer to user interface private data
     struct timespec time_pre, time_post;  // block processing timing
 };
@@ -95,12 +130,44 @@ int dc_procedure_open(DC_Procedure *procedure, DC_Dev *dev, DC_ProcedureCtx **ct
 int dc_procedure_perform(DC_ProcedureCtx *ctx);
 void dc_procedure_close(DC_ProcedureCtx *ctx);
 
+// Called after each .perform(), with reports batch in ctx->reports
 typedef int (*ProcedureDetachedLoopCB)(DC_ProcedureCtx *ctx, void *callback_priv);
 int dc_procedure_perform_loop(DC_ProcedureCtx *ctx, ProcedureDetachedLoopCB callback, void *callback_priv);
 int dc_procedure_perform_loop_detached(DC_ProcedureCtx *ctx, ProcedureDetachedLoopCB callback,
         void *callback_priv, pthread_t *tid
         );
 
+// Used by procedure implementations on .open(): sample SMART on given fd every interval_s seconds, if enabled and supported
+void dc_procedure_watch_smart(DC_ProcedureCtx *ctx, int fd, int64_t interval_s);
+// Used by procedure implementations on .open(): limit time device retries failed sector to timeout_ms, if enabled and supported
+void dc_procedure_limit_erc(DC_ProcedureCtx *ctx, int fd, int64_t timeout_ms);
+// Give device its own recovery timers back before procedure ends, e.g. for last pass over bad sectors
+void dc_procedure_restore_erc(DC_ProcedureCtx *ctx);
+
+// Used by procedure implementations on .open(): reset device if command on given I/O hangs for hang_timeout_s seconds
+void dc_procedure_watch_hangs(DC_ProcedureCtx *ctx, struct dc_io *io, int64_t hang_timeout_s);
+// Whether watchdog has reset device, so procedure is to let commands in flight come back, then reopen I/O
+int dc_procedure_io_reset_pending(DC_ProcedureCtx *ctx);
+/**
+ * Reopen watched I/O after reset, retrying for a while if device hasn't come back yet
+ * @param lba: where procedure resumes
+ * @return 0 on success
+ */
+int dc_procedure_reopen_io(DC_ProcedureCtx *ctx, uint64_t lba);
+
+/**
+ * Used by procedure implementations on .open(): parse timeout option
+ * @param str: milliseconds, 0 for default of I/O backend, or "auto" for adaptive timeout
+ * @return 1 if value is invalid
+ */
+int dc_procedure_set_timeout(DC_ProcedureCtx *ctx, const char *str);
+/**
+ * Timeout for next command, in ms, 0 for default of I/O backend
+ * @param queue_depth: commands kept in flight, as command may wait for others ahead of it
+ * @param suspect: command goes near known defects, so hang is likely and timeout is tightened
+ */
+unsigned int dc_procedure_cmd_timeout(DC_ProcedureCtx *ctx, int queue_depth, int suspect);
+
 // Functions used internally by procedure implementations for timing
 void _dc_proc_time_pre(DC_ProcedureCtx *ctx);
 void _dc_proc_time_post(DC_ProcedureCtx *ctx);
@@ -11,27 +11,41 @@
 #include <errno.h>
 #include <assert.h>
 #include "procedure.h"
-#include "ata.h"
-#include "scsi.h"
+#include "io_backend.h"
+
+// Blocks reported per perform call, at most
+#define REPORTS_AT_ONCE 16
+
+typedef struct read_slot {
+    DC_IoRequest req;
+    int done;
+} ReadSlot;
 
 struct read_priv {
     const char *api_str;
+    const char *block_sectors_str;
+    const char *timeout_str;
+    int64_t block_sectors;
     int64_t start_lba;
     enum Api api;
     int64_t end_lba;
     int64_t lba_to_process;
-    int fd;
-    void *buf;
-    AtaCommand ata_command;
-    ScsiCommand scsi_command;
-    int old_readahead;
     uint64_t current_lba;
+    int64_t queue_depth;
+    int64_t smart_interval;
+    int64_t erc_timeout;
+    int64_t hang_timeout;
+    DC_Io *io;
+    ReadSlot *slots;  // Ring of io->queue_depth requests, in LBA order starting from slots_head
+    void *slots_buf;
+    int slots_head;
+    int nb_slots_used;  // Submitted and not yet reported
+    uint64_t submit_lba;
+    struct timespec last_completion;
+    DC_BlockReport reports[REPORTS_AT_ONCE];
 };
 typedef struct read_priv ReadPriv;
 
-#define SECTORS_AT_ONCE 256
-#define BLK_SIZE (SECTORS_AT_ONCE * 512) // FIXME hardcode
-
 static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
     (void)dev;
     if (!strcmp(setting->name, "api")) {
@@ -39,17 +53,64 @@ static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
             setting->value = strdup("ata");
         else
             setting->value = strdup("posix");
+    } else if (!strcmp(setting->name, "block_sectors")) {
+        setting->value = strdup("auto");
     } else if (!strcmp(setting->name, "start_lba")) {
         setting->value = strdup("0");
+    } else if (!strcmp(setting->name, "queue_depth")) {
+        setting->value = strdup("1");
+    } else if (!strcmp(setting->name, "smart_interval")) {
+        setting->value = strdup(dev->ata_capable ? "60" : "0");
+    } else if (!strcmp(setting->name, "hang_timeout")) {
+        setting->value = strdup(dev->ata_capable ? "30" : "0");
+    } else if (!strcmp(setting->name, "timeout")) {
+        setting->value = strdup("0");
+    } else if (!strcmp(setting->name, "erc_timeout")) {
+        setting->value = strdup("0");  // Access time of slow sectors is what we measure
     } else {
         return 1;
     }
     return 0;
 }
 
+static int slots_setup(DC_ProcedureCtx *ctx) {
+    ReadPriv *priv = ctx->priv;
+    int depth = priv->io->queue_depth;
+    struct iovec *iovecs;
+    int i;
+    int r;
+    priv->slots = calloc(depth, sizeof(ReadSlot));
+    if (!priv->slots)
+        return 1;
+    // ATA verification transfers no data, but POSIX reads need buffers
+    r = posix_memalign(&priv->slots_buf, sysconf(_SC_PAGESIZE), ctx->blk_size * depth);
+    if (r) {
+        free(priv->slots);
+        return 1;
+    }
+    iovecs = calloc(depth, sizeof(*iovecs));
+    assert(iovecs);
+    for (i = 0; i < depth; i++) {
+        ReadSlot *slot = &priv->slots[i];
+        slot->req.op = DC_IoOp_eVerify;
+        slot->req.buf = (uint8_t*)priv->slots_buf + i * ctx->blk_size;
+        slot->req.buf_index = i;
+        slot->req.user_data = slot;
+        iovecs[i].iov_base = slot->req.buf;
+        iovecs[i].iov_len = ctx->blk_size;
+    }
+    r = dc_io_register_buffers(priv->io, iovecs, depth);
+    free(iovecs);
+    if (r) {
+        free(priv->slots_buf);
+        free(priv->slots);
+        return 1;
+    }
+    return 0;
+}
+
 static int Open(DC_ProcedureCtx *ctx) {
     int r;
-    int open_flags;
     ReadPriv *priv = ctx->priv;
 
     // Setting context
@@ -61,117 +122,140 @@ static int Open(DC_ProcedureCtx *ctx) {
         return 1;
     if (priv->api == Api_eAta && !ctx->dev->ata_capable)
         return 1;
-    ctx->blk_size = BLK_SIZE;
+    r = dc_io_parse_block_sectors(ctx->dev, priv->api, priv->block_sectors_str, &priv->block_sectors);
+    if (r)
+        return 1;
+    r = dc_procedure_set_timeout(ctx, priv->timeout_str);
+    if (r)
+        return 1;
+    ctx->blk_size = priv->block_sectors * ctx->dev->logical_sector_size;
     priv->current_lba = priv->start_lba;
-    priv->end_lba = ctx->dev->capacity / 512;
+    priv->submit_lba = priv->start_lba;
+    priv->end_lba = ctx->dev->capacity / ctx->dev->logical_sector_size;
     priv->lba_to_process = priv->end_lba - priv->start_lba;
     if (priv->lba_to_process <= 0)
         return 1;
-    ctx->progress.den = priv->lba_to_process / SECTORS_AT_ONCE;
-    if (priv->lba_to_process % SECTORS_AT_ONCE)
-        ctx->progress.den++;
+    // Blocks are aligned to block size, so first one is shorter if start_lba is not
+    ctx->progress.den = (priv->end_lba - 1) / priv->block_sectors - priv->start_lba / priv->block_sectors + 1;
 
-    if (priv->api == Api_eAta) {
-        open_flags = O_RDWR;
-    } else {
-        r = posix_memalign(&priv->buf, sysconf(_SC_PAGESIZE), ctx->blk_size);
-        if (r)
-            return 1;
-
-        open_flags = O_RDONLY | O_DIRECT | O_LARGEFILE | O_NOATIME;
+    if (priv->queue_depth < 1 || priv->queue_depth > DC_IO_MAX_QUEUE_DEPTH) {
+        dc_log(DC_LOG_ERROR, "queue_depth must be from 1 to %d\n", DC_IO_MAX_QUEUE_DEPTH);
+        return 1;
     }
-
-    priv->fd = open(ctx->dev->dev_path, open_flags);
-    if (priv->fd == -1) {
-        dc_log(DC_LOG_FATAL, "open %s fail\n", ctx->dev->dev_path);
+    priv->io = dc_io_open(ctx->dev, priv->api, priv->queue_depth, 0);
+    if (!priv->io)
+        return 1;
+    r = slots_setup(ctx);
+    if (r) {
+        dc_io_close(priv->io);
         return 1;
     }
+    dc_procedure_watch_smart(ctx, priv->io->fd, priv->smart_interval);
+    dc_procedure_limit_erc(ctx, priv->io->fd, priv->erc_timeout);
+    dc_procedure_watch_hangs(ctx, priv->io, priv->hang_timeout);
+    return 0;
+}
 
-    lseek(priv->fd, 512 * priv->start_lba, SEEK_SET);
-    r = ioctl(priv->fd, BLKFLSBUF, NULL);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Flushing block device buffers failed\n");
-    r = ioctl(priv->fd, BLKRAGET, &priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Getting block device readahead setting failed\n");
-    r = ioctl(priv->fd, BLKRASET, 0);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Disabling block device readahead setting failed\n");
+static uint64_t timespec_diff_mcs(struct timespec *pre, struct timespec *post) {
+    int64_t diff = (post->tv_sec - pre->tv_sec) * 1000000 + (post->tv_nsec - pre->tv_nsec) / 1000;
+    return diff > 0 ? diff : 0;
+}
 
+static int submit_slots(DC_ProcedureCtx *ctx) {
+    ReadPriv *priv = ctx->priv;
+    int depth = priv->io->queue_depth;
+    int r;
+    // Keep queue full
+    while (priv->nb_slots_used < depth && (int64_t)priv->submit_lba < priv->end_lba) {
+        ReadSlot *slot = &priv->slots[(priv->slots_head + priv->nb_slots_used) % depth];
+        slot->req.lba = priv->submit_lba;
+        int64_t sectors_left = priv->end_lba - priv->submit_lba;
+        int64_t sectors_to_boundary = priv->block_sectors - priv->submit_lba % priv->block_sectors;
+        slot->req.sectors = (sectors_left < sectors_to_boundary) ? sectors_left : sectors_to_boundary;
+        slot->req.timeout_ms = dc_procedure_cmd_timeout(ctx, depth, 0);
+        slot->done = 0;
+        r = dc_io_submit(priv->io, &slot->req);
+        if (r)
+            return r;
+        priv->submit_lba += slot->req.sectors;
+        priv->nb_slots_used++;
+    }
     return 0;
 }
 
 static int Perform(DC_ProcedureCtx *ctx) {
-    ssize_t read_ret;
-    int ioctl_ret;
-    int ret = 0;
     ReadPriv *priv = ctx->priv;
-    size_t sectors_to_read = (priv->lba_to_process < SECTORS_AT_ONCE) ? priv->lba_to_process : SECTORS_AT_ONCE;
-
-    // Updating context
-    ctx->report.lba = priv->current_lba;
-    ctx->report.sectors_processed = sectors_to_read;
-    ctx->report.blk_status = DC_BlockStatus_eOk;
-
-    // Preparing to act
-    if (priv->api == Api_eAta) {
-        memset(&priv->ata_command, 0, sizeof(priv->ata_command));
-        memset(&priv->scsi_command, 0, sizeof(priv->scsi_command));
-        prepare_ata_command(&priv->ata_command, WIN_VERIFY_EXT /* 42h */, priv->current_lba, sectors_to_read);
-        prepare_scsi_command_from_ata(&priv->scsi_command, &priv->ata_command);
-    }
-
-    // Timing
-    _dc_proc_time_pre(ctx);
-
-    // Acting
-    if (priv->api == Api_eAta)
-        ioctl_ret = ioctl(priv->fd, SG_IO, &priv->scsi_command);
-    else
-        read_ret = read(priv->fd, priv->buf, sectors_to_read * 512);
-
-    // Timing
-    _dc_proc_time_post(ctx);
+    int depth = priv->io->queue_depth;
+    int r;
 
-    // Error handling
-    if (priv->api == Api_eAta) {
-        // Updating context
-        if (ioctl_ret) {
-            ctx->report.blk_status = DC_BlockStatus_eError;
-            ret = 1;
+    ctx->reports = priv->reports;
+    ctx->nb_reports = 0;
+    while (ctx->nb_reports < REPORTS_AT_ONCE) {
+        // After reset of device by watchdog, commands in flight come back failed; reopen once all have
+        if (dc_procedure_io_reset_pending(ctx) && !priv->nb_slots_used) {
+            r = dc_procedure_reopen_io(ctx, priv->submit_lba);
+            if (r)
+                return r;
         }
-        ctx->report.blk_status = scsi_ata_check_return_status(&priv->scsi_command);
-    } else {
-        if ((int)read_ret != (int)sectors_to_read * 512) {
-            // Position of fd is undefined. Set fd position to read next block
-            lseek(priv->fd, 512 * priv->current_lba, SEEK_SET);
+        if (!dc_procedure_io_reset_pending(ctx)) {
+            r = submit_slots(ctx);
+            if (r)
+                return r;
+        }
+        if (!priv->nb_slots_used)
+            break;
 
-            // Updating context
-            ctx->report.blk_status = DC_BlockStatus_eError;
+        // Blocks are reported in LBA order, so wait for the oldest one
+        ReadSlot *slot = &priv->slots[priv->slots_head];
+        while (!slot->done) {
+            DC_IoRequest *req = dc_io_complete(priv->io);
+            if (!req)
+                return 1;
+            ((ReadSlot*)req->user_data)->done = 1;
         }
-    }
 
-    // Updating context
-    ctx->progress.num++;
-    priv->lba_to_process -= sectors_to_read;
-    priv->current_lba += sectors_to_read;
+        // Updating context
+        DC_BlockReport *report = &priv->reports[ctx->nb_reports++];
+        report->lba = slot->req.lba;
+        report->sectors_processed = slot->req.sectors;
+        report->blk_status = slot->req.status;
+        report->error_lba_valid = slot->req.error_lba_valid;
+        report->error_lba = slot->req.error_lba;
+        // Requests overlap, so count only time the device spent on this block after previous one completed
+        struct timespec *service_start = &slot->req.submitted;
+        if (timespec_diff_mcs(&slot->req.submitted, &priv->last_completion))
+            service_start = &priv->last_completion;
+        report->blk_access_time = timespec_diff_mcs(service_start, &slot->req.completed);
+        if (timespec_diff_mcs(&priv->last_completion, &slot->req.completed))
+            priv->last_completion = slot->req.completed;
 
-    return ret;
+        priv->slots_head = (priv->slots_head + 1) % depth;
+        priv->nb_slots_used--;
+        ctx->progress.num++;
+        priv->lba_to_process -= slot->req.sectors;
+        priv->current_lba += slot->req.sectors;
+    }
+    return 0;
 }
 
 static void Close(DC_ProcedureCtx *ctx) {
     ReadPriv *priv = ctx->priv;
-    int r = ioctl(priv->fd, BLKRASET, priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Restoring block device readahead setting failed\n");
-    free(priv->buf);
-    close(priv->fd);
+    // Backend waits for or drops requests in flight, so buffers are freed after it
+    dc_io_close(priv->io);
+    free(priv->slots_buf);
+    free(priv->slots);
 }
 
 static const char * const api_choices[] = {"ata", "posix", NULL};
 static DC_ProcedureOption options[] = {
     { "api", "select operation API: \"posix\" for POSIX read(), \"ata\" for ATA \"READ VERIFY EXT\" command", offsetof(ReadPriv, api_str), DC_ProcedureOptionType_eString, api_choices },
     { "start_lba", "set LBA address to begin from", offsetof(ReadPriv, start_lba), DC_ProcedureOptionType_eInt64 },
+    { "block_sectors", "set number of sectors read at once, or \"auto\" for largest request device takes unsplit", offsetof(ReadPriv, block_sectors_str), DC_ProcedureOptionType_eString },
+    { "queue_depth", "set number of reads kept in flight; above 1, \"posix\" API uses io_uring, \"ata\" API uses asynchronous SCSI generic driver", offsetof(ReadPriv, queue_depth), DC_ProcedureOptionType_eInt64 },
+    { "smart_interval", "set seconds between SMART reads watching error counters, or 0 not to watch", offsetof(ReadPriv, smart_interval), DC_ProcedureOptionType_eInt64 },
+    { "timeout", "set milliseconds after which command is aborted as timed out, 0 for default, or \"auto\" to derive it from access times of healthy blocks", offsetof(ReadPriv, timeout_str), DC_ProcedureOptionType_eString },
+    { "hang_timeout", "set seconds without completion after which stuck command is aborted by device reset, then bus reset, and device is reopened; 0 not to watch", offsetof(ReadPriv, hang_timeout), DC_ProcedureOptionType_eInt64 },
+    { "erc_timeout", "set milliseconds device may spend retrying bad sector, or 0 to leave device setting", offsetof(ReadPriv, erc_timeout), DC_ProcedureOptionType_eInt64 },
     { NULL }
 };
 
@@ -179,7 +263,7 @@ static DC_ProcedureOption options[] = {
 DC_Procedure read_test = {
     .name = "read_test",
     .display_name = "Read test",
-    .help = "Verifies entire device with reading. It reads data sequentially, from given start LBA up to end. To get data from source device, it may use ATA \"READ VERIFY EXT\" command, or POSIX read() function, by user choice.",
+    .help = "Verifies entire device with reading. It reads data sequentially, from given start LBA up to end. To get data from source device, it may use ATA \"READ VERIFY EXT\" command, or POSIX read() function, by user choice. With queue_depth above 1, that many requests are kept in flight: POSIX reads are submitted through io_uring, and ATA commands through asynchronous write()/read() interface of matching /dev/sgN.",
     .suggest_default_value = SuggestDefaultValue,
     .open = Open,
     .perform = Perform,
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "report_queue.h"
+
+DC_ReportQueue *dc_report_queue_open(size_t capacity) {
+    DC_ReportQueue *queue;
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    int r = posix_memalign((void**)&queue, DC_CACHE_LINE_SIZE, sizeof(*queue));
+    if (r)
+        return NULL;
+    memset(queue, 0, sizeof(*queue));
+    queue->reports = calloc(size, sizeof(DC_BlockReport));
+    if (!queue->reports) {
+        free(queue);
+        return NULL;
+    }
+    queue->mask = size - 1;
+    return queue;
+}
+
+void dc_report_queue_close(DC_ReportQueue *queue) {
+    free(queue->reports);
+    free(queue);
+}
+
+size_t dc_report_queue_push(DC_ReportQueue *queue, const DC_BlockReport *reports, size_t nb_reports) {
+    uint64_t tail = queue->tail;
+    uint64_t nb_free = queue->mask + 1 - (tail - queue->head_cache);
+    if (nb_free < nb_reports) {
+        queue->head_cache = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        nb_free = queue->mask + 1 - (tail - queue->head_cache);
+        if (nb_free < nb_reports) {
+            __atomic_store_n(&queue->nb_overflows, queue->nb_overflows + 1, __ATOMIC_RELAXED);
+            nb_reports = nb_free;
+        }
+    }
+    for (size_t i = 0; i < nb_reports; i++)
+        queue->reports[(tail + i) & queue->mask] = reports[i];
+    // Publishes reports contents along with new tail
+    __atomic_store_n(&queue->tail, tail + nb_reports, __ATOMIC_RELEASE);
+    return nb_reports;
+}
+
+void dc_report_queue_push_wait(DC_ReportQueue *queue, const DC_BlockReport *reports, size_t nb_reports) {
+    for (;;) {
+        size_t nb_pushed = dc_report_queue_push(queue, reports, nb_reports);
+        reports += nb_pushed;
+        nb_reports -= nb_pushed;
+        if (!nb_reports)
+            break;
+        usleep(1000);
+    }
+}
+
+uint64_t dc_report_queue_overflows(DC_ReportQueue *queue) {
+    return __atomic_load_n(&queue->nb_overflows, __ATOMIC_RELAXED);
+}
+
+size_t dc_report_queue_peek(DC_ReportQueue *queue, const DC_BlockReport **reports) {
+    uint64_t head = queue->head;
+    if (head == queue->tail_cache) {
+        queue->tail_cache = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        if (head == queue->tail_cache)
+            return 0;
+    }
+    uint64_t index = head & queue->mask;
+    uint64_t nb_reports = queue->tail_cache - head;
+    // Run ends at end of array, the rest is given on next call
+    if (index + nb_reports > queue->mask + 1)
+        nb_reports = queue->mask + 1 - index;
+    *reports = &queue->reports[index];
+    return nb_reports;
+}
+
+void dc_report_queue_release(DC_ReportQueue *queue, size_t nb_reports) {
+    assert(queue->head + nb_reports <= queue->tail_cache);
+    // Slots are given back to producer only after consumer is done reading them
+    __atomic_store_n(&queue->head, queue->head + nb_reports, __ATOMIC_RELEASE);
+}
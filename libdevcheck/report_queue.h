@@ -0,0 +1,45 @@
+#ifndef REPORT_QUEUE_H
+#define REPORT_QUEUE_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "procedure.h"
+
+#define DC_CACHE_LINE_SIZE 64
+// Enough to hold reports of some seconds of fast sequential reading, if render thread stalls
+#define DC_REPORT_QUEUE_DEFAULT_CAPACITY (128 * 1024)
+
+// Lock-free queue of block reports from one producer (procedure thread)
+// to one consumer (render thread)
+typedef struct dc_report_queue {
+    DC_BlockReport *reports;
+    uint64_t mask;  // Number of slots minus one, which is power of 2
+
+    // Written by producer only
+    uint64_t tail __attribute__((aligned(DC_CACHE_LINE_SIZE)));
+    uint64_t head_cache;  // Last seen head, to not touch consumer's line on each push
+    uint64_t nb_overflows;  // Pushes rejected because queue was full
+
+    // Written by consumer only
+    uint64_t head __attribute__((aligned(DC_CACHE_LINE_SIZE)));
+    uint64_t tail_cache;
+} DC_ReportQueue;
+
+// Capacity is rounded up to power of 2
+DC_ReportQueue *dc_report_queue_open(size_t capacity);
+void dc_report_queue_close(DC_ReportQueue *queue);
+
+// Producer. Returns number of reports queued, less than nb_reports if queue got full
+size_t dc_report_queue_push(DC_ReportQueue *queue, const DC_BlockReport *reports, size_t nb_reports);
+// Producer. Retries until consumer makes space, sleeping between tries
+void dc_report_queue_push_wait(DC_ReportQueue *queue, const DC_BlockReport *reports, size_t nb_reports);
+uint64_t dc_report_queue_overflows(DC_ReportQueue *queue);
+
+// Consumer. Gives contiguous run of queued reports, returns its length, 0 if queue is empty.
+// Reports stay valid until dc_report_queue_release()
+size_t dc_report_queue_peek(DC_ReportQueue *queue, const DC_BlockReport **reports);
+// Consumer. Frees first nb_reports queued reports
+void dc_report_queue_release(DC_ReportQueue *queue, size_t nb_reports);
+
+#endif // REPORT_QUEUE_H
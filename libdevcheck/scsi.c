@@ -1,5 +1,10 @@
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 
 #include "scsi.h"
 
@@ -14,7 +19,7 @@ void prepare_scsi_command_from_ata(ScsiCommand *scsi_cmd, AtaCommand *ata_cmd) {
     scsi_cmd->io_hdr.dxferp = NULL;
     scsi_cmd->io_hdr.cmdp = scsi_cmd->scsi_cmd;  // Pointer to command
     scsi_cmd->io_hdr.sbp = scsi_cmd->sense_buf;
-    scsi_cmd->io_hdr.timeout = 1000;  // In millisec; MAX_UINT is no timeout
+    scsi_cmd->io_hdr.timeout = DC_DEFAULT_TIMEOUT_MS;  // In millisec; MAX_UINT is no timeout
     scsi_cmd->io_hdr.flags = SG_FLAG_DIRECT_IO;
     scsi_cmd->io_hdr.pack_id = 0;  // Unused internally
     scsi_cmd->io_hdr.usr_ptr = 0;  // Unused internally
@@ -42,6 +47,7 @@ void fill_scsi_ata_return_descriptor(ScsiAtaReturnDescriptor *scsi_ata_ret, Scsi
     memcpy(scsi_ata_ret->descriptor, descr, sizeof(scsi_ata_ret->descriptor));
     scsi_ata_ret->error = descr[3];
     scsi_ata_ret->status = descr[13];
+    scsi_ata_ret->count = descr[5] | (descr[4] << 8);
     scsi_ata_ret->lba  = 0;
     scsi_ata_ret->lba |= (uint64_t)descr[7];
     scsi_ata_ret->lba |= (uint64_t)descr[9]  <<  8;
@@ -51,6 +57,19 @@ void fill_scsi_ata_return_descriptor(ScsiAtaReturnDescriptor *scsi_ata_ret, Scsi
     scsi_ata_ret->lba |= (uint64_t)descr[10] << 40;
 }
 
+int scsi_ata_get_error_lba(ScsiCommand *scsi_command, uint64_t *lba) {
+    // Descriptor format sense data, with ATA Status Return descriptor first
+    if ((scsi_command->sense_buf[0] & 0x7e) != 0x72 || scsi_command->sense_buf[8] != 0x09)
+        return 1;
+    ScsiAtaReturnDescriptor scsi_ata_return;
+    fill_scsi_ata_return_descriptor(&scsi_ata_return, scsi_command);
+    if (!(scsi_ata_return.status & STATUS_BIT_ERR)
+            || !(scsi_ata_return.error & (ERROR_BIT_UNC | ERROR_BIT_IDNF | ERROR_BIT_AMNF)))
+        return 1;
+    *lba = scsi_ata_return.lba;
+    return 0;
+}
+
 int get_sense_key_from_sense_buffer(uint8_t *buf) {
     switch (buf[0]) {
         case 0x70:
@@ -64,7 +83,25 @@ int get_sense_key_from_sense_buffer(uint8_t *buf) {
     }
 }
 
+DC_BlockStatus scsi_check_transport_status(ScsiCommand *scsi_command) {
+    sg_io_hdr_t *io_hdr = &scsi_command->io_hdr;
+    int driver_status = io_hdr->driver_status & SCSI_DRIVER_STATUS_MASK;
+    if (io_hdr->host_status == SCSI_HOST_STATUS_TIME_OUT || driver_status == SCSI_DRIVER_STATUS_TIMEOUT)
+        return DC_BlockStatus_eTimeout;
+    // DID_RESET, DID_ABORT, DID_NO_CONNECT etc.
+    if (io_hdr->host_status || driver_status)
+        return DC_BlockStatus_eError;
+    // Succeeded, yet buffer is partly stale; failed command has resid anyway
+    if (io_hdr->status == 0 && io_hdr->dxfer_direction == SG_DXFER_FROM_DEV && io_hdr->resid)
+        return DC_BlockStatus_eError;
+    return DC_BlockStatus_eOk;
+}
+
 DC_BlockStatus scsi_ata_check_return_status(ScsiCommand *scsi_command) {
+    // Command aborted by kernel has no meaningful status
+    DC_BlockStatus transport_status = scsi_check_transport_status(scsi_command);
+    if (transport_status != DC_BlockStatus_eOk)
+        return transport_status;
     if (scsi_command->io_hdr.status == 0)
         return DC_BlockStatus_eOk;
     if (scsi_command->io_hdr.status != 0x02 /* CHECK_CONDITION */)
@@ -112,3 +149,67 @@ DC_BlockStatus scsi_ata_check_return_status(ScsiCommand *scsi_command) {
 
     return DC_BlockStatus_eOk;
 }
+
+int scsi_sg_open(const char *dev_fs_name) {
+    char path[300];
+    int fd = -1;
+    snprintf(path, sizeof(path), "/sys/block/%s/device/scsi_generic", dev_fs_name);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "sg", 2))
+            continue;
+        snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+        fd = open(path, O_RDWR);
+        break;
+    }
+    closedir(dir);
+    if (fd == -1)
+        return -1;
+
+    int sg_version;
+    int command_queuing = 1;
+    if (ioctl(fd, SG_GET_VERSION_NUM, &sg_version) || sg_version < 30000
+            || ioctl(fd, SG_SET_COMMAND_Q, &command_queuing)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int scsi_sg_submit(int sg_fd, ScsiCommand *scsi_cmd) {
+    ssize_t r;
+    scsi_cmd->io_hdr.usr_ptr = scsi_cmd;
+    do {
+        r = write(sg_fd, &scsi_cmd->io_hdr, sizeof(scsi_cmd->io_hdr));
+    } while (r == -1 && errno == EINTR);
+    return r != sizeof(scsi_cmd->io_hdr);
+}
+
+ScsiCommand *scsi_sg_receive(int sg_fd) {
+    sg_io_hdr_t io_hdr;
+    ssize_t r;
+    memset(&io_hdr, 0, sizeof(io_hdr));
+    io_hdr.interface_id = 'S';
+    do {
+        r = read(sg_fd, &io_hdr, sizeof(io_hdr));
+    } while (r == -1 && errno == EINTR);
+    if (r != sizeof(io_hdr))
+        return NULL;
+    // Sense data is already in place, as kernel writes it by sbp pointer given at submission
+    ScsiCommand *scsi_cmd = io_hdr.usr_ptr;
+    scsi_cmd->io_hdr = io_hdr;
+    return scsi_cmd;
+}
+
+int scsi_reset(const char *dev_path, int what) {
+    // Separate fd, as the one of stuck command is busy
+    int fd = open(dev_path, O_RDWR | O_NONBLOCK);
+    if (fd == -1)
+        return 1;
+    int r = ioctl(fd, SG_SCSI_RESET, &what);
+    close(fd);
+    return r == -1;
+}
@@ -31,10 +31,17 @@ typedef struct scsi_command {
 #define STATUS_BIT_DRDY ((uint8_t)(1 << 6))
 #define STATUS_BIT_BSY  ((uint8_t)(1 << 7))
 
+// Host status of command which kernel aborted on timeout (DID_TIME_OUT)
+#define SCSI_HOST_STATUS_TIME_OUT 0x03
+// Driver status, without DRIVER_SENSE (0x08) and suggestion bits which come along with valid sense data
+#define SCSI_DRIVER_STATUS_MASK 0x07
+#define SCSI_DRIVER_STATUS_TIMEOUT 0x06
+
 typedef struct scsi_ata_return_descriptor {
     uint8_t descriptor[14];
     uint8_t error;
     uint8_t status;
+    uint16_t count;
     uint64_t lba;
 } ScsiAtaReturnDescriptor;
 
@@ -44,6 +51,44 @@ void fill_scsi_ata_return_descriptor(ScsiAtaReturnDescriptor *scsi_ata_ret, Scsi
 
 int get_sense_key_from_sense_buffer(uint8_t *buf);
 
+/**
+ * Whether command has come back through transport at all: not aborted on timeout,
+ * by reset or error handling, nor lost with device; and, if it succeeded, with all data
+ * transferred. SCSI status of such failed command is 0, though nothing was done.
+ * @return DC_BlockStatus_eOk if it has, DC_BlockStatus_eTimeout or DC_BlockStatus_eError otherwise
+ */
+DC_BlockStatus scsi_check_transport_status(ScsiCommand *scsi_command);
 DC_BlockStatus scsi_ata_check_return_status(ScsiCommand *scsi_command);
 
+/**
+ * LBA of first failed sector, from ATA Status Return descriptor of failed command
+ * @return 0 if descriptor is present and error is of kind which reports LBA
+ */
+int scsi_ata_get_error_lba(ScsiCommand *scsi_command, uint64_t *lba);
+
+/**
+ * Open SCSI generic node (/dev/sgN) matching block device, for asynchronous commands.
+ * @return fd or -1
+ */
+int scsi_sg_open(const char *dev_fs_name);
+
+/**
+ * Queue command through sg v3 write() interface. Completion is fetched with scsi_sg_receive().
+ * @return 0 on success
+ */
+int scsi_sg_submit(int sg_fd, ScsiCommand *scsi_cmd);
+
+/**
+ * Wait for any submitted command to complete, update its io_hdr output members
+ * @return completed command, or NULL on failure
+ */
+ScsiCommand *scsi_sg_receive(int sg_fd);
+
+/**
+ * Reset device or whole bus it's on, aborting commands in flight
+ * @param what: SG_SCSI_RESET_DEVICE or SG_SCSI_RESET_BUS
+ * @return 0 on success
+ */
+int scsi_reset(const char *dev_path, int what);
+
 #endif  // SCSI_H
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sct.h"
+
+// SCT Command/Status log is accessed by SMART READ/WRITE LOG
+#define LOG_SCT_COMMAND_STATUS 0xe0
+#define SMART_LBA_SIGNATURE ((SMART_HCYL_PASS << 16) | (SMART_LCYL_PASS << 8))
+
+#define SCT_ACTION_ERC 0x0003
+#define SCT_ERC_FUNCTION_SET 0x0001
+#define SCT_ERC_FUNCTION_GET 0x0002
+#define SCT_ERC_SELECTION_READ 0x0001
+#define SCT_ERC_SELECTION_WRITE 0x0002
+
+int dc_sct_erc_supported(const uint8_t identify[512]) {
+    // Word 206: bit 0 SCT Command Transport, bit 3 SCT Error Recovery Control
+    uint16_t word206 = identify[206 * 2] | (identify[206 * 2 + 1] << 8);
+    return (word206 & 0x0009) == 0x0009;
+}
+
+// Sends single ERC command as key sector written to SCT Command/Status log
+static int erc_command(DC_AtaSession *session, uint16_t function, uint16_t selection, uint16_t *value) {
+    uint8_t key[512];
+    uint16_t words[] = { SCT_ACTION_ERC, function, selection, *value };
+    memset(key, 0, sizeof(key));
+    for (unsigned int i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        key[i * 2] = words[i];
+        key[i * 2 + 1] = words[i] >> 8;
+    }
+    dc_ata_session_prepare(session, &session->cmd, DC_AtaProtocol_ePioOut, WIN_SMART /* B0h */,
+            SMART_WRITE_LOG_SECTOR, SMART_LBA_SIGNATURE | LOG_SCT_COMMAND_STATUS, 1, key, sizeof(key));
+    session->cmd.scsi_cmd[1] &= ~1;  // 28-bit command, clear EXTEND bit
+    if (dc_ata_session_exec(session, &session->cmd))
+        return -1;
+    // Returned timer is in Count and LBA (7:0)
+    if (function == SCT_ERC_FUNCTION_GET)
+        *value = (session->ret.count & 0xff) | ((session->ret.lba & 0xff) << 8);
+    return 0;
+}
+
+int dc_sct_erc_get(DC_AtaSession *session, DC_SctErc *erc) {
+    erc->read_timer = 0;
+    erc->write_timer = 0;
+    if (erc_command(session, SCT_ERC_FUNCTION_GET, SCT_ERC_SELECTION_READ, &erc->read_timer))
+        return -1;
+    return erc_command(session, SCT_ERC_FUNCTION_GET, SCT_ERC_SELECTION_WRITE, &erc->write_timer);
+}
+
+int dc_sct_erc_set(DC_AtaSession *session, const DC_SctErc *erc) {
+    uint16_t read_timer = erc->read_timer;
+    uint16_t write_timer = erc->write_timer;
+    if (erc_command(session, SCT_ERC_FUNCTION_SET, SCT_ERC_SELECTION_READ, &read_timer))
+        return -1;
+    return erc_command(session, SCT_ERC_FUNCTION_SET, SCT_ERC_SELECTION_WRITE, &write_timer);
+}
+
+DC_SctErcLimit *dc_sct_erc_limit_open(int fd, uint64_t timeout_ms) {
+    DC_AtaSession *session = dc_ata_session_open_fd(fd);
+    if (!session)
+        return NULL;
+    return dc_sct_erc_limit_open_session(session, timeout_ms);
+}
+
+DC_SctErcLimit *dc_sct_erc_limit_open_session(DC_AtaSession *session, uint64_t timeout_ms) {
+    uint8_t identify[512];
+    DC_SctErcLimit *limit = calloc(1, sizeof(*limit));
+    if (!limit)
+        goto fail;
+    limit->session = session;
+    if (dc_ata_session_identify(limit->session, identify) || !dc_sct_erc_supported(identify))
+        goto fail_limit;
+    if (dc_sct_erc_get(limit->session, &limit->saved))
+        goto fail_limit;
+
+    // Round up, as 0 would disable limit instead
+    uint64_t units = (timeout_ms + DC_SCT_ERC_UNIT_MS - 1) / DC_SCT_ERC_UNIT_MS;
+    DC_SctErc erc;
+    erc.read_timer = units ? (units > 0xffff ? 0xffff : units) : 1;
+    erc.write_timer = erc.read_timer;
+    if (dc_sct_erc_set(limit->session, &erc)) {
+        // Read timer could be set already
+        dc_sct_erc_set(limit->session, &limit->saved);
+        goto fail_limit;
+    }
+    return limit;
+
+fail_limit:
+    free(limit);
+fail:
+    dc_ata_session_close(session);
+    return NULL;
+}
+
+void dc_sct_erc_limit_close(DC_SctErcLimit *limit) {
+    dc_sct_erc_set(limit->session, &limit->saved);
+    dc_ata_session_close(limit->session);
+    free(limit);
+}
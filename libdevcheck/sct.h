@@ -0,0 +1,40 @@
+#ifndef SCT_H
+#define SCT_H
+
+#include <inttypes.h>
+
+#include "ata_session.h"
+
+// SCT Error Recovery Control timers count in these units
+#define DC_SCT_ERC_UNIT_MS 100
+
+// Limits of time device spends on internal retries of failed read or write
+typedef struct dc_sct_erc {
+    uint16_t read_timer;  // In DC_SCT_ERC_UNIT_MS, 0 means no limit
+    uint16_t write_timer;
+} DC_SctErc;
+
+// Whether IDENTIFY DEVICE data tells SCT Error Recovery Control is supported
+int dc_sct_erc_supported(const uint8_t identify[512]);
+// Current (volatile) timers, through SCT Command Transport
+int dc_sct_erc_get(DC_AtaSession *session, DC_SctErc *erc);
+// Volatile setting, it's lost on power cycle
+int dc_sct_erc_set(DC_AtaSession *session, const DC_SctErc *erc);
+
+/*
+ * Timers set by procedure for its duration, on procedure's own fd,
+ * with values found at start kept to put them back.
+ */
+typedef struct dc_sct_erc_limit {
+    DC_AtaSession *session;
+    DC_SctErc saved;
+} DC_SctErcLimit;
+
+// NULL if device doesn't support SCT ERC or has refused new timers
+DC_SctErcLimit *dc_sct_erc_limit_open(int fd, uint64_t timeout_ms);
+// Same on given session, which is owned by limit then, and closed along with it or on failure
+DC_SctErcLimit *dc_sct_erc_limit_open_session(DC_AtaSession *session, uint64_t timeout_ms);
+// Restores saved timers, fd must still be open
+void dc_sct_erc_limit_close(DC_SctErcLimit *limit);
+
+#endif  // SCT_H
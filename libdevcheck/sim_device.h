@@ -0,0 +1,33 @@
+#ifndef SIM_DEVICE_H
+#define SIM_DEVICE_H
+
+#include <inttypes.h>
+
+/*
+ * Simulated device is a text file describing defects and timings of a disk,
+ * served by "sim" I/O backend. LBAs and sizes are in sectors, times in mcs:
+ *
+ *   # whdd simulated device
+ *   capacity 1953525168
+ *   rate 180 90                 # MB/s at first and at last LBA
+ *   seek 1000 15000             # adjacent and full stroke seek time
+ *   bad_delay 2000000           # default time spent on failing read
+ *   bad 1000000 8 unc 7000000   # LBA, length, [status], [time spent]
+ *   slow 5000000 100000 4       # LBA, length, slowdown factor
+ *   realtime yes                # actually wait for modeled time; otherwise it's only reported
+ *   data no                     # leave read buffers untouched, to save time
+ *   sector_size 4096 4096       # logical and [physical] sector size in bytes, 512 by default
+ *
+ * Status is one of: error, timeout, unc, idnf, abrt, amnf.
+ * Command modeled to take longer than its timeout fails with timeout status at that time.
+ * Read data is the LBA of each sector repeated in 8-byte words, unless disabled.
+ */
+#define SIM_DEVICE_MAGIC "# whdd simulated device"
+
+/**
+ * @return 0 if file is simulated device spec, filling capacity in bytes and sector sizes;
+ *         1 if it's not; -1 if spec is malformed
+ */
+int sim_device_probe(const char *path, uint64_t *capacity, int *logical_sector_size, int *physical_sector_size);
+
+#endif  // SIM_DEVICE_H
@@ -0,0 +1,121 @@
+#include <string.h>
+
+#include "smart.h"
+
+// SMART subcommands go in features register, cylinder registers hold signature
+#define SMART_LBA_SIGNATURE ((SMART_HCYL_PASS << 16) | (SMART_LCYL_PASS << 8))
+
+static int smart_command(DC_AtaSession *session, DC_AtaProtocol protocol, uint8_t subcommand, uint8_t *buf) {
+    dc_ata_session_prepare(session, &session->cmd, protocol, WIN_SMART /* B0h */, subcommand,
+            SMART_LBA_SIGNATURE, buf ? 1 : 0, buf, buf ? 512 : 0);
+    session->cmd.scsi_cmd[1] &= ~1;  // 28-bit command, clear EXTEND bit
+    return dc_ata_session_exec(session, &session->cmd) ? -1 : 0;
+}
+
+int dc_smart_enable(DC_AtaSession *session) {
+    return smart_command(session, DC_AtaProtocol_eNonData, SMART_ENABLE, NULL);
+}
+
+int dc_smart_read_data(DC_AtaSession *session, uint8_t data[512]) {
+    return smart_command(session, DC_AtaProtocol_ePioIn, SMART_READ_VALUES, data);
+}
+
+int dc_smart_read_thresholds(DC_AtaSession *session, uint8_t thresholds[512]) {
+    return smart_command(session, DC_AtaProtocol_ePioIn, SMART_READ_THRESHOLDS, thresholds);
+}
+
+// Sum of all bytes including checksum in last byte is zero
+static int checksum_valid(const uint8_t buf[512]) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += buf[i];
+    return sum == 0;
+}
+
+int dc_smart_parse(const uint8_t data[512], const uint8_t thresholds[512], DC_Smart *smart) {
+    int ret = 0;
+    memset(smart, 0, sizeof(*smart));
+    if (!checksum_valid(data) || (thresholds && !checksum_valid(thresholds)))
+        ret = 1;
+    // Both tables are 12-byte entries from offset 2, but slots of same attribute may differ
+    for (int i = 0; i < DC_SMART_NB_ATTRS; i++) {
+        const uint8_t *entry = data + 2 + i * 12;
+        if (!entry[0])
+            continue;
+        DC_SmartAttr *attr = &smart->attrs[smart->nb_attrs++];
+        attr->id = entry[0];
+        attr->flags = entry[1] | (entry[2] << 8);
+        attr->value = entry[3];
+        attr->worst = entry[4];
+        attr->raw = 0;
+        for (int j = 5; j >= 0; j--)
+            attr->raw = (attr->raw << 8) | entry[5 + j];
+        if (!thresholds)
+            continue;
+        for (int j = 0; j < DC_SMART_NB_ATTRS; j++) {
+            const uint8_t *thr_entry = thresholds + 2 + j * 12;
+            if (thr_entry[0] == attr->id) {
+                attr->threshold = thr_entry[1];
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+int dc_smart_read(DC_AtaSession *session, DC_Smart *smart) {
+    uint8_t data[512];
+    uint8_t thresholds[512];
+    if (dc_smart_read_data(session, data))
+        return -1;
+    if (dc_smart_read_thresholds(session, thresholds))
+        return dc_smart_parse(data, NULL, smart);
+    return dc_smart_parse(data, thresholds, smart);
+}
+
+DC_SmartAttr *dc_smart_find_attr(DC_Smart *smart, uint8_t id) {
+    for (int i = 0; i < smart->nb_attrs; i++)
+        if (smart->attrs[i].id == id)
+            return &smart->attrs[i];
+    return NULL;
+}
+
+int dc_smart_attr_failing(const DC_SmartAttr *attr) {
+    return attr->threshold && attr->value <= attr->threshold;
+}
+
+const char *dc_smart_attr_name(uint8_t id) {
+    switch (id) {
+        case 1: return "Raw_Read_Error_Rate";
+        case 2: return "Throughput_Performance";
+        case 3: return "Spin_Up_Time";
+        case 4: return "Start_Stop_Count";
+        case 5: return "Reallocated_Sector_Ct";
+        case 7: return "Seek_Error_Rate";
+        case 8: return "Seek_Time_Performance";
+        case 9: return "Power_On_Hours";
+        case 10: return "Spin_Retry_Count";
+        case 11: return "Calibration_Retry_Count";
+        case 12: return "Power_Cycle_Count";
+        case 183: return "Runtime_Bad_Block";
+        case 184: return "End-to-End_Error";
+        case 187: return "Reported_Uncorrect";
+        case 188: return "Command_Timeout";
+        case 189: return "High_Fly_Writes";
+        case 190: return "Airflow_Temperature_Cel";
+        case 191: return "G-Sense_Error_Rate";
+        case 192: return "Power-Off_Retract_Count";
+        case 193: return "Load_Cycle_Count";
+        case 194: return "Temperature_Celsius";
+        case 195: return "Hardware_ECC_Recovered";
+        case 196: return "Reallocated_Event_Count";
+        case 197: return "Current_Pending_Sector";
+        case 198: return "Offline_Uncorrectable";
+        case 199: return "UDMA_CRC_Error_Count";
+        case 200: return "Multi_Zone_Error_Rate";
+        case 240: return "Head_Flying_Hours";
+        case 241: return "Total_LBAs_Written";
+        case 242: return "Total_LBAs_Read";
+        default: return "Unknown_Attribute";
+    }
+}
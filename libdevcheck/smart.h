@@ -0,0 +1,55 @@
+#ifndef SMART_H
+#define SMART_H
+
+#include <inttypes.h>
+
+#include "ata_session.h"
+
+// Slots in SMART data structure
+#define DC_SMART_NB_ATTRS 30
+
+typedef struct dc_smart_attr {
+    uint8_t id;
+    uint16_t flags;
+    uint8_t value;  // Normalized, higher is better
+    uint8_t worst;
+    uint8_t threshold;  // 0 if thresholds weren't read
+    uint64_t raw;  // 48 bits, vendor specific meaning
+} DC_SmartAttr;
+
+typedef struct dc_smart {
+    int nb_attrs;  // Non-empty slots, packed to the beginning of array
+    DC_SmartAttr attrs[DC_SMART_NB_ATTRS];
+} DC_Smart;
+
+#define DC_SMART_ATTR_FLAG_PREFAILURE 0x0001
+#define DC_SMART_ATTR_FLAG_ONLINE     0x0002
+
+// SMART ENABLE OPERATIONS
+int dc_smart_enable(DC_AtaSession *session);
+// SMART READ DATA, raw 512-byte structure
+int dc_smart_read_data(DC_AtaSession *session, uint8_t data[512]);
+// SMART READ ATTRIBUTE THRESHOLDS, obsolete in ATA-8 but reported by all drives
+int dc_smart_read_thresholds(DC_AtaSession *session, uint8_t thresholds[512]);
+
+/**
+ * Parse attribute table from raw structures, without talking to device
+ * @param thresholds: may be NULL
+ * @return 0 on success, 1 if some structure checksum mismatches; table is filled anyway
+ */
+int dc_smart_parse(const uint8_t data[512], const uint8_t thresholds[512], DC_Smart *smart);
+
+/**
+ * Read data and thresholds and parse them.
+ * @return 0 on success, -1 on command failure, 1 on checksum mismatch
+ */
+int dc_smart_read(DC_AtaSession *session, DC_Smart *smart);
+
+// NULL if not found
+DC_SmartAttr *dc_smart_find_attr(DC_Smart *smart, uint8_t id);
+// Commonly used meaning of attribute, "Unknown_Attribute" for others
+const char *dc_smart_attr_name(uint8_t id);
+// Normalized value has reached threshold
+int dc_smart_attr_failing(const DC_SmartAttr *attr);
+
+#endif  // SMART_H
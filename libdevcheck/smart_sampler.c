@@ -0,0 +1,139 @@
+#include <stdlib.h>
+
+#include "smart_sampler.h"
+
+// Raw values of these are counters of errors, others may change on their own
+static const uint8_t watched_attrs[] = {
+    5,    // Reallocated_Sector_Ct
+    10,   // Spin_Retry_Count
+    184,  // End-to-End_Error
+    187,  // Reported_Uncorrect
+    188,  // Command_Timeout
+    196,  // Reallocated_Event_Count
+    197,  // Current_Pending_Sector
+    198,  // Offline_Uncorrectable
+    199,  // UDMA_CRC_Error_Count
+};
+
+static uint64_t timespec_diff_mcs(struct timespec *pre, struct timespec *post) {
+    int64_t diff = (post->tv_sec - pre->tv_sec) * 1000000 + (post->tv_nsec - pre->tv_nsec) / 1000;
+    return diff > 0 ? diff : 0;
+}
+
+/*
+ * Reads SMART data, measuring how long it took. Thresholds aren't needed for deltas,
+ * so it's one command.
+ * @return 0 on success, -1 on command failure, 1 on checksum mismatch
+ */
+static int sample(DC_SmartSampler *sampler, DC_Smart *smart, uint64_t *latency_mcs) {
+    uint8_t data[512];
+    struct timespec pre, post;
+    clock_gettime(DC_BEST_CLOCK, &pre);
+    int r = dc_smart_read_data(sampler->session, data);
+    clock_gettime(DC_BEST_CLOCK, &post);
+    *latency_mcs = timespec_diff_mcs(&pre, &post);
+    if (r)
+        return -1;
+    return dc_smart_parse(data, NULL, smart);
+}
+
+DC_SmartSampler *dc_smart_sampler_open(int fd, uint64_t interval_ms) {
+    DC_SmartSampler *sampler = calloc(1, sizeof(*sampler));
+    if (!sampler)
+        return NULL;
+    sampler->session = dc_ata_session_open_fd(fd);
+    if (!sampler->session)
+        goto fail;
+    sampler->interval_ms = interval_ms;
+    sampler->cur_interval_ms = interval_ms;
+    // First sample is baseline for deltas. Checksum mismatch may be a glitch of this read,
+    // so only failed command is fatal
+    int r = sample(sampler, &sampler->prev, &sampler->min_latency_mcs);
+    if (r == -1)
+        goto fail_session;
+    sampler->prev_valid = !r;
+    clock_gettime(DC_BEST_CLOCK, &sampler->last_sample);
+    return sampler;
+
+fail_session:
+    dc_ata_session_close(sampler->session);
+fail:
+    free(sampler);
+    return NULL;
+}
+
+void dc_smart_sampler_close(DC_SmartSampler *sampler) {
+    dc_ata_session_close(sampler->session);
+    free(sampler);
+}
+
+static void backoff(DC_SmartSampler *sampler) {
+    sampler->cur_interval_ms *= 2;
+    if (sampler->cur_interval_ms > sampler->interval_ms * DC_SMART_SAMPLER_MAX_BACKOFF)
+        sampler->cur_interval_ms = sampler->interval_ms * DC_SMART_SAMPLER_MAX_BACKOFF;
+}
+
+static void recover(DC_SmartSampler *sampler) {
+    sampler->cur_interval_ms /= 2;
+    if (sampler->cur_interval_ms < sampler->interval_ms)
+        sampler->cur_interval_ms = sampler->interval_ms;
+}
+
+int dc_smart_sampler_poll(DC_SmartSampler *sampler, const DC_BlockReport *reports, int nb_reports,
+        DC_SmartEvent **events) {
+    struct timespec now;
+    *events = sampler->events;
+    if (!nb_reports)
+        return 0;
+    clock_gettime(DC_BEST_CLOCK, &now);
+    if (timespec_diff_mcs(&sampler->last_sample, &now) < sampler->cur_interval_ms * 1000)
+        return 0;
+    sampler->last_sample = now;
+
+    // Extra command to struggling device would only make it worse
+    for (int i = 0; i < nb_reports; i++) {
+        if (reports[i].blk_status || reports[i].blk_access_time >= DC_SMART_SAMPLER_SLOW_BLOCK_MCS) {
+            backoff(sampler);
+            return 0;
+        }
+    }
+
+    DC_Smart smart;
+    uint64_t latency_mcs;
+    int r = sample(sampler, &smart, &latency_mcs);
+    if (r == -1) {
+        backoff(sampler);
+        return 0;
+    }
+    if (latency_mcs < sampler->min_latency_mcs)
+        sampler->min_latency_mcs = latency_mcs;
+    // Slack keeps jitter of fast command from being taken for slow down
+    if (latency_mcs > sampler->min_latency_mcs * 4 + 10000)
+        backoff(sampler);
+    else
+        recover(sampler);
+    // Corrupted sample would make a change and its reversal on next one; previous one is kept
+    if (r)
+        return 0;
+    if (!sampler->prev_valid) {
+        sampler->prev = smart;
+        sampler->prev_valid = 1;
+        return 0;
+    }
+
+    const DC_BlockReport *last_report = &reports[nb_reports - 1];
+    int nb_events = 0;
+    for (unsigned int i = 0; i < sizeof(watched_attrs); i++) {
+        DC_SmartAttr *attr = dc_smart_find_attr(&smart, watched_attrs[i]);
+        DC_SmartAttr *prev_attr = dc_smart_find_attr(&sampler->prev, watched_attrs[i]);
+        if (!attr || !prev_attr || attr->raw == prev_attr->raw)
+            continue;
+        DC_SmartEvent *event = &sampler->events[nb_events++];
+        event->id = attr->id;
+        event->delta = attr->raw - prev_attr->raw;
+        event->raw = attr->raw;
+        event->lba = last_report->lba + last_report->sectors_processed;
+    }
+    sampler->prev = smart;
+    return nb_events;
+}
@@ -0,0 +1,50 @@
+#ifndef SMART_SAMPLER_H
+#define SMART_SAMPLER_H
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "smart.h"
+#include "procedure.h"
+
+// Interval grows up to this many times configured one, while device is slow
+#define DC_SMART_SAMPLER_MAX_BACKOFF 16
+// Block taking longer than this, or failed, means device is struggling, so sample is postponed
+#define DC_SMART_SAMPLER_SLOW_BLOCK_MCS 500000
+
+// Change of error counter attribute between two samples
+struct dc_smart_event {
+    uint8_t id;
+    int64_t delta;  // Change of raw value
+    uint64_t raw;  // New raw value
+    uint64_t lba;  // Position of procedure when change was noticed
+};
+
+/*
+ * Reads SMART data between blocks of procedure, on procedure's own fd,
+ * and reports changes of error counters like reallocated and pending sectors.
+ */
+typedef struct dc_smart_sampler {
+    DC_AtaSession *session;
+    uint64_t interval_ms;  // Configured
+    uint64_t cur_interval_ms;  // With backoff
+    uint64_t min_latency_mcs;  // Of SMART READ DATA; baseline to notice slow down
+    struct timespec last_sample;
+    DC_Smart prev;
+    int prev_valid;  // 0 if baseline had checksum mismatch; next good sample replaces it
+    DC_SmartEvent events[DC_SMART_NB_ATTRS];
+} DC_SmartSampler;
+
+// NULL if device doesn't return SMART data
+DC_SmartSampler *dc_smart_sampler_open(int fd, uint64_t interval_ms);
+void dc_smart_sampler_close(DC_SmartSampler *sampler);
+
+/**
+ * Take sample if interval has passed; called between blocks.
+ * @param reports: blocks processed since previous call, to see whether device is slow
+ * @return number of events, pointed by *events until next call
+ */
+int dc_smart_sampler_poll(DC_SmartSampler *sampler, const DC_BlockReport *reports, int nb_reports,
+        DC_SmartEvent **events);
+
+#endif  // SMART_SAMPLER_H
@@ -1,22 +1,97 @@
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "procedure.h"
+#include "smart.h"
 #include "utils.h"
 
+// General Purpose logs
+#define LOG_DIRECTORY 0x00
+#define LOG_EXT_COMPREHENSIVE_ERROR 0x03
+
 struct smart_show_priv {
 };
 typedef struct smart_show_priv SmartShowPriv;
 
-static int Open(DC_ProcedureCtx *ctx) {
+// Device error count from Extended Comprehensive SMART error log, -1 if drive doesn't keep it
+static int read_error_count(DC_AtaSession *session) {
+    uint8_t buf[512];
+    if (dc_ata_session_read_log_ext(session, LOG_DIRECTORY, 0, 1, buf))
+        return -1;
+    // Directory holds number of pages of each log, log 0 itself is version
+    int nb_pages = buf[LOG_EXT_COMPREHENSIVE_ERROR * 2] | (buf[LOG_EXT_COMPREHENSIVE_ERROR * 2 + 1] << 8);
+    if (!nb_pages)
+        return -1;
+    if (dc_ata_session_read_log_ext(session, LOG_EXT_COMPREHENSIVE_ERROR, 0, 1, buf))
+        return -1;
+    return buf[500] | (buf[501] << 8);
+}
+
+static void render(FILE *out, DC_Dev *dev, DC_Smart *smart, int error_count) {
+    fprintf(out, "Device Model:  %s\n", dev->model_str ? : "");
+    fprintf(out, "Serial Number: %s\n\n", dev->serial_no ? : "");
+    fprintf(out, "ID# ATTRIBUTE_NAME          FLAG   VALUE WORST THRESH TYPE     UPDATED RAW_VALUE\n");
+    for (int i = 0; i < smart->nb_attrs; i++) {
+        DC_SmartAttr *attr = &smart->attrs[i];
+        fprintf(out, "%3d %-23s 0x%04x %03d   %03d   %03d    %-8s %-7s %"PRIu64"%s\n",
+                attr->id, dc_smart_attr_name(attr->id), attr->flags,
+                attr->value, attr->worst, attr->threshold,
+                attr->flags & DC_SMART_ATTR_FLAG_PREFAILURE ? "Pre-fail" : "Old_age",
+                attr->flags & DC_SMART_ATTR_FLAG_ONLINE ? "Always" : "Offline",
+                attr->raw, dc_smart_attr_failing(attr) ? "  FAILING_NOW" : "");
+    }
+    if (error_count >= 0)
+        fprintf(out, "\nATA errors logged: %d\n", error_count);
+}
+
+// SMART of devices without ATA passthrough, in whatever form smartctl has for them
+static int show_smartctl_text(DC_ProcedureCtx *ctx) {
     char *text = dc_dev_smartctl_text(ctx->dev->dev_path, " -i -s on -A ");
-    if (text) {
-        dc_log(DC_LOG_INFO, "%s", text);
-        free(text);
-        return 0;
-    } else {
+    if (!text) {
         dc_log(DC_LOG_ERROR, "%s", "Getting SMART attributes failed");
         return 1;
     }
+    dc_log(DC_LOG_INFO, "%s", text);
+    free(text);
+    return 0;
+}
+
+static int Open(DC_ProcedureCtx *ctx) {
+    DC_Smart smart;
+    char *text = NULL;
+    size_t text_size;
+    int ret = 1;
+
+    if (!ctx->dev->ata_capable)
+        return show_smartctl_text(ctx);
+
+    DC_AtaSession *session = dc_ata_session_open(ctx->dev->dev_path);
+    if (!session) {
+        dc_log(DC_LOG_FATAL, "open %s fail\n", ctx->dev->dev_path);
+        return 1;
+    }
+    if (dc_smart_enable(session))
+        dc_log(DC_LOG_WARNING, "Command SMART ENABLE OPERATIONS failed\n");
+    int r = dc_smart_read(session, &smart);
+    if (r == -1) {
+        dc_log(DC_LOG_ERROR, "%s", "Getting SMART attributes failed");
+        goto fail;
+    }
+    if (r)
+        dc_log(DC_LOG_WARNING, "SMART data checksum mismatch\n");
+    int error_count = read_error_count(session);
+
+    FILE *out = open_memstream(&text, &text_size);
+    if (!out)
+        goto fail;
+    render(out, ctx->dev, &smart, error_count);
+    fclose(out);
+    dc_log(DC_LOG_INFO, "%s", text);
+    free(text);
+    ret = 0;
+fail:
+    dc_ata_session_close(session);
+    return ret;
 }
 
 static void Close(DC_ProcedureCtx *ctx) {
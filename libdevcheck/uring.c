@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "log.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(Uring *ring, unsigned entries, int iopoll) {
+    struct io_uring_params p;
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    if (iopoll)
+        p.flags |= IORING_SETUP_IOPOLL;
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd == -1 && iopoll) {
+        memset(&p, 0, sizeof(p));
+        iopoll = 0;
+        ring->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (ring->fd == -1) {
+        dc_log(DC_LOG_WARNING, "io_uring_setup failed, errno %d\n", errno);
+        return 1;
+    }
+    ring->iopoll = iopoll;
+    ring->sq_entries = p.sq_entries;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring_ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring_ptr == MAP_FAILED)
+        goto fail_sq;
+    ring->cq_ring_ptr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring_ptr == MAP_FAILED)
+        goto fail_cq;
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_sqes;
+
+    uint8_t *sq = ring->sq_ring_ptr;
+    uint8_t *cq = ring->cq_ring_ptr;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+
+fail_sqes:
+    munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+fail_cq:
+    munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+fail_sq:
+    dc_log(DC_LOG_WARNING, "io_uring mmap failed, errno %d\n", errno);
+    close(ring->fd);
+    return 1;
+}
+
+void uring_free(Uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+    munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+int uring_register_buffers(Uring *ring, struct iovec *iovecs, unsigned nb_iovecs) {
+    int r = sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, nb_iovecs);
+    if (r == -1) {
+        dc_log(DC_LOG_WARNING, "io_uring buffers registration failed, errno %d\n", errno);
+        return 1;
+    }
+    return 0;
+}
+
+void uring_prep_rw(Uring *ring, int opcode, int fd, void *buf, unsigned len, uint64_t offset,
+        int buf_index, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    // Publish SQE to kernel
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+int uring_submit_and_wait(Uring *ring, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int r;
+    // With IOPOLL, completions are only found when we ask kernel to poll for them
+    if (ring->iopoll && !min_complete && !ring->to_submit)
+        flags |= IORING_ENTER_GETEVENTS;
+    do {
+        r = sys_io_uring_enter(ring->fd, ring->to_submit, min_complete, flags);
+    } while (r == -1 && errno == EINTR);
+    if (r == -1) {
+        dc_log(DC_LOG_ERROR, "io_uring_enter failed, errno %d\n", errno);
+        return 1;
+    }
+    ring->to_submit -= r;  // Number of consumed SQEs
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_dev_supports_iopoll(const char *dev_fs_name) {
+    char path[200];
+    int io_poll = 0;
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/io_poll", dev_fs_name);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%d", &io_poll) != 1)
+        io_poll = 0;
+    fclose(f);
+    return io_poll;
+}
@@ -0,0 +1,60 @@
+#ifndef URING_H
+#define URING_H
+
+#include <inttypes.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper over raw syscalls, so we don't depend on liburing
+typedef struct uring {
+    int fd;
+    int iopoll;  // Ring is set up with IORING_SETUP_IOPOLL, completions must be polled
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;  // SQEs filled but not yet passed to kernel
+    void *sq_ring_ptr;
+    size_t sq_ring_size;
+    void *cq_ring_ptr;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+/**
+ * Set up ring of given number of entries.
+ * @param iopoll: request IORING_SETUP_IOPOLL; it is dropped silently if kernel refuses it
+ * @return 0 on success
+ */
+int uring_init(Uring *ring, unsigned entries, int iopoll);
+void uring_free(Uring *ring);
+
+int uring_register_buffers(Uring *ring, struct iovec *iovecs, unsigned nb_iovecs);
+
+/**
+ * Queue IORING_OP_READ/WRITE, or their _FIXED variants using registered buffer #buf_index.
+ * Caller must not queue more than sq_entries at once.
+ */
+void uring_prep_rw(Uring *ring, int opcode, int fd, void *buf, unsigned len, uint64_t offset,
+        int buf_index, uint64_t user_data);
+
+/**
+ * Pass queued SQEs to kernel and wait for at least min_complete completions.
+ * @return 0 on success
+ */
+int uring_submit_and_wait(Uring *ring, unsigned min_complete);
+
+// Returns next completion or NULL; mark it consumed with uring_cqe_seen()
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+
+// Whether block device queue reports polled I/O capability (/sys/block/<dev>/queue/io_poll)
+int uring_dev_supports_iopoll(const char *dev_fs_name);
+
+#endif  // URING_H
@@ -8,10 +8,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "utils.h"
 #include "log.h"
 #include "scsi.h"
+#include "ata_session.h"
 
 char *cmd_output(char *command_line) {
     int r;
@@ -182,36 +186,26 @@ fail:
     return 1;
 }
 
-int dc_dev_get_native_capacity(char *dev_fs_path, uint64_t *capacity) {
+int dc_dev_get_native_capacity(char *dev_fs_path, int sector_size, uint64_t *capacity) {
     int ret = dc_dev_get_native_max_lba(dev_fs_path, capacity);
     if (!ret)
-        *capacity = (*capacity + 1) * 512;
+        *capacity = (*capacity + 1) * sector_size;
     return ret;
 }
 
 int dc_dev_get_native_max_lba(char *dev_fs_path, uint64_t *max_lba) {
-    int ioctl_ret;
-    int fd = open(dev_fs_path, O_RDWR);
-    if (fd == -1)
-        return -1;
-    AtaCommand ata_command;
-    prepare_ata_command(&ata_command, WIN_READ_NATIVE_MAX_EXT /* 27h */, 0, 0);
-    ScsiCommand scsi_command;
-    prepare_scsi_command_from_ata(&scsi_command, &ata_command);
-    ioctl_ret = ioctl(fd, SG_IO, &scsi_command);
-    close(fd);
-    if (ioctl_ret)
+    DC_AtaSession *session = dc_ata_session_open(dev_fs_path);
+    if (!session)
         return -1;
-    ScsiAtaReturnDescriptor scsi_ata_ret;
-    fill_scsi_ata_return_descriptor(&scsi_ata_ret, &scsi_command);
-    *max_lba = scsi_ata_ret.lba;
-    return 0;
+    int ret = dc_ata_session_read_native_max_lba(session, max_lba);
+    dc_ata_session_close(session);
+    return ret;
 }
 
-int dc_dev_get_capacity(char *dev_fs_path, uint64_t *capacity) {
+int dc_dev_get_capacity(char *dev_fs_path, int sector_size, uint64_t *capacity) {
     int ret = dc_dev_get_max_lba(dev_fs_path, capacity);
     if (!ret)
-        *capacity = (*capacity + 1) * 512;
+        *capacity = (*capacity + 1) * sector_size;
     return ret;
 }
 
@@ -221,43 +215,31 @@ int dc_dev_get_max_lba(char *dev_fs_path, uint64_t *max_lba) {
     ret = dc_dev_ata_identify(dev_fs_path, buf);
     if (ret)
         return ret;
-    *max_lba = (uint64_t)buf[200]
-        | ((uint64_t)buf[201] << 8)
-        | ((uint64_t)buf[202] << 16)
-        | ((uint64_t)buf[203] << 24)
-        | ((uint64_t)buf[204] << 32)
-        | ((uint64_t)buf[205] << 40);
-    (*max_lba)--;
+    *max_lba = dc_ata_identify_max_lba(buf);
     return 0;
 }
 
-int dc_dev_set_max_capacity(char *dev_fs_path, uint64_t capacity) {
-    return dc_dev_set_max_lba(dev_fs_path, capacity / 512 - 1);
+uint64_t dc_ata_identify_max_lba(const uint8_t identify[512]) {
+    uint64_t nb_sectors = (uint64_t)identify[200]
+        | ((uint64_t)identify[201] << 8)
+        | ((uint64_t)identify[202] << 16)
+        | ((uint64_t)identify[203] << 24)
+        | ((uint64_t)identify[204] << 32)
+        | ((uint64_t)identify[205] << 40);
+    return nb_sectors - 1;
+}
+
+int dc_dev_set_max_capacity(char *dev_fs_path, int sector_size, uint64_t capacity) {
+    return dc_dev_set_max_lba(dev_fs_path, capacity / sector_size - 1);
 }
 
 int dc_dev_set_max_lba(char *dev_fs_path, uint64_t lba) {
-    int ioctl_ret;
-    uint64_t old_max_lba;
-    dc_dev_get_native_capacity(dev_fs_path, &old_max_lba);  // Have read from hdparm.c that this is required by standard before setting
-    int fd = open(dev_fs_path, O_RDWR);
-    if (fd == -1)
+    DC_AtaSession *session = dc_ata_session_open(dev_fs_path);
+    if (!session)
         return -1;
-    AtaCommand ata_command;
-    prepare_ata_command(&ata_command, WIN_SET_MAX_EXT /* 37h */, lba, 1 /* value volatile bit */);
-    ScsiCommand scsi_command;
-    prepare_scsi_command_from_ata(&scsi_command, &ata_command);
-    ioctl_ret = ioctl(fd, SG_IO, &scsi_command);
-    close(fd);
-    if (ioctl_ret)
-        return ioctl_ret;
-
-    // Parse response
-    ScsiAtaReturnDescriptor scsi_ata_ret;
-    fill_scsi_ata_return_descriptor(&scsi_ata_ret, &scsi_command);
-    int sense_key = get_sense_key_from_sense_buffer(scsi_command.sense_buf);
-    if (scsi_ata_ret.status & STATUS_BIT_ERR || sense_key > 0x01)
-        return -1;
-    return 0;
+    int ret = dc_ata_session_set_max_lba(session, lba);
+    dc_ata_session_close(session);
+    return ret;
 }
 
 int dc_dev_ata_capable(char *dev_fs_path) {
@@ -266,40 +248,29 @@ int dc_dev_ata_capable(char *dev_fs_path) {
 }
 
 int dc_dev_ata_identify(char *dev_fs_path, uint8_t identify[512]) {
-    int ioctl_ret;
-    int fd = open(dev_fs_path, O_RDWR);
-    if (fd == -1)
-        return -1;
-    AtaCommand ata_command;
-    ScsiCommand scsi_command;
-    uint8_t buf[512];
-    memset(&ata_command, 0, sizeof(ata_command));
-    memset(&scsi_command, 0, sizeof(scsi_command));
-    prepare_ata_command(&ata_command, WIN_IDENTIFY /* ECh */, 0, 0);
-    prepare_scsi_command_from_ata(&scsi_command, &ata_command);
-    scsi_command.io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-    scsi_command.io_hdr.dxferp = identify;
-    scsi_command.io_hdr.dxfer_len = sizeof(buf);
-    scsi_command.scsi_cmd[1] = (4 << 1) + 1;  // PIO_IN protocol + EXTEND bit
-    scsi_command.scsi_cmd[2] = 0x2e;  // CK_COND=1 T_DIR=1 BYTE_BLOCK=1 T_LENGTH=10b
-#if 0
-    int i;
-    for (i = 0; i < sizeof(scsi_command.scsi_cmd); i++)
-        fprintf(stderr, "%02hhx", scsi_command.scsi_cmd[i]);
-    fprintf(stderr, "\n");
-#endif
-    ioctl_ret = ioctl(fd, SG_IO, &scsi_command);
-    close(fd);
-    if (ioctl_ret)
+    DC_AtaSession *session = dc_ata_session_open(dev_fs_path);
+    if (!session)
         return -1;
+    int ret = dc_ata_session_identify(session, identify);
+    dc_ata_session_close(session);
+    return ret;
+}
 
-    // Parse response
-    ScsiAtaReturnDescriptor scsi_ata_ret;
-    fill_scsi_ata_return_descriptor(&scsi_ata_ret, &scsi_command);
-    int sense_key = get_sense_key_from_sense_buffer(scsi_command.sense_buf);
-    if (scsi_ata_ret.status & STATUS_BIT_ERR || sense_key > 0x01)
-        return -1;
-    return 0;
+void dc_ata_identify_sector_sizes(const uint8_t identify[512], int *logical, int *physical) {
+    uint16_t word106 = identify[212] | (identify[213] << 8);
+    *logical = *physical = 512;
+    // Word is valid if bit 14 is set and bit 15 is cleared
+    if ((word106 & 0xc000) != 0x4000)
+        return;
+    if (word106 & (1 << 12)) {
+        // Words 117-118 hold logical sector size in words
+        uint32_t words = identify[234] | (identify[235] << 8) | (identify[236] << 16) | ((uint32_t)identify[237] << 24);
+        if (words >= 256)
+            *logical = words * 2;
+    }
+    *physical = *logical;
+    if (word106 & (1 << 13))
+        *physical = *logical << (word106 & 0xf);
 }
 
 void dc_ata_ascii_to_c_string(uint8_t *ata_ascii_string, unsigned int ata_length_in_words, char *dst) {
@@ -338,3 +309,64 @@ void dc_ata_ascii_to_c_string(uint8_t *ata_ascii_string, unsigned int ata_length
         *dst = '\0';
     }
 }
+
+static int buffer_is_zero_scalar(const uint8_t *p, size_t len) {
+    size_t i = 0;
+    for (; i < len && ((uintptr_t)(p + i) % sizeof(uint64_t)); i++)
+        if (p[i])
+            return 0;
+    uint64_t acc = 0;
+    for (; i + 4 * sizeof(uint64_t) <= len; i += 4 * sizeof(uint64_t)) {
+        const uint64_t *w = (const uint64_t*)(p + i);
+        acc |= w[0] | w[1] | w[2] | w[3];
+        if (acc)
+            return 0;
+    }
+    for (; i < len; i++)
+        if (p[i])
+            return 0;
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int buffer_is_zero_avx2(const uint8_t *p, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i v = _mm256_or_si256(
+                _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + i)),
+                    _mm256_loadu_si256((const __m256i*)(p + i + 32))),
+                _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + i + 64)),
+                    _mm256_loadu_si256((const __m256i*)(p + i + 96))));
+        if (!_mm256_testz_si256(v, v))
+            return 0;
+    }
+    return buffer_is_zero_scalar(p + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static int buffer_is_zero_sse2(const uint8_t *p, size_t len) {
+    size_t i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= len; i += 64) {
+        __m128i v = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)),
+                    _mm_loadu_si128((const __m128i*)(p + i + 16))),
+                _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)),
+                    _mm_loadu_si128((const __m128i*)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+            return 0;
+    }
+    return buffer_is_zero_scalar(p + i, len - i);
+}
+#endif
+
+int dc_buffer_is_zero(const void *buf, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return buffer_is_zero_avx2(buf, len);
+    if (__builtin_cpu_supports("sse2"))
+        return buffer_is_zero_sse2(buf, len);
+#endif
+    return buffer_is_zero_scalar(buf, len);
+}
@@ -20,6 +20,7 @@ char *cmd_output(char *command_line);
  */
 int dc_realtime_scheduling_enable_with_prio(int prio);
 
+// Devices other than ATA (NVMe, SCSI, USB bridges) get SMART shown by smartctl
 char *dc_dev_smartctl_text(char *dev_fs_path, char *options);
 
 char *commaprint(uint64_t n, char *retbuf, size_t bufsize);
@@ -27,18 +28,26 @@ char *commaprint(uint64_t n, char *retbuf, size_t bufsize);
 int procedure_perform_until_interrupt(DC_ProcedureCtx *actctx,
         ProcedureDetachedLoopCB callback, void *callback_priv);
 
-int dc_dev_get_capacity(char *dev_fs_path, uint64_t *capacity);
+int dc_dev_get_capacity(char *dev_fs_path, int sector_size, uint64_t *capacity);
 int dc_dev_get_max_lba(char *dev_fs_path, uint64_t *max_lba);
 
-int dc_dev_get_native_capacity(char *dev_fs_path, uint64_t *capacity);
+int dc_dev_get_native_capacity(char *dev_fs_path, int sector_size, uint64_t *capacity);
 int dc_dev_get_native_max_lba(char *dev_fs_path, uint64_t *max_lba);
 
 // Difference is unit of capacity
-int dc_dev_set_max_capacity(char *dev_fs_path, uint64_t capacity);
+int dc_dev_set_max_capacity(char *dev_fs_path, int sector_size, uint64_t capacity);
 int dc_dev_set_max_lba(char *dev_fs_path, uint64_t lba);
 
 int dc_dev_ata_capable(char *dev_fs_path);
 int dc_dev_ata_identify(char *dev_fs_path, uint8_t identify[512]);
+// Above are one-shot wrappers; for series of commands use DC_AtaSession
+// Max LBA by IDENTIFY words 100-103
+uint64_t dc_ata_identify_max_lba(const uint8_t identify[512]);
+// Sector sizes in bytes, from IDENTIFY words 106 and 117-118; 512 if not reported
+void dc_ata_identify_sector_sizes(const uint8_t identify[512], int *logical, int *physical);
 
 void dc_ata_ascii_to_c_string(uint8_t *ata_ascii_string, unsigned int ata_length_in_words, char *dst);
+
+// Whether all bytes of buffer are zero; uses SIMD if CPU has it
+int dc_buffer_is_zero(const void *buf, size_t len);
 #endif // LIBDEVCHECK_UTILS_H
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "watchdog.h"
+
+// Device may come back under same name after bus reset, e.g. USB bridge re-enumerating
+#define REOPEN_ATTEMPTS 10
+#define REOPEN_DELAY_S 3
+
+static uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void add_event(DC_Watchdog *watchdog, DC_WatchdogEvent *event) {
+    pthread_mutex_lock(&watchdog->lock);
+    // Oldest event gets lost if procedure thread doesn't come for them
+    if (watchdog->nb_pending == DC_WATCHDOG_NB_EVENTS) {
+        for (int i = 1; i < DC_WATCHDOG_NB_EVENTS; i++)
+            watchdog->pending[i - 1] = watchdog->pending[i];
+        watchdog->nb_pending--;
+    }
+    watchdog->pending[watchdog->nb_pending++] = *event;
+    pthread_mutex_unlock(&watchdog->lock);
+}
+
+// Escalates from device to bus reset while command stays stuck; 1 interval of hang_ms for each
+static void check(DC_Watchdog *watchdog) {
+    DC_Io *io = watchdog->io;
+    uint64_t stuck_ms = 0;
+    if (__atomic_load_n(&io->nb_inflight, __ATOMIC_ACQUIRE))
+        stuck_ms = monotonic_ms() - __atomic_load_n(&io->last_progress_ms, __ATOMIC_RELAXED);
+    if (stuck_ms < watchdog->hang_ms) {
+        watchdog->level = 0;
+        return;
+    }
+    if (watchdog->level >= 2 || stuck_ms < watchdog->hang_ms * (watchdog->level + 1))
+        return;
+
+    DC_WatchdogEvent event = {
+        .action = watchdog->level ? DC_WatchdogAction_eBusReset : DC_WatchdogAction_eDeviceReset,
+        .lba = __atomic_load_n(&io->last_lba, __ATOMIC_RELAXED),
+        .stuck_ms = stuck_ms,
+    };
+    watchdog->level++;
+    event.failed = watchdog->reset(watchdog->dev_path,
+            event.action == DC_WatchdogAction_eBusReset ? SG_SCSI_RESET_BUS : SG_SCSI_RESET_DEVICE);
+    if (!event.failed)
+        __atomic_store_n(&watchdog->reset_pending, 1, __ATOMIC_RELEASE);
+    add_event(watchdog, &event);
+}
+
+static void *watchdog_thread(void *arg) {
+    DC_Watchdog *watchdog = arg;
+    // Often enough to act soon after hang_ms, rarely enough to cost nothing
+    uint64_t period_ms = watchdog->hang_ms / 4;
+    if (period_ms > 1000)
+        period_ms = 1000;
+    if (!period_ms)
+        period_ms = 1;
+    pthread_mutex_lock(&watchdog->lock);
+    while (!watchdog->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += period_ms / 1000;
+        deadline.tv_nsec += (period_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        int r = pthread_cond_timedwait(&watchdog->cond, &watchdog->lock, &deadline);
+        if (watchdog->stop || r != ETIMEDOUT)
+            continue;
+        // Reset may take long, procedure thread must not wait for it to take events
+        pthread_mutex_unlock(&watchdog->lock);
+        check(watchdog);
+        pthread_mutex_lock(&watchdog->lock);
+    }
+    pthread_mutex_unlock(&watchdog->lock);
+    return NULL;
+}
+
+DC_Watchdog *dc_watchdog_start(DC_Io *io, uint64_t hang_ms) {
+    DC_Watchdog *watchdog = calloc(1, sizeof(*watchdog));
+    if (!watchdog)
+        return NULL;
+    watchdog->io = io;
+    watchdog->dev_path = io->dev->dev_path;
+    watchdog->hang_ms = hang_ms;
+    watchdog->reset = scsi_reset;
+    pthread_mutex_init(&watchdog->lock, NULL);
+    pthread_cond_init(&watchdog->cond, NULL);
+    if (pthread_create(&watchdog->thread, NULL, watchdog_thread, watchdog)) {
+        pthread_cond_destroy(&watchdog->cond);
+        pthread_mutex_destroy(&watchdog->lock);
+        free(watchdog);
+        return NULL;
+    }
+    return watchdog;
+}
+
+void dc_watchdog_stop(DC_Watchdog *watchdog) {
+    pthread_mutex_lock(&watchdog->lock);
+    watchdog->stop = 1;
+    pthread_cond_signal(&watchdog->cond);
+    pthread_mutex_unlock(&watchdog->lock);
+    pthread_join(watchdog->thread, NULL);
+    pthread_cond_destroy(&watchdog->cond);
+    pthread_mutex_destroy(&watchdog->lock);
+    free(watchdog);
+}
+
+int dc_watchdog_reset_pending(DC_Watchdog *watchdog) {
+    return __atomic_load_n(&watchdog->reset_pending, __ATOMIC_ACQUIRE);
+}
+
+int dc_watchdog_reopen(DC_Watchdog *watchdog, uint64_t lba) {
+    DC_WatchdogEvent event = {
+        .action = DC_WatchdogAction_eReopen,
+        .lba = lba,
+    };
+    int r = dc_io_reopen(watchdog->io);
+    for (int i = 1; r && i < REOPEN_ATTEMPTS; i++) {
+        sleep(REOPEN_DELAY_S);
+        r = dc_io_reopen(watchdog->io);
+    }
+    __atomic_store_n(&watchdog->reset_pending, 0, __ATOMIC_RELEASE);
+    event.failed = r;
+    add_event(watchdog, &event);
+    return r;
+}
+
+int dc_watchdog_poll(DC_Watchdog *watchdog, DC_WatchdogEvent **events) {
+    pthread_mutex_lock(&watchdog->lock);
+    int nb_events = watchdog->nb_pending;
+    for (int i = 0; i < nb_events; i++)
+        watchdog->events[i] = watchdog->pending[i];
+    watchdog->nb_pending = 0;
+    pthread_mutex_unlock(&watchdog->lock);
+    *events = watchdog->events;
+    return nb_events;
+}
+
+const char *dc_watchdog_action_name(DC_WatchdogAction action) {
+    switch (action) {
+        case DC_WatchdogAction_eDeviceReset: return "device reset";
+        case DC_WatchdogAction_eBusReset: return "bus reset";
+        case DC_WatchdogAction_eReopen: return "reopen";
+        default: return "unknown action";
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "io_backend.h"
+
+// Events kept until procedure thread takes them
+#define DC_WATCHDOG_NB_EVENTS 8
+
+typedef enum {
+    DC_WatchdogAction_eDeviceReset,
+    DC_WatchdogAction_eBusReset,
+    DC_WatchdogAction_eReopen,
+} DC_WatchdogAction;
+
+struct dc_watchdog_event {
+    DC_WatchdogAction action;
+    int failed;  // Action itself has failed
+    uint64_t lba;  // Of stuck command, or where procedure resumes after reopen
+    uint64_t stuck_ms;  // For resets, how long command was in flight without progress
+};
+
+/*
+ * Thread watching requests in flight on procedure's I/O. If none completes for too long,
+ * it resets device, then bus, to make kernel give stuck command back.
+ * Procedure thread notices reset and reopens device before going on.
+ */
+typedef struct dc_watchdog {
+    DC_Io *io;
+    const char *dev_path;
+    uint64_t hang_ms;
+    // scsi_reset() unless replaced, e.g. by stub in tests
+    int (*reset)(const char *dev_path, int what);
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+    int level;  // Resets done for current hang
+    int reset_pending;  // Device was reset, I/O is to be reopened
+
+    // Under lock, taken by dc_watchdog_poll()
+    DC_WatchdogEvent pending[DC_WATCHDOG_NB_EVENTS];
+    int nb_pending;
+    DC_WatchdogEvent events[DC_WATCHDOG_NB_EVENTS];
+} DC_Watchdog;
+
+// NULL on failure
+DC_Watchdog *dc_watchdog_start(DC_Io *io, uint64_t hang_ms);
+void dc_watchdog_stop(DC_Watchdog *watchdog);
+
+// Whether device was reset and I/O hasn't been reopened since
+int dc_watchdog_reset_pending(DC_Watchdog *watchdog);
+/**
+ * Reopen I/O after reset, once nothing is in flight; records event
+ * @param lba: where procedure resumes
+ * @return 0 on success
+ */
+int dc_watchdog_reopen(DC_Watchdog *watchdog, uint64_t lba);
+
+// "device reset", "bus reset", "reopen"
+const char *dc_watchdog_action_name(DC_WatchdogAction action);
+
+/**
+ * Take events which happened since previous call
+ * @return number of events, pointed by *events until next call
+ */
+int dc_watchdog_poll(DC_Watchdog *watchdog, DC_WatchdogEvent **events);
+
+#endif  // WATCHDOG_H
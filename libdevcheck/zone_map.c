@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "zone_map.h"
+
+static int height(Zone *zone) {
+    return zone ? zone->height : 0;
+}
+
+static int64_t zone_length(Zone *zone) {
+    return zone->end_lba - zone->begin_lba;
+}
+
+// Recompute aggregates of node from its children
+static void pull(Zone *zone) {
+    Zone *l = zone->left;
+    Zone *r = zone->right;
+    zone->height = 1 + (height(l) > height(r) ? height(l) : height(r));
+    zone->subtree_max_length = zone_length(zone);
+    if (l && l->subtree_max_length > zone->subtree_max_length)
+        zone->subtree_max_length = l->subtree_max_length;
+    if (r && r->subtree_max_length > zone->subtree_max_length)
+        zone->subtree_max_length = r->subtree_max_length;
+    zone->subtree_has_clean_begin = !zone->begin_lba_defective
+        || (l && l->subtree_has_clean_begin) || (r && r->subtree_has_clean_begin);
+    zone->subtree_has_clean_end = !zone->end_lba_defective
+        || (l && l->subtree_has_clean_end) || (r && r->subtree_has_clean_end);
+}
+
+static void replace_child(ZoneMap *map, Zone *parent, Zone *old_child, Zone *new_child) {
+    if (!parent)
+        map->root = new_child;
+    else if (parent->left == old_child)
+        parent->left = new_child;
+    else
+        parent->right = new_child;
+}
+
+static Zone *rotate_left(ZoneMap *map, Zone *x) {
+    Zone *y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    replace_child(map, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+    pull(x);
+    pull(y);
+    return y;
+}
+
+static Zone *rotate_right(ZoneMap *map, Zone *x) {
+    Zone *y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    replace_child(map, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+    pull(x);
+    pull(y);
+    return y;
+}
+
+static void rebalance_upward(ZoneMap *map, Zone *zone) {
+    while (zone) {
+        pull(zone);
+        int balance = height(zone->left) - height(zone->right);
+        if (balance > 1) {
+            if (height(zone->left->left) < height(zone->left->right))
+                rotate_left(map, zone->left);
+            zone = rotate_right(map, zone);
+        } else if (balance < -1) {
+            if (height(zone->right->right) < height(zone->right->left))
+                rotate_right(map, zone->right);
+            zone = rotate_left(map, zone);
+        }
+        zone = zone->parent;
+    }
+}
+
+void zone_map_insert(ZoneMap *map, Zone *zone) {
+    Zone *parent = NULL;
+    Zone **link = &map->root;
+    while (*link) {
+        parent = *link;
+        assert(zone->begin_lba != parent->begin_lba);
+        link = (zone->begin_lba < parent->begin_lba) ? &parent->left : &parent->right;
+    }
+    zone->left = zone->right = NULL;
+    zone->parent = parent;
+    *link = zone;
+    map->nb_zones++;
+    rebalance_upward(map, zone);
+}
+
+void zone_map_remove(ZoneMap *map, Zone *zone) {
+    Zone *rebalance_start;
+    if (zone->left && zone->right) {
+        // Put in-order successor to place of removed zone
+        Zone *successor = zone->right;
+        while (successor->left)
+            successor = successor->left;
+        if (successor->parent == zone) {
+            rebalance_start = successor;
+        } else {
+            rebalance_start = successor->parent;
+            replace_child(map, successor->parent, successor, successor->right);
+            if (successor->right)
+                successor->right->parent = successor->parent;
+            successor->right = zone->right;
+            successor->right->parent = successor;
+        }
+        replace_child(map, zone->parent, zone, successor);
+        successor->parent = zone->parent;
+        successor->left = zone->left;
+        successor->left->parent = successor;
+    } else {
+        Zone *child = zone->left ? zone->left : zone->right;
+        replace_child(map, zone->parent, zone, child);
+        if (child)
+            child->parent = zone->parent;
+        rebalance_start = zone->parent;
+    }
+    map->nb_zones--;
+    rebalance_upward(map, rebalance_start);
+}
+
+void zone_map_update(ZoneMap *map, Zone *zone) {
+    (void)map;
+    for (; zone; zone = zone->parent)
+        pull(zone);
+}
+
+static void free_subtree(Zone *zone) {
+    if (!zone)
+        return;
+    free_subtree(zone->left);
+    free_subtree(zone->right);
+    free(zone);
+}
+
+void zone_map_clear(ZoneMap *map) {
+    free_subtree(map->root);
+    map->root = NULL;
+    map->nb_zones = 0;
+}
+
+Zone *zone_map_first(ZoneMap *map) {
+    Zone *zone = map->root;
+    while (zone && zone->left)
+        zone = zone->left;
+    return zone;
+}
+
+Zone *zone_map_next(Zone *zone) {
+    if (zone->right) {
+        zone = zone->right;
+        while (zone->left)
+            zone = zone->left;
+        return zone;
+    }
+    while (zone->parent && zone->parent->right == zone)
+        zone = zone->parent;
+    return zone->parent;
+}
+
+Zone *zone_map_largest(ZoneMap *map) {
+    Zone *zone = map->root;
+    if (!zone)
+        return NULL;
+    int64_t max_length = zone->subtree_max_length;
+    while (1) {
+        if (zone->left && zone->left->subtree_max_length == max_length)
+            zone = zone->left;
+        else if (zone_length(zone) == max_length)
+            return zone;
+        else
+            zone = zone->right;
+    }
+}
+
+static int zone_matches(Zone *zone, ZoneQuery *query) {
+    return (query->clean_begin && !zone->begin_lba_defective)
+        || (query->clean_end && !zone->end_lba_defective)
+        || (query->longer_than > 0 && zone_length(zone) > query->longer_than);
+}
+
+static int subtree_matches(Zone *zone, ZoneQuery *query) {
+    return (query->clean_begin && zone->subtree_has_clean_begin)
+        || (query->clean_end && zone->subtree_has_clean_end)
+        || (query->longer_than > 0 && zone->subtree_max_length > query->longer_than);
+}
+
+static Zone *find_first(Zone *zone, ZoneQuery *query) {
+    if (!zone || !subtree_matches(zone, query))
+        return NULL;
+    Zone *found = find_first(zone->left, query);
+    if (found)
+        return found;
+    if (zone_matches(zone, query))
+        return zone;
+    return find_first(zone->right, query);
+}
+
+Zone *zone_map_find_first(ZoneMap *map, ZoneQuery *query) {
+    return find_first(map->root, query);
+}
@@ -0,0 +1,54 @@
+#ifndef ZONE_MAP_H
+#define ZONE_MAP_H
+
+#include <inttypes.h>
+
+typedef struct zone {
+    // begin_lba < end_lba
+    int64_t begin_lba;
+    int64_t end_lba;  // LBA of the first sector beyond zone
+    int begin_lba_defective;  // Whether reading near begin_lba failed
+    int end_lba_defective;  // Whether reading near end_lba failed
+
+    // Tree linkage and subtree aggregates, maintained by zone_map_*()
+    struct zone *left;
+    struct zone *right;
+    struct zone *parent;
+    int height;
+    int64_t subtree_max_length;
+    int subtree_has_clean_begin;
+    int subtree_has_clean_end;
+} Zone;
+
+/*
+ * Set of non-overlapping zones, as AVL tree ordered by LBA.
+ * Subtrees keep maximal zone length and presence of non-defective zone borders,
+ * so that searches by length or by border state take O(log n).
+ */
+typedef struct zone_map {
+    Zone *root;
+    int nb_zones;
+} ZoneMap;
+
+typedef struct zone_query {
+    int clean_begin;  // Match zones with non-defective begin
+    int clean_end;  // Match zones with non-defective end
+    int64_t longer_than;  // Match zones longer than this, if positive
+} ZoneQuery;
+
+void zone_map_insert(ZoneMap *map, Zone *zone);
+// Zone is not freed
+void zone_map_remove(ZoneMap *map, Zone *zone);
+// Must be called after changing bounds or border state of zone; zone must not overlap others
+void zone_map_update(ZoneMap *map, Zone *zone);
+// Free all zones
+void zone_map_clear(ZoneMap *map);
+
+Zone *zone_map_first(ZoneMap *map);
+Zone *zone_map_next(Zone *zone);
+// Largest zone; first one by LBA if several are of same size
+Zone *zone_map_largest(ZoneMap *map);
+// First zone by LBA matching any condition of query
+Zone *zone_map_find_first(ZoneMap *map, ZoneQuery *query);
+
+#endif  // ZONE_MAP_H
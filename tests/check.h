@@ -0,0 +1,62 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+/*
+ * Helpers of stub-driven checks: devices are stood in for by responders
+ * put in place of DC_AtaSession.sg_io, answering as SAT layer of kernel would.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "scsi.h"
+
+static int check_failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        check_failures++; \
+    } \
+} while (0)
+
+// Descriptor sense with ATA Status Return descriptor, as returned for failed command or one with CK_COND
+static inline void check_sat_return(ScsiCommand *cmd, uint8_t status, uint8_t error, uint16_t count, uint64_t lba) {
+    uint8_t *sense = cmd->sense_buf;
+    uint8_t *descr = &sense[8];
+    memset(sense, 0, sizeof(cmd->sense_buf));
+    sense[0] = 0x72;
+    sense[1] = (status & STATUS_BIT_ERR) ? 0x0b /* ABORTED COMMAND */ : 0x00 /* NO SENSE */;
+    sense[2] = 0x00;  // ASC/ASCQ 00h/1Dh: ATA PASS THROUGH INFORMATION AVAILABLE
+    sense[3] = 0x1d;
+    sense[7] = 14;
+    descr[0] = 0x09;
+    descr[1] = 12;
+    descr[2] = 1;  // EXTEND
+    descr[3] = error;
+    descr[4] = count >> 8;
+    descr[5] = count;
+    descr[6] = lba >> 24;
+    descr[7] = lba;
+    descr[8] = lba >> 32;
+    descr[9] = lba >> 8;
+    descr[10] = lba >> 40;
+    descr[11] = lba >> 16;
+    descr[13] = status;
+    cmd->io_hdr.status = 0x02;  // CHECK CONDITION
+    cmd->io_hdr.driver_status = 0x08;  // DRIVER_SENSE
+}
+
+// Command failed by device with ABRT
+static inline void check_sat_abort(ScsiCommand *cmd) {
+    check_sat_return(cmd, STATUS_BIT_DRDY | STATUS_BIT_ERR, ERROR_BIT_ABRT, 0, 0);
+}
+
+static inline int check_summary(const char *name) {
+    if (check_failures)
+        fprintf(stderr, "%s: %d checks failed\n", name, check_failures);
+    else
+        printf("%s: OK\n", name);
+    return check_failures ? 1 : 0;
+}
+
+#endif  // CHECK_H
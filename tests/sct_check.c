@@ -0,0 +1,209 @@
+/*
+ * Checks of SCT Error Recovery Control commands and of timers limit kept for procedure,
+ * against stub responder in place of device.
+ */
+#include <assert.h>
+#include <stdlib.h>
+
+#include "sct.h"
+#include "check.h"
+
+#define MAX_KEYS 16
+
+// Device state, and log of key sectors it got
+static struct {
+    int erc_supported;
+    uint16_t read_timer;
+    uint16_t write_timer;
+    int reset_get;  // GET comes back killed by reset: SCSI status 0, host status DID_RESET
+    int abort_set_write;  // Device refuses to set write timer
+    int nb_keys;
+    uint8_t keys[MAX_KEYS][512];
+    int bad_cdbs;
+} stub;
+
+static uint16_t key_word(const uint8_t *key, int i) {
+    return key[i * 2] | (key[i * 2 + 1] << 8);
+}
+
+static int answer_identify(ScsiCommand *cmd) {
+    uint8_t *cdb = cmd->scsi_cmd;
+    if (cdb[1] != (4 << 1) + 1 || cmd->io_hdr.dxfer_direction != SG_DXFER_FROM_DEV
+            || cmd->io_hdr.dxfer_len != 512) {
+        stub.bad_cdbs++;
+        check_sat_abort(cmd);
+        return 0;
+    }
+    uint8_t *identify = cmd->io_hdr.dxferp;
+    memset(identify, 0, 512);
+    // Word 206: SCT Command Transport, and ERC if supported
+    identify[206 * 2] = stub.erc_supported ? 0x09 : 0x01;
+    check_sat_return(cmd, STATUS_BIT_DRDY, 0, 0, 0);
+    return 0;
+}
+
+static int stub_sg_io(int fd, ScsiCommand *cmd) {
+    (void)fd;
+    uint8_t *cdb = cmd->scsi_cmd;
+    memset(cmd->sense_buf, 0, sizeof(cmd->sense_buf));
+    cmd->io_hdr.status = 0;
+    cmd->io_hdr.host_status = 0;
+    cmd->io_hdr.driver_status = 0;
+    cmd->io_hdr.resid = 0;
+    if (cdb[0] == 0x85 && cdb[14] == WIN_IDENTIFY)
+        return answer_identify(cmd);
+
+    // SMART WRITE LOG of single sector to SCT Command/Status log, as 28-bit PIO-out command
+    if (cdb[0] != 0x85 || cdb[1] != (5 << 1) || cdb[2] != 0x26 || cdb[14] != WIN_SMART
+            || cdb[4] != SMART_WRITE_LOG_SECTOR || cdb[6] != 1 || cdb[8] != 0xe0
+            || cdb[10] != SMART_LCYL_PASS || cdb[12] != SMART_HCYL_PASS
+            || cmd->io_hdr.dxfer_direction != SG_DXFER_TO_DEV || cmd->io_hdr.dxfer_len != 512) {
+        stub.bad_cdbs++;
+        check_sat_abort(cmd);
+        return 0;
+    }
+    uint8_t *key = cmd->io_hdr.dxferp;
+    if (stub.nb_keys < MAX_KEYS)
+        memcpy(stub.keys[stub.nb_keys++], key, 512);
+    uint16_t action = key_word(key, 0);
+    uint16_t function = key_word(key, 1);
+    uint16_t selection = key_word(key, 2);
+    uint16_t value = key_word(key, 3);
+    uint16_t *timer = selection == 1 ? &stub.read_timer : selection == 2 ? &stub.write_timer : NULL;
+    if (action != 3 || !timer) {
+        check_sat_abort(cmd);
+        return 0;
+    }
+    if (function == 1) {
+        if (selection == 2 && stub.abort_set_write) {
+            check_sat_abort(cmd);
+            return 0;
+        }
+        *timer = value;
+        check_sat_return(cmd, STATUS_BIT_DRDY, 0, 0, 0);
+        return 0;
+    }
+    if (function == 2) {
+        if (stub.reset_get) {
+            cmd->io_hdr.host_status = 0x08;  // DID_RESET
+            return 0;
+        }
+        // Timer in Count and LBA (7:0), garbage above them
+        check_sat_return(cmd, STATUS_BIT_DRDY, 0, 0xa500 | (*timer & 0xff), 0x5a5a5a00 | (*timer >> 8));
+        return 0;
+    }
+    check_sat_abort(cmd);
+    return 0;
+}
+
+static void reset_stub(void) {
+    memset(&stub, 0, sizeof(stub));
+    stub.erc_supported = 1;
+    stub.read_timer = 70;
+    stub.write_timer = 0x0123;
+}
+
+static DC_AtaSession *stub_session(void) {
+    DC_AtaSession *session = dc_ata_session_open_fd(-1);
+    assert(session);
+    session->sg_io = stub_sg_io;
+    return session;
+}
+
+static int key_is(int n, uint16_t function, uint16_t selection, uint16_t value) {
+    const uint8_t *key = stub.keys[n];
+    if (key_word(key, 0) != 3 || key_word(key, 1) != function || key_word(key, 2) != selection
+            || key_word(key, 3) != value)
+        return 0;
+    for (int i = 8; i < 512; i++)
+        if (key[i])
+            return 0;
+    return 1;
+}
+
+static void check_commands(void) {
+    uint8_t identify[512];
+    memset(identify, 0, sizeof(identify));
+    identify[206 * 2] = 0x09;
+    CHECK(dc_sct_erc_supported(identify));
+    identify[206 * 2] = 0x01;
+    CHECK(!dc_sct_erc_supported(identify));
+
+    DC_AtaSession *session = stub_session();
+    DC_SctErc erc;
+
+    reset_stub();
+    CHECK(dc_sct_erc_get(session, &erc) == 0);
+    CHECK(erc.read_timer == 70 && erc.write_timer == 0x0123);
+    CHECK(stub.nb_keys == 2 && key_is(0, 2, 1, 0) && key_is(1, 2, 2, 0));
+
+    reset_stub();
+    erc.read_timer = 5;
+    erc.write_timer = 0x0207;
+    CHECK(dc_sct_erc_set(session, &erc) == 0);
+    CHECK(stub.read_timer == 5 && stub.write_timer == 0x0207);
+    CHECK(stub.nb_keys == 2 && key_is(0, 1, 1, 5) && key_is(1, 1, 2, 0x0207));
+    CHECK(stub.bad_cdbs == 0);
+
+    reset_stub();
+    stub.reset_get = 1;
+    CHECK(dc_sct_erc_get(session, &erc) != 0);
+
+    dc_ata_session_close(session);
+}
+
+static void check_limit(void) {
+    DC_SctErcLimit *limit;
+
+    reset_stub();
+    limit = dc_sct_erc_limit_open_session(stub_session(), 500);
+    CHECK(limit);
+    if (limit) {
+        CHECK(limit->saved.read_timer == 70 && limit->saved.write_timer == 0x0123);
+        CHECK(stub.read_timer == 5 && stub.write_timer == 5);
+        dc_sct_erc_limit_close(limit);
+        CHECK(stub.read_timer == 70 && stub.write_timer == 0x0123);
+    }
+    CHECK(stub.bad_cdbs == 0);
+
+    // Rounded up, and never 0 which would lift limit
+    reset_stub();
+    limit = dc_sct_erc_limit_open_session(stub_session(), 1);
+    CHECK(limit && stub.read_timer == 1);
+    if (limit)
+        dc_sct_erc_limit_close(limit);
+    reset_stub();
+    limit = dc_sct_erc_limit_open_session(stub_session(), 0);
+    CHECK(limit && stub.read_timer == 1);
+    if (limit)
+        dc_sct_erc_limit_close(limit);
+    reset_stub();
+    limit = dc_sct_erc_limit_open_session(stub_session(), 100000000);
+    CHECK(limit && stub.read_timer == 0xffff);
+    if (limit)
+        dc_sct_erc_limit_close(limit);
+
+    // No SCT ERC: nothing is sent
+    reset_stub();
+    stub.erc_supported = 0;
+    CHECK(!dc_sct_erc_limit_open_session(stub_session(), 500));
+    CHECK(stub.nb_keys == 0);
+
+    // Saved timers unknown: nothing is set
+    reset_stub();
+    stub.reset_get = 1;
+    CHECK(!dc_sct_erc_limit_open_session(stub_session(), 500));
+    CHECK(stub.read_timer == 70 && stub.write_timer == 0x0123);
+
+    // Write timer refused: read timer is put back
+    reset_stub();
+    stub.abort_set_write = 1;
+    CHECK(!dc_sct_erc_limit_open_session(stub_session(), 500));
+    CHECK(stub.read_timer == 70 && stub.write_timer == 0x0123);
+}
+
+int main(void) {
+    check_commands();
+    check_limit();
+    return check_summary("sct_check");
+}
@@ -0,0 +1,181 @@
+/*
+ * Checks of SMART reading and parsing, against stub responder in place of device.
+ */
+#include <stdlib.h>
+
+#include "smart.h"
+#include "check.h"
+
+// Sum of all bytes including last one is zero
+static void set_checksum(uint8_t buf[512]) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 511; i++)
+        sum += buf[i];
+    buf[511] = -sum;
+}
+
+static void put_attr(uint8_t data[512], int slot, uint8_t id, uint16_t flags, uint8_t value, uint8_t worst, uint64_t raw) {
+    uint8_t *entry = data + 2 + slot * 12;
+    entry[0] = id;
+    entry[1] = flags;
+    entry[2] = flags >> 8;
+    entry[3] = value;
+    entry[4] = worst;
+    for (int i = 0; i < 6; i++)
+        entry[5 + i] = raw >> (i * 8);
+}
+
+static void put_threshold(uint8_t thresholds[512], int slot, uint8_t id, uint8_t threshold) {
+    thresholds[2 + slot * 12] = id;
+    thresholds[2 + slot * 12 + 1] = threshold;
+}
+
+// Attribute and threshold tables of canned device; slots of same attribute differ on purpose
+static uint8_t canned_data[512];
+static uint8_t canned_thresholds[512];
+
+static void make_canned_sectors(void) {
+    memset(canned_data, 0, 512);
+    memset(canned_thresholds, 0, 512);
+    canned_data[0] = 0x10;  // Revision
+    put_attr(canned_data, 0, 5, 0x0033, 100, 99, 0x000001020304ULL);
+    put_attr(canned_data, 2, 197, 0x0012, 1, 1, 0x112233445566ULL);
+    put_attr(canned_data, 3, 9, 0x0032, 90, 90, 12345);
+    set_checksum(canned_data);
+    put_threshold(canned_thresholds, 0, 197, 5);
+    put_threshold(canned_thresholds, 1, 5, 36);
+    set_checksum(canned_thresholds);
+}
+
+static struct {
+    int corrupt_data;  // Flip a byte of data after checksum
+    int fail_thresholds;  // Device aborts READ THRESHOLDS
+    int reset_data;  // READ DATA comes back killed by reset: SCSI status 0, host status DID_RESET
+    int nb_cmds;
+    int bad_cdbs;
+} stub;
+
+static int stub_sg_io(int fd, ScsiCommand *cmd) {
+    (void)fd;
+    uint8_t *cdb = cmd->scsi_cmd;
+    stub.nb_cmds++;
+    memset(cmd->sense_buf, 0, sizeof(cmd->sense_buf));
+    cmd->io_hdr.status = 0;
+    cmd->io_hdr.host_status = 0;
+    cmd->io_hdr.driver_status = 0;
+    cmd->io_hdr.resid = 0;
+    // SMART: 28-bit command B0h, subcommand in features, signature in cylinder registers
+    if (cdb[0] != 0x85 || cdb[14] != WIN_SMART || cdb[10] != SMART_LCYL_PASS || cdb[12] != SMART_HCYL_PASS
+            || (cdb[1] & 1)) {
+        stub.bad_cdbs++;
+        check_sat_abort(cmd);
+        return 0;
+    }
+    int pio_in = cdb[1] == (4 << 1) && cmd->io_hdr.dxfer_direction == SG_DXFER_FROM_DEV
+        && cmd->io_hdr.dxfer_len == 512 && cdb[6] == 1;
+    switch (cdb[4]) {
+        case SMART_ENABLE:
+            return 0;
+        case SMART_READ_VALUES:
+            if (!pio_in)
+                break;
+            if (stub.reset_data) {
+                cmd->io_hdr.host_status = 0x08;  // DID_RESET
+                return 0;
+            }
+            memcpy(cmd->io_hdr.dxferp, canned_data, 512);
+            if (stub.corrupt_data)
+                ((uint8_t*)cmd->io_hdr.dxferp)[100] ^= 1;
+            return 0;
+        case SMART_READ_THRESHOLDS:
+            if (!pio_in)
+                break;
+            if (stub.fail_thresholds) {
+                check_sat_abort(cmd);
+                return 0;
+            }
+            memcpy(cmd->io_hdr.dxferp, canned_thresholds, 512);
+            return 0;
+    }
+    stub.bad_cdbs++;
+    check_sat_abort(cmd);
+    return 0;
+}
+
+static void check_parse(void) {
+    DC_Smart smart;
+    CHECK(dc_smart_parse(canned_data, canned_thresholds, &smart) == 0);
+    CHECK(smart.nb_attrs == 3);
+    DC_SmartAttr *reallocated = dc_smart_find_attr(&smart, 5);
+    DC_SmartAttr *pending = dc_smart_find_attr(&smart, 197);
+    DC_SmartAttr *hours = dc_smart_find_attr(&smart, 9);
+    CHECK(reallocated && pending && hours);
+    CHECK(!dc_smart_find_attr(&smart, 1));
+    if (!reallocated || !pending || !hours)
+        return;
+    CHECK(reallocated->flags == 0x0033 && reallocated->value == 100 && reallocated->worst == 99);
+    CHECK(reallocated->raw == 0x000001020304ULL);
+    CHECK(pending->raw == 0x112233445566ULL);
+    // Thresholds are matched by id, not by slot
+    CHECK(reallocated->threshold == 36);
+    CHECK(pending->threshold == 5);
+    CHECK(hours->threshold == 0);
+    CHECK(!dc_smart_attr_failing(reallocated));
+    CHECK(dc_smart_attr_failing(pending));
+    CHECK(!dc_smart_attr_failing(hours));
+
+    // Without thresholds, nothing is failing
+    CHECK(dc_smart_parse(canned_data, NULL, &smart) == 0);
+    CHECK(smart.nb_attrs == 3 && !dc_smart_attr_failing(dc_smart_find_attr(&smart, 197)));
+
+    // Mismatch is reported, table is filled anyway
+    uint8_t corrupted[512];
+    memcpy(corrupted, canned_data, 512);
+    corrupted[100] ^= 1;
+    CHECK(dc_smart_parse(corrupted, NULL, &smart) == 1);
+    CHECK(smart.nb_attrs == 3);
+    CHECK(dc_smart_parse(canned_data, corrupted, &smart) == 1);
+}
+
+static void check_read(void) {
+    DC_AtaSession *session = dc_ata_session_open_fd(-1);
+    CHECK(session);
+    if (!session)
+        return;
+    session->sg_io = stub_sg_io;
+    uint8_t data[512];
+    DC_Smart smart;
+
+    memset(&stub, 0, sizeof(stub));
+    CHECK(dc_smart_enable(session) == 0);
+    CHECK(dc_smart_read_data(session, data) == 0);
+    CHECK(!memcmp(data, canned_data, 512));
+    CHECK(dc_smart_read(session, &smart) == 0);
+    CHECK(smart.nb_attrs == 3 && dc_smart_find_attr(&smart, 5)->threshold == 36);
+    CHECK(stub.nb_cmds == 4 && stub.bad_cdbs == 0);
+
+    memset(&stub, 0, sizeof(stub));
+    stub.corrupt_data = 1;
+    CHECK(dc_smart_read(session, &smart) == 1);
+
+    // Attributes are still shown when thresholds can't be read
+    memset(&stub, 0, sizeof(stub));
+    stub.fail_thresholds = 1;
+    CHECK(dc_smart_read(session, &smart) == 0);
+    CHECK(smart.nb_attrs == 3 && dc_smart_find_attr(&smart, 197)->threshold == 0);
+
+    // Aborted command is no data, though SCSI status is good
+    memset(&stub, 0, sizeof(stub));
+    stub.reset_data = 1;
+    CHECK(dc_smart_read_data(session, data) == -1);
+    CHECK(dc_smart_read(session, &smart) == -1);
+
+    dc_ata_session_close(session);
+}
+
+int main(void) {
+    make_canned_sectors();
+    check_parse();
+    check_read();
+    return check_summary("smart_check");
+}
@@ -0,0 +1,175 @@
+/*
+ * Checks of watchdog escalation on stuck I/O, with stub in place of scsi_reset()
+ * and stub backend to reopen.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "watchdog.h"
+#include "check.h"
+
+#define HANG_MS 40
+// Generous, for loaded machine; waits end as soon as expected happens
+#define WAIT_MS 2000
+
+#define MAX_RESETS 8
+
+static struct {
+    int fail_reset;
+    int nb_resets;
+    int resets[MAX_RESETS];
+    const char *dev_path;
+    int nb_opens;
+    int nb_closes;
+} stub;
+
+static int stub_reset(const char *dev_path, int what) {
+    int n = __atomic_load_n(&stub.nb_resets, __ATOMIC_RELAXED);
+    if (n < MAX_RESETS)
+        stub.resets[n] = what;
+    stub.dev_path = dev_path;
+    __atomic_store_n(&stub.nb_resets, n + 1, __ATOMIC_RELEASE);
+    return __atomic_load_n(&stub.fail_reset, __ATOMIC_RELAXED);
+}
+
+static int stub_open(DC_Io *io) {
+    (void)io;
+    stub.nb_opens++;
+    return 0;
+}
+
+static void stub_close(DC_Io *io) {
+    (void)io;
+    stub.nb_closes++;
+}
+
+static const DC_IoBackend stub_backend = {
+    .name = "stub",
+    .priv_data_size = sizeof(int),
+    .open = stub_open,
+    .close = stub_close,
+};
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void sleep_ms(uint64_t ms) {
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+// Until given number of resets is done, or WAIT_MS
+static void wait_resets(int nb_resets) {
+    uint64_t deadline = now_ms() + WAIT_MS;
+    while (__atomic_load_n(&stub.nb_resets, __ATOMIC_ACQUIRE) < nb_resets && now_ms() < deadline)
+        sleep_ms(1);
+}
+
+static DC_Dev dev = { .dev_path = "/dev/stub" };
+
+static DC_Io *stub_io(void) {
+    DC_Io *io = calloc(1, sizeof(*io));
+    assert(io);
+    io->backend = &stub_backend;
+    io->priv = calloc(1, stub_backend.priv_data_size);
+    assert(io->priv);
+    io->dev = &dev;
+    io->fd = -1;
+    io->queue_depth = 1;
+    return io;
+}
+
+static void free_stub_io(DC_Io *io) {
+    free(io->priv);
+    free(io);
+}
+
+// Request is submitted and nothing completes since
+static void hang(DC_Io *io, uint64_t lba) {
+    __atomic_store_n(&io->last_lba, lba, __ATOMIC_RELAXED);
+    __atomic_store_n(&io->last_progress_ms, now_ms(), __ATOMIC_RELAXED);
+    __atomic_store_n(&io->nb_inflight, 1, __ATOMIC_RELEASE);
+}
+
+static DC_Watchdog *start(DC_Io *io) {
+    memset(&stub, 0, sizeof(stub));
+    DC_Watchdog *watchdog = dc_watchdog_start(io, HANG_MS);
+    assert(watchdog);
+    // Before anything is in flight, so watchdog thread can't call real one
+    watchdog->reset = stub_reset;
+    return watchdog;
+}
+
+static void check_escalation(void) {
+    DC_Io *io = stub_io();
+    DC_Watchdog *watchdog = start(io);
+    DC_WatchdogEvent *events;
+
+    // Idle device is not stuck
+    sleep_ms(HANG_MS * 4);
+    CHECK(__atomic_load_n(&stub.nb_resets, __ATOMIC_ACQUIRE) == 0);
+    CHECK(dc_watchdog_poll(watchdog, &events) == 0);
+    CHECK(!dc_watchdog_reset_pending(watchdog));
+
+    // Device reset, then bus reset, then nothing more for same hang
+    hang(io, 12345);
+    wait_resets(2);
+    sleep_ms(HANG_MS * 4);
+    CHECK(__atomic_load_n(&stub.nb_resets, __ATOMIC_ACQUIRE) == 2);
+    CHECK(stub.resets[0] == SG_SCSI_RESET_DEVICE && stub.resets[1] == SG_SCSI_RESET_BUS);
+    CHECK(stub.dev_path && !strcmp(stub.dev_path, "/dev/stub"));
+    CHECK(dc_watchdog_reset_pending(watchdog));
+    CHECK(dc_watchdog_poll(watchdog, &events) == 2);
+    CHECK(events[0].action == DC_WatchdogAction_eDeviceReset && !events[0].failed);
+    CHECK(events[0].lba == 12345 && events[0].stuck_ms >= HANG_MS);
+    CHECK(events[1].action == DC_WatchdogAction_eBusReset && !events[1].failed);
+    CHECK(events[1].stuck_ms >= HANG_MS * 2);
+    CHECK(dc_watchdog_poll(watchdog, &events) == 0);
+
+    // Killed command comes back, procedure thread reopens
+    __atomic_store_n(&io->nb_inflight, 0, __ATOMIC_RELEASE);
+    CHECK(dc_watchdog_reopen(watchdog, 12345) == 0);
+    CHECK(stub.nb_closes == 1 && stub.nb_opens == 1);
+    CHECK(!dc_watchdog_reset_pending(watchdog));
+    CHECK(dc_watchdog_poll(watchdog, &events) == 1);
+    CHECK(events[0].action == DC_WatchdogAction_eReopen && !events[0].failed && events[0].lba == 12345);
+
+    // Next hang starts from device reset again
+    hang(io, 777);
+    wait_resets(3);
+    CHECK(__atomic_load_n(&stub.nb_resets, __ATOMIC_ACQUIRE) >= 3);
+    CHECK(stub.resets[2] == SG_SCSI_RESET_DEVICE);
+
+    dc_watchdog_stop(watchdog);
+    free_stub_io(io);
+}
+
+static void check_failed_reset(void) {
+    DC_Io *io = stub_io();
+    DC_Watchdog *watchdog = start(io);
+    DC_WatchdogEvent *events;
+
+    __atomic_store_n(&stub.fail_reset, 1, __ATOMIC_RELAXED);
+    hang(io, 42);
+    wait_resets(1);
+    CHECK(__atomic_load_n(&stub.nb_resets, __ATOMIC_ACQUIRE) >= 1);
+    // Event is recorded right after reset returns
+    sleep_ms(HANG_MS / 2);
+    CHECK(dc_watchdog_poll(watchdog, &events) >= 1);
+    CHECK(events[0].action == DC_WatchdogAction_eDeviceReset && events[0].failed && events[0].lba == 42);
+    // Nothing to reopen, device was left as is
+    CHECK(!dc_watchdog_reset_pending(watchdog));
+
+    dc_watchdog_stop(watchdog);
+    free_stub_io(io);
+}
+
+int main(void) {
+    check_escalation();
+    check_failed_reset();
+    return check_summary("watchdog_check");
+}
@@ -10,8 +10,13 @@ void ui_dev_descr_format(char *buf, int bufsize, DC_Dev *dev) {
     primary_cap_print = cap_print = commaprint(dev->capacity, cap_buf, sizeof(cap_buf));
     native_cap_print = commaprint(dev->native_capacity, native_cap_buf, sizeof(native_cap_buf));
 
+    if (dev->probe_state != DC_DevProbeState_eDone) {
+        snprintf(buf, bufsize, "%s %s bytes; %s", dev->model_str ? : "", cap_print,
+                dev->probe_state == DC_DevProbeState_ePending ? "probing..." : "not responding");
+        return;
+    }
     if (!dev->ata_capable) {
-        snprintf(buf, bufsize, "%s %s bytes; non-ATA", dev->model_str, cap_print);
+        snprintf(buf, bufsize, "%s %s bytes; non-ATA", dev->model_str ? : "", cap_print);
         return;
     }
     char warning[50] = "; no HPA";
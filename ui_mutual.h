@@ -4,6 +4,9 @@
 #include "objects_def.h"
 #include "device.h"
 
+// Devices answering within this time are listed with details right away, the rest are filled in later
+#define UI_DEV_LIST_FIRST_WAIT_MS 500
+
 void ui_dev_descr_format(char *buf, int bufsize, DC_Dev *dev);
 
 #endif  // UI_MUTUAL_H